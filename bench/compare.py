@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""Compare benchmark results (see run.py) against a baseline.
+
+A clip regresses when any of these holds:
+- its frame rate drops by more than --threshold
+- its peak RSS grows by more than --threshold
+- the p95 latency of a stage grows by more than --latency-threshold
+  (stages that take less than --min-ms in the baseline are ignored, they're
+  mostly noise)
+
+Prints a table and exits with status 1 if anything regressed. Results from
+another machine or from other player options are compared anyway, with a
+warning.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        results = json.load(f)
+    if results.get("format") != 1:
+        sys.exit("%s: unknown results format" % path)
+    return results
+
+
+def relative(new, old):
+    return (new - old) / old if old else 0.0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("baseline")
+    parser.add_argument("results")
+    parser.add_argument("--threshold", type=float, default=0.10,
+                        help="allowed frame rate loss and RSS growth (default: 0.10 = 10%%)")
+    parser.add_argument("--latency-threshold", type=float, default=0.25,
+                        help="allowed p95 stage latency growth (default: 0.25 = 25%%)")
+    parser.add_argument("--min-ms", type=float, default=0.05,
+                        help="ignore stages faster than this in the baseline (default: 0.05)")
+    args = parser.parse_args()
+
+    baseline, results = load(args.baseline), load(args.results)
+    if baseline["host"] != results["host"]:
+        print("warning: the baseline comes from another machine (%s, %s)" % (
+            baseline["host"].get("node"), baseline["host"].get("cpu")))
+    if baseline["player_args"] != results["player_args"]:
+        print("warning: the baseline was made with other player options: %s" % " ".join(baseline["player_args"]))
+
+    regressions = 0
+    print("%-24s %10s %10s %8s %10s  %s" % ("clip", "base fps", "fps", "change", "RSS MiB", "notes"))
+    for name in sorted(set(baseline["clips"]) | set(results["clips"])):
+        old, new = baseline["clips"].get(name), results["clips"].get(name)
+        if not old or not new:
+            print("%-24s %s" % (name, "not in the baseline" if not old else "not in the results"))
+            continue
+        notes = []
+        fps_change = relative(new["fps"], old["fps"])
+        if fps_change < -args.threshold:
+            notes.append("REGRESSION: frame rate")
+        rss_change = relative(new["peak_rss_mib"], old["peak_rss_mib"])
+        if rss_change > args.threshold:
+            notes.append("REGRESSION: peak RSS %+.0f%%" % (rss_change * 100.0))
+        for stage, old_stage in sorted(old["stages"].items()):
+            new_stage = new["stages"].get(stage)
+            if not new_stage or old_stage["p95_ms"] < args.min_ms:
+                continue
+            change = relative(new_stage["p95_ms"], old_stage["p95_ms"])
+            if change > args.latency_threshold:
+                notes.append("REGRESSION: %s p95 %.3f -> %.3f ms" % (stage, old_stage["p95_ms"], new_stage["p95_ms"]))
+        regressions += any(note.startswith("REGRESSION") for note in notes)
+        print("%-24s %10.1f %10.1f %+7.1f%% %10.1f  %s" % (name, old["fps"], new["fps"], fps_change * 100.0,
+                                                          new["peak_rss_mib"], "; ".join(notes)))
+    print("%d of %d clips regressed" % (regressions, len(results["clips"])))
+    sys.exit(1 if regressions else 0)
+
+
+if __name__ == "__main__":
+    main()
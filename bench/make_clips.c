@@ -0,0 +1,349 @@
+#if 0  // self-compiling code: chmod +x this file and run it like a script
+BINARY=${BINARY:-make_clips}
+gcc -Wall -Wextra -pedantic -Werror ${CFLAGS:--O2 -g} -o $BINARY $0 \
+    `pkg-config libavcodec libavformat libavutil --cflags --libs` || exit 1
+test "$1" = "--compile-only" && exit 0
+exec ./$BINARY $*
+#endif  /*
+
+Test clip generator for the benchmark suite (see run.py): encodes a synthetic
+pattern with the libavcodec encoders that are available, for every
+combination of codec, size and GOP structure, into the given directory.
+The clips are deterministic: same pattern, single-threaded encoders,
+bit-exact flags; so for a given set of encoder versions, they come out
+byte for byte the same on every machine. A clips.json manifest describes
+them for the benchmark runner. Existing clips are kept, unless --force; the
+frame count is part of their names, so a different --frames makes new ones.
+*/
+
+// configuration section
+#define DEFAULT_FRAMES  240  // per clip
+#define FRAME_RATE       30
+#define BITS_PER_PIXEL  0.1  // target bit rate relative to the pixel rate
+#define GOP_LENGTH       60  // frames per GOP, except for all-intra clips
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+#include <libavutil/opt.h>
+
+
+// exit with a simple error message
+void fail(const char *msg) {
+    fprintf(stderr, "ERROR: %s failed\n", msg);
+    exit(1);
+}
+
+// the codecs: the encoders to try, in order of preference, the container,
+// the fastest settings of each encoder, and whether it can do B-frames
+typedef struct ClipCodec {
+    const char *name;
+    const char *encoders[3];
+    const char *extension;
+    const char *options;  // key=value:key=value, for whichever encoder it is
+    bool b_frames;
+} ClipCodec;
+static const ClipCodec clip_codecs[] = {
+    { "mpeg2", { "mpeg2video" },                "ts",   "",                                   true },
+    { "h264",  { "libx264", "libopenh264" },    "mp4",  "preset=veryfast",                    true },
+    { "hevc",  { "libx265" },                   "mkv",  "preset=ultrafast:x265-params=log-level=error", true },
+    { "vp9",   { "libvpx-vp9" },                "webm", "deadline=realtime:cpu-used=8",       false },
+    { "av1",   { "libsvtav1", "libaom-av1" },   "mkv",  "preset=12:cpu-used=8:usage=realtime", false },
+};
+#define NUM_CLIP_CODECS (int)(sizeof(clip_codecs) / sizeof(clip_codecs[0]))
+
+static const struct { int width, height; } clip_sizes[] = {
+    { 1280,  720 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+};
+#define NUM_CLIP_SIZES (int)(sizeof(clip_sizes) / sizeof(clip_sizes[0]))
+
+// GOP structures: all keyframes, keyframe + P-frames, keyframe + 2 B-frames
+// between the P-frames
+enum { GOP_INTRA, GOP_IPP, GOP_IBBP, NUM_GOPS };
+static const char* const gop_names[NUM_GOPS] = { "intra", "ipp", "ibbp" };
+
+typedef struct Options {
+    const char *dir;
+    int frames;
+    const char *codecs;   // comma-separated subset, or NULL for all
+    const char *heights;  // ditto
+    bool force;
+} Options;
+
+void show_help(int argc, char* argv[]) {
+    (void)argc;
+    fprintf(stderr, "Usage: %s [options] <output directory>\n"
+                    "Options:\n"
+                    "  --frames N        frames per clip (default %d)\n"
+                    "  --codecs LIST     only these codecs, e.g. h264,hevc (default: all of\n"
+                    "                    mpeg2, h264, hevc, vp9, av1 that have an encoder)\n"
+                    "  --heights LIST    only these sizes, e.g. 720,1080 (default: 720,1080,2160)\n"
+                    "  --force           re-encode clips that already exist\n",
+                    argv[0], DEFAULT_FRAMES);
+    exit(2);
+}
+
+void parse_options(Options *opts, int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        { "frames",  required_argument, NULL, 'n' },
+        { "codecs",  required_argument, NULL, 'c' },
+        { "heights", required_argument, NULL, 's' },
+        { "force",   no_argument,       NULL, 'f' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    memset(opts, 0, sizeof(*opts));
+    opts->frames = DEFAULT_FRAMES;
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'n': opts->frames = atoi(optarg); break;
+            case 'c': opts->codecs = optarg; break;
+            case 's': opts->heights = optarg; break;
+            case 'f': opts->force = true; break;
+            default:  show_help(argc, argv);
+        }
+    }
+    if ((optind != argc - 1) || (opts->frames < 1)) {
+        show_help(argc, argv);
+    }
+    opts->dir = argv[optind];
+}
+
+// is item in the comma-separated list? (a NULL list has everything)
+static bool in_list(const char *list, const char *item) {
+    if (!list) {
+        return true;
+    }
+    size_t len = strlen(item);
+    for (const char *p = list;  p;  p = strchr(p, ',') ? (strchr(p, ',') + 1) : NULL) {
+        if (!strncmp(p, item, len) && ((p[len] == ',') || (p[len] == '\0'))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the test pattern: a diagonal gradient that scrolls, a box that bounces
+// around, and a bit of noise, so that there's motion, flat areas, edges and
+// texture to encode. the noise comes from a fixed-seed xorshift, so every
+// frame is the same on every run.
+static void draw_pattern(AVFrame *frame, int n) {
+    const int w = frame->width, h = frame->height;
+    uint32_t rng = 0x9e3779b9u ^ (uint32_t)n;
+    const int box = h / 4;
+    int bx = (n * 7) % (2 * (w - box)), by = (n * 5) % (2 * (h - box));
+    if (bx >= w - box) { bx = 2 * (w - box) - bx; }
+    if (by >= h - box) { by = 2 * (h - box) - by; }
+    for (int y = 0;  y < h;  ++y) {
+        uint8_t *row = frame->data[0] + (size_t)y * frame->linesize[0];
+        bool box_row = (y >= by) && (y < by + box);
+        for (int x = 0;  x < w;  ++x) {
+            rng ^= rng << 13;  rng ^= rng >> 17;  rng ^= rng << 5;
+            int v = ((x + y + 4 * n) * 255 / (w + h)) & 0xff;
+            if (box_row && (x >= bx) && (x < bx + box)) {
+                v = ((x - bx) ^ (y - by)) & 0x20 ? 235 : 16;  // a checkerboard
+            }
+            v += (int)(rng & 7) - 4;
+            row[x] = (uint8_t)((v < 0) ? 0 : (v > 255) ? 255 : v);
+        }
+    }
+    for (int plane = 1;  plane < 3;  ++plane) {
+        for (int y = 0;  y < h / 2;  ++y) {
+            uint8_t *row = frame->data[plane] + (size_t)y * frame->linesize[plane];
+            for (int x = 0;  x < w / 2;  ++x) {
+                row[x] = (uint8_t)(128 + ((plane == 1) ? ((x - n) & 63) : ((y + n) & 63)) - 32);
+            }
+        }
+    }
+}
+
+// send a frame (NULL = flush) to the encoder, and write what comes out
+static void encode_and_write(AVCodecContext *enc, AVFormatContext *out, AVStream *st, const AVFrame *frame,
+                             AVPacket *packet) {
+    if (avcodec_send_frame(enc, frame) < 0) {
+        fail("avcodec_send_frame");
+    }
+    for (;;) {
+        int ret = avcodec_receive_packet(enc, packet);
+        if ((ret == AVERROR(EAGAIN)) || (ret == AVERROR_EOF)) {
+            return;
+        }
+        if (ret < 0) {
+            fail("avcodec_receive_packet");
+        }
+        av_packet_rescale_ts(packet, enc->time_base, st->time_base);
+        packet->stream_index = st->index;
+        if (av_interleaved_write_frame(out, packet) < 0) {
+            fail("av_interleaved_write_frame");
+        }
+    }
+}
+
+// encode one clip into tmp_path (path only decides the container);
+// returns false if the encoder refused the settings
+static bool make_clip(const char *path, const char *tmp_path, const AVCodec *encoder, const ClipCodec *codec, int width, int height,
+                      int gop, int frames) {
+    AVFormatContext *out = NULL;
+    if (avformat_alloc_output_context2(&out, NULL, NULL, path) < 0) {
+        fail("avformat_alloc_output_context2");
+    }
+    out->flags |= AVFMT_FLAG_BITEXACT;
+    AVCodecContext *enc = avcodec_alloc_context3(encoder);
+    if (!enc) {
+        fail("avcodec_alloc_context3");
+    }
+    enc->width = width;
+    enc->height = height;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->time_base = (AVRational){ 1, FRAME_RATE };
+    enc->framerate = (AVRational){ FRAME_RATE, 1 };
+    enc->bit_rate = (int64_t)(width * height * FRAME_RATE * BITS_PER_PIXEL);
+    enc->gop_size = (gop == GOP_INTRA) ? 1 : GOP_LENGTH;
+    enc->max_b_frames = (gop == GOP_IBBP) ? 2 : 0;
+    enc->thread_count = 1;  // threads would make the output depend on timing
+    enc->flags |= AV_CODEC_FLAG_BITEXACT;
+    if (out->oformat->flags & AVFMT_GLOBALHEADER) {
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    AVDictionary *options = NULL;
+    if (av_dict_parse_string(&options, codec->options, "=", ":", 0) < 0) {
+        fail("av_dict_parse_string");
+    }
+    int ret = avcodec_open2(enc, encoder, &options);
+    av_dict_free(&options);  // whatever's left didn't apply to this encoder
+    if (ret < 0) {
+        avcodec_free_context(&enc);
+        avformat_free_context(out);
+        return false;
+    }
+
+    AVStream *st = avformat_new_stream(out, NULL);
+    if (!st || (avcodec_parameters_from_context(st->codecpar, enc) < 0)) {
+        fail("avformat_new_stream");
+    }
+    st->time_base = enc->time_base;
+    st->avg_frame_rate = enc->framerate;
+    if (!(out->oformat->flags & AVFMT_NOFILE) && (avio_open(&out->pb, tmp_path, AVIO_FLAG_WRITE) < 0)) {
+        fail("avio_open");
+    }
+    if (avformat_write_header(out, NULL) < 0) {
+        fail("avformat_write_header");
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *packet = av_packet_alloc();
+    if (!frame || !packet) {
+        fail("allocation");
+    }
+    frame->width = width;
+    frame->height = height;
+    frame->format = AV_PIX_FMT_YUV420P;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        fail("av_frame_get_buffer");
+    }
+    for (int n = 0;  n < frames;  ++n) {
+        if (av_frame_make_writable(frame) < 0) {
+            fail("av_frame_make_writable");
+        }
+        draw_pattern(frame, n);
+        frame->pts = n;
+        encode_and_write(enc, out, st, frame, packet);
+    }
+    encode_and_write(enc, out, st, NULL, packet);
+    if (av_write_trailer(out) < 0) {
+        fail("av_write_trailer");
+    }
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&enc);
+    if (!(out->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&out->pb);
+    }
+    avformat_free_context(out);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    parse_options(&opts, argc, argv);
+    mkdir(opts.dir, 0755);
+
+    char manifest_path[4096];
+    snprintf(manifest_path, sizeof(manifest_path), "%s/clips.json", opts.dir);
+    FILE *manifest = fopen(manifest_path, "w");
+    if (!manifest) {
+        fail("fopen");
+    }
+    fprintf(manifest, "{\"frames\": %d, \"frame_rate\": %d, \"clips\": [", opts.frames, FRAME_RATE);
+    int made = 0, kept = 0, listed = 0;
+    for (int c = 0;  c < NUM_CLIP_CODECS;  ++c) {
+        const ClipCodec *codec = &clip_codecs[c];
+        if (!in_list(opts.codecs, codec->name)) {
+            continue;
+        }
+        const AVCodec *encoder = NULL;
+        for (int e = 0;  (e < 3) && codec->encoders[e] && !encoder;  ++e) {
+            encoder = avcodec_find_encoder_by_name(codec->encoders[e]);
+        }
+        if (!encoder) {
+            printf("%s: no encoder available, skipping\n", codec->name);
+            continue;
+        }
+        for (int s = 0;  s < NUM_CLIP_SIZES;  ++s) {
+            char height[16];
+            snprintf(height, sizeof(height), "%d", clip_sizes[s].height);
+            if (!in_list(opts.heights, height)) {
+                continue;
+            }
+            for (int g = 0;  g < NUM_GOPS;  ++g) {
+                if ((g == GOP_IBBP) && !codec->b_frames) {
+                    continue;
+                }
+                char name[64], path[4096], tmp_path[4096 + 16];
+                snprintf(name, sizeof(name), "%s_%dp_%s_%df.%s", codec->name, clip_sizes[s].height, gop_names[g],
+                         opts.frames, codec->extension);
+                snprintf(path, sizeof(path), "%s/%s", opts.dir, name);
+                snprintf(tmp_path, sizeof(tmp_path), "%s.partial", path);
+                struct stat st;
+                if (!opts.force && !stat(path, &st) && (st.st_size > 0)) {
+                    kept++;
+                } else {
+                    printf("%s (%s) ... ", name, encoder->name);
+                    fflush(stdout);
+                    if (!make_clip(path, tmp_path, encoder, codec, clip_sizes[s].width, clip_sizes[s].height, g,
+                                   opts.frames)) {
+                        printf("the encoder refused these settings, skipping\n");
+                        continue;
+                    }
+                    if (rename(tmp_path, path)) {
+                        fail("rename");
+                    }
+                    printf("done\n");
+                    made++;
+                }
+                fprintf(manifest, "%s\n  {\"file\": \"%s\", \"codec\": \"%s\", \"encoder\": \"%s\", "
+                                  "\"width\": %d, \"height\": %d, \"gop\": \"%s\"}",
+                        listed++ ? "," : "", name, codec->name, encoder->name,
+                        clip_sizes[s].width, clip_sizes[s].height, gop_names[g]);
+            }
+        }
+    }
+    fprintf(manifest, "\n]}\n");
+    fclose(manifest);
+    printf("%d clips made, %d already there; manifest in %s\n", made, kept, manifest_path);
+    return 0;
+}
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""Benchmark runner.
+
+Builds the player without AddressSanitizer and makes the test clips (see
+make_clips.c), unless they're already there. Then it plays every clip
+headless with software decoding, i.e. demux + decode + upload + convert
+as fast as possible, a few times over. The results go into a JSON file:
+- frames per second (the median run)
+- per-stage latencies (from --stats-json)
+- peak RSS
+
+compare.py checks the results against a baseline. To make one, run this
+on the reference machine with --output bench/baseline.json.
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import re
+import statistics
+import subprocess
+import sys
+
+BENCH = os.path.dirname(os.path.abspath(__file__))
+REPO = os.path.dirname(BENCH)
+PLAYER = "vaapi_egl_interop_example_bench"
+CLIP_MAKER = "make_clips"
+CFLAGS = "-O2 -g"
+
+HEADLESS_RE = re.compile(r"headless: (\d+) frames in ([\d.]+) s, ([\d.]+) frames/s")
+
+
+def build(source_dir, source, binary):
+    env = dict(os.environ, CFLAGS=CFLAGS, BINARY=binary)
+    subprocess.run(["bash", source, "--compile-only"], cwd=source_dir, env=env, check=True)
+
+
+def host_info():
+    cpu = platform.processor()
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    cpu = line.split(":", 1)[1].strip()
+                    break
+    except OSError:
+        pass
+    return {"node": platform.node(), "machine": platform.machine(), "kernel": platform.release(),
+            "cpu": cpu, "cpus": os.cpu_count()}
+
+
+def git_commit():
+    try:
+        return subprocess.run(["git", "rev-parse", "--short", "HEAD"], cwd=REPO, capture_output=True,
+                              text=True, check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def run_once(clip, log_path, stats_path, extra_args):
+    """Play a clip once; returns (fps, frames, peak RSS in MiB, stage latencies)."""
+    cmd = [os.path.join(REPO, PLAYER), "--headless", "--software", "--stats-json", stats_path]
+    cmd += extra_args + [clip]
+    with open(log_path, "w") as log:
+        proc = subprocess.Popen(cmd, cwd=REPO, stdout=log, stderr=subprocess.STDOUT)
+        # wait4() gives us the resource usage of just this child
+        _, status, rusage = os.wait4(proc.pid, 0)
+        proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode != 0:
+        raise RuntimeError("%s exited with %d, see %s" % (" ".join(cmd), proc.returncode, log_path))
+    with open(log_path, errors="replace") as log:
+        match = HEADLESS_RE.search(log.read())
+    if not match:
+        raise RuntimeError("no frame rate in %s" % log_path)
+    with open(stats_path) as f:
+        stages = {name: {k: v for k, v in stage.items() if k != "count"}
+                  for name, stage in json.load(f)["stages"].items() if stage["count"]}
+    return float(match.group(3)), int(match.group(1)), rusage.ru_maxrss / 1024.0, stages
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--clips", default=os.path.join(BENCH, "clips"), help="clip directory (default: bench/clips)")
+    parser.add_argument("--output", default=os.path.join(BENCH, "results.json"),
+                        help="results file (default: bench/results.json)")
+    parser.add_argument("--repeat", type=int, default=3, help="runs per clip (default: 3)")
+    parser.add_argument("--frames", type=int, help="frames per clip, if they need to be made")
+    parser.add_argument("--codecs", help="only these codecs, e.g. h264,hevc")
+    parser.add_argument("--heights", help="only these sizes, e.g. 720,1080")
+    parser.add_argument("--filter", default="", help="only clips whose name contains this")
+    parser.add_argument("--no-build", action="store_true", help="use the binaries that are there")
+    parser.add_argument("player_args", nargs="*", help="extra player options (after --)")
+    args = parser.parse_args()
+
+    if not args.no_build:
+        build(REPO, "vaapi_egl_interop_example.c", PLAYER)
+        build(BENCH, "make_clips.c", CLIP_MAKER)
+    make_cmd = [os.path.join(BENCH, CLIP_MAKER)]
+    if args.frames:
+        make_cmd += ["--frames", str(args.frames)]
+    if args.codecs:
+        make_cmd += ["--codecs", args.codecs]
+    if args.heights:
+        make_cmd += ["--heights", args.heights]
+    subprocess.run(make_cmd + [args.clips], check=True)
+    with open(os.path.join(args.clips, "clips.json")) as f:
+        manifest = json.load(f)
+
+    log_dir = os.path.join(os.path.dirname(os.path.abspath(args.output)), "logs")
+    os.makedirs(log_dir, exist_ok=True)
+    results = {
+        "format": 1,
+        "date": datetime.datetime.now().isoformat(timespec="seconds"),
+        "commit": git_commit(),
+        "host": host_info(),
+        "player_args": ["--headless", "--software"] + args.player_args,
+        "clips": {},
+    }
+    for clip in manifest["clips"]:
+        name = os.path.splitext(clip["file"])[0]
+        if args.filter not in name:
+            continue
+        runs = []
+        for n in range(args.repeat):
+            base = os.path.join(log_dir, "%s.%d" % (name, n))
+            runs.append(run_once(os.path.join(os.path.abspath(args.clips), clip["file"]), base + ".log",
+                                 base + ".json", args.player_args))
+        runs.sort(key=lambda run: run[0])
+        fps, frames, _, stages = runs[len(runs) // 2]
+        results["clips"][name] = {
+            "codec": clip["codec"], "encoder": clip["encoder"], "width": clip["width"], "height": clip["height"],
+            "gop": clip["gop"], "frames": frames,
+            "fps": fps,
+            "fps_runs": [run[0] for run in runs],
+            "peak_rss_mib": max(run[2] for run in runs),
+            "stages": stages,
+        }
+        spread = (runs[-1][0] - runs[0][0]) / fps * 100.0 if fps else 0.0
+        print("%-24s %8.1f fps (%.0f%% spread)  %7.1f MiB" % (name, fps, spread,
+                                                              results["clips"][name]["peak_rss_mib"]))
+    if not results["clips"]:
+        sys.exit("no clips to run")
+    with open(args.output, "w") as f:
+        json.dump(results, f, indent=1, sort_keys=True)
+        f.write("\n")
+    print("results in %s; geometric mean %.1f fps" % (
+        args.output, statistics.geometric_mean([c["fps"] for c in results["clips"].values()])))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,8 +1,8 @@
 #if 0  // self-compiling code: chmod +x this file and run it like a script
-BINARY=vaapi_egl_interop_example
-gcc -Wall -Wextra -pedantic -Werror -g -fsanitize=address -o $BINARY $0 \
+BINARY=${BINARY:-vaapi_egl_interop_example}
+gcc -Wall -Wextra -pedantic -Werror ${CFLAGS:--g -fsanitize=address} -o $BINARY $0 \
     `pkg-config libavcodec libavformat libavutil libva gl egl libdrm --cflags --libs` \
-    -lX11 -lva-x11 -lva-drm || exit 1
+    -lX11 -lva-x11 -lva-drm -pthread || exit 1
 test "$1" = "--compile-only" && exit 0
 exec env ASAN_OPTIONS=fast_unwind_on_malloc=0 ./$BINARY $*
 #endif  /*
@@ -10,28 +10,128 @@ exec env ASAN_OPTIONS=fast_unwind_on_malloc=0 ./$BINARY $*
 Minimal example application for hardware video decoding on Linux and display
 over VA-API/EGL interoperability into an X11 window. This is essentially how
 MPV, Kodi etc. work, just in very condensed and easier-to-understand form.
-Takes a video file as an argument and plays it back in a window, without audio,
-and without time synchronization (i.e. it will play at whatever rate the GPU
-can decode the frames, or at VSync rate).
+Takes a video file as an argument and plays it back in a window, without audio.
+Frames are presented according to their timestamps, and if decoding can't
+keep up, the decoder skips more and more frames until it can; with
+--no-pacing, it plays at whatever rate the GPU can decode the frames, or at
+VSync rate. The arrow keys seek; with --index, the keyframes of the inputs
+are indexed in the background, so that seeks go straight to the right one.
+If VA-API isn't available or can't decode the stream, it falls back to
+software decoding and uploads the frames through pixel buffer objects.
+Given several inputs, it decodes all of them in parallel and shows them as a
+mosaic in a single window. They share one VA-API device, or, given several
+render nodes, are spread across them by codec support and load, and moved to
+another device when theirs can't keep up.
+With --playlist, the inputs are played one after another instead, and with
+--loop, over and over again. Each input is opened in the background while
+the previous one plays, and the decoder (and everything on the GL side) is
+kept if the codec parameters stay the same, so that there's no gap between
+them; how long it really is gets measured.
+With --headless, no X server is needed: VA-API is opened on a DRM render
+node, frames are rendered into an offscreen framebuffer as fast as possible,
+and the achieved frame rate is printed at the end.
+The time to the first frame is printed, broken down by startup phase; with
+--fast-start, the inputs are probed while the display is being set up.
+With --thumbnails, a downscaled copy of every frame is read back to the CPU
+asynchronously, e.g. for analysis; a simple motion meter is built in.
+With --metrics or --metrics-socket, live playback metrics are available in
+the Prometheus text format.
+With --live, it's tuned for live sources such as cameras: no buffering or
+long probing, low-delay decoding, always the newest frame on screen, and the
+time from the arrival of each packet to the swap that shows its frame is
+measured. A FIFO makes a good stand-in for a camera:
+  mkfifo /tmp/cam
+  ffmpeg -re -f lavfi -i testsrc2=size=1280x720:rate=30 -c:v libx264 \
+         -tune zerolatency -f mpegts /tmp/cam &
+  ./vaapi_egl_interop_example.c --live /tmp/cam
+(MPEG-TS rather than raw H.264, whose parser only completes a packet when
+the next one starts.)
+bench/run.py measures the software decode path over a set of synthetic
+clips, and bench/compare.py checks the results against a baseline.
+--self-test checks the interop cache and the frame fence logic against fake
+backends, without a GPU, and exits with a non-zero status if anything is off.
 */
 
 // configuration section: switch between the many parts that are implemented
-// in two or more possible ways in this program
-#define USE_LAYERS       1  // 0 = use VA_EXPORT_SURFACE_COMPOSED_LAYERS
-                            // 1 = use VA_EXPORT_SURFACE_SEPARATE_LAYERS
-#define SWAP_INTERVAL    2  // 0 = decode and display as fast as possible
-                            // 1 = run at VSync framerate (typically 60 Hz)
-                            // 2 = run at half VSync framerate (30 Hz)
-// (*) this currently crashes due to bugs(?) somewhere in the Mesa stack
-
-// request OpenGL 3.3 for Core Profile
-#define CORE_PROFILE_MAJOR_VERSION 3
-#define CORE_PROFILE_MINOR_VERSION 3
+// in two or more possible ways in this program. the interop mode, swap
+// interval and OpenGL version are command-line options (see show_help()).
+#define INTEROP_PROBE_ROUNDS 16  // export/import rounds per mode for --interop=auto
+
+// depth of the queues between the demux, decode and display threads
+#define PACKET_QUEUE_DEPTH  32  // compressed packets (default for --packet-queue)
+#define FRAME_QUEUE_DEPTH    4  // decoded frames, each one pins a VA surface! (--frame-queue)
+#define MAX_QUEUE_DEPTH   1024  // upper limit for both
+#define PBO_RING_SIZE        3  // pixel buffer objects for software decoding
+#define MAX_FRAMES_IN_FLIGHT 4  // upper limit for --frames-in-flight
+#define SERVER_HELD_FRAMES   8  // frames all --serve subscribers together can hold
+#define SERVER_QUEUE_DEPTH   4  // frames waiting for the frame server thread
+#define INTEROP_CACHE_SIZE  64  // VA surfaces the interop cache keeps imported
+#define DECODER_SURFACES    20  // the decoder's own surface pool, at most (16 references + 4)
+// frames held for display or by the frame server, at most: the whole surface
+// pool (see populate_context()) has to fit the interop cache, so this limits
+// --frame-queue
+#define MAX_HELD_FRAMES (INTEROP_CACHE_SIZE - DECODER_SURFACES - 4 - MAX_FRAMES_IN_FLIGHT)
+#define THUMBNAIL_RING_SIZE  3  // --thumbnails readback buffers per stream
+#define MAX_STREAMS         64  // maximum number of inputs in a mosaic
+#define ALLOC_WARMUP_FRAMES 100  // frames before --count-allocs starts counting
+#define FAST_PROBE_SIZE     (256 * 1024)  // --fast-start probing limit in bytes ...
+#define FAST_ANALYZE_MS     500           // ... and in stream time
+#define LIVE_PROBE_SIZE     (32 * 1024)   // --live probing limit in bytes ...
+#define LIVE_ANALYZE_MS     100           // ... and in stream time
+#define PARAM_CACHE_MAX_EXTRADATA 4096  // bigger codec headers aren't cached
+#define IO_BUFFER_SIZE      (256 * 1024)  // demuxer buffer for --io mmap/readahead
+#define READAHEAD_CHUNK_SIZE (4 << 20)    // bytes per read for --io readahead ...
+#define READAHEAD_CHUNKS    8             // ... and how many chunks it reads ahead
+
+#define ENABLE_PROBES        1  // 0 = compile out the per-stage latency probes
+#define METRICS_INTERVAL_MS 1000  // how often --metrics rewrites its file
+#define METRICS_BUFFER_SIZE (256 * 1024)  // room for the metrics text
+#define PROGRESS_INTERVAL_MS 1000  // how often the decode thread prints its frame count
+
+// presentation scheduling
+#define LATE_THRESHOLD_MS   20  // frames shown later than this count as late
+#define RESYNC_THRESHOLD_MS 1000  // restart the clock if a frame is off by more
+
+// seeking with the arrow keys: left/right by this many seconds, down/up by
+// six times as much
+#define SEEK_STEP_SECONDS   10
+
+// adaptive skip_frame control (see SkipControl)
+#define SKIP_INTERVAL_MS    250   // how often the controller decides
+#define SKIP_LOAD_HIGH      0.90  // decode thread load that counts as overload ...
+#define SKIP_LOAD_LOW       0.50  // ... and that leaves room to skip fewer frames
+#define SKIP_RECOVER_INTERVALS 8  // healthy intervals before stepping back up,
+#define SKIP_MAX_RECOVER_INTERVALS 64  // doubled every time that fails
+
+// decoding devices, and the scheduler that spreads the streams across them
+#define MAX_DEVICES          8    // render nodes that can be given
+#define MAX_DEVICE_CODECS   16
+#define DEVICE_MAX_SESSIONS 16    // default for --sessions
+#define SCHED_INTERVAL_MS   1000  // how often the scheduler rebalances
+#define SCHED_HOLDOFF_INTERVALS 5  // intervals a stream stays put after a move
+#define SCHED_DEVICE_PIXEL_RATE (3840.0 * 2160 * 60)  // assumed decoding rate of a device, until measured
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include <getopt.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -41,9 +141,11 @@ can decode the frames, or at VSync rate).
 #include <libavformat/avformat.h>
 #include <libavutil/hwcontext.h>
 #include <libavutil/hwcontext_vaapi.h>
+#include <libavutil/pixdesc.h>
 
 #include <va/va.h>
 #include <va/va_x11.h>
+#include <va/va_drm.h>
 #include <va/va_drmcommon.h>
 
 #include <drm_fourcc.h>
@@ -67,11 +169,257 @@ void fail(const char *msg) {
     exit(1);
 }
 
+// look up required EGL and OpenGL extension functions
+#define LOOKUP_FUNCTION(type, func) \
+    type func = (type) eglGetProcAddress(#func); \
+    if (!func) { fail("eglGetProcAddress(" #func ")"); }
+
+// monotonic clock in nanoseconds
+static inline int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// per-stage latency histograms. with several streams, the threads of all of
+// them record into the same stages, so the updates are relaxed atomic
+// read-modify-writes (uncontended most of the time, as the stages of one
+// pipeline run on different threads). buckets are log-linear: 8 sub-buckets
+// per power of two of microseconds, which gives percentiles with <= 12.5% error.
+#define FOR_EACH_STAGE(X) \
+    X(DEMUX,         "demux")          \
+    X(SEND_PACKET,   "send_packet")    \
+    X(RECEIVE_FRAME, "receive_frame")  \
+    X(EXPORT,        "export")         \
+    X(SYNC,          "sync")           \
+    X(IMPORT,        "import")         \
+    X(UPLOAD,        "upload")         \
+    X(DRAW,          "draw")           \
+    X(THUMBNAIL,     "thumbnail")      \
+    X(READBACK,      "readback")       \
+    X(SEEK,          "seek")           \
+    X(SWAP,          "swap")           \
+    X(FRAME,         "frame")          \
+    X(ARRIVAL,       "arrival_to_swap") \
+    X(CLIP_GAP,      "clip_gap")
+#define DECLARE_STAGE_ENUM(id, name) STAGE_##id,
+enum { FOR_EACH_STAGE(DECLARE_STAGE_ENUM) NUM_STAGES };
+#define DECLARE_STAGE_NAME(id, name) name,
+static const char* const stage_names[NUM_STAGES] = { FOR_EACH_STAGE(DECLARE_STAGE_NAME) };
+
+#define LATENCY_BUCKETS 416  // enough for any 64-bit nanosecond value
+typedef struct LatencyHistogram {
+    _Atomic uint64_t count, sum_ns, max_ns;
+    _Atomic uint64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+LatencyHistogram stage_latency[NUM_STAGES];
+
+#define RELAXED_ADD(var, val) atomic_fetch_add_explicit(&(var), (val), memory_order_relaxed)
+
+static inline int latency_bucket(uint64_t ns) {
+    uint64_t us = ns >> 10;  // close enough to microseconds
+    if (us < 8) {
+        return (int)us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    return (msb - 2) * 8 + (int)((us >> (msb - 3)) & 7);
+}
+
+// upper bound of a bucket, in nanoseconds
+static uint64_t latency_bucket_limit(int bucket) {
+    if (bucket < 8) {
+        return (uint64_t)(bucket + 1) << 10;
+    }
+    int msb = bucket / 8 + 2;
+    return ((uint64_t)(8 + bucket % 8 + 1) << (msb - 3)) << 10;
+}
+
+static inline void latency_record(LatencyHistogram *h, int64_t ns) {
+    if (ns < 0) { ns = 0; }
+    RELAXED_ADD(h->count, 1);
+    RELAXED_ADD(h->sum_ns, (uint64_t)ns);
+    RELAXED_ADD(h->buckets[latency_bucket(ns)], 1);
+    uint64_t max_ns = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    while (((uint64_t)ns > max_ns)
+    &&     !atomic_compare_exchange_weak_explicit(&h->max_ns, &max_ns, (uint64_t)ns, memory_order_relaxed,
+                                                  memory_order_relaxed)) {}
+}
+
+// probes around a stage; PROBE_BEGIN and PROBE_END must be in the same scope
+#if ENABLE_PROBES
+    #define PROBE_BEGIN(stage) const int64_t probe_t0_##stage = now_ns()
+    #define PROBE_END(stage)   latency_record(&stage_latency[STAGE_##stage], now_ns() - probe_t0_##stage)
+#else
+    #define PROBE_BEGIN(stage) ((void)0)
+    #define PROBE_END(stage)   ((void)0)
+#endif
+
+static double latency_percentile_ms(const uint64_t *buckets, uint64_t count, int percent) {
+    uint64_t rank = (count * (uint64_t)percent + 99) / 100, seen = 0;
+    for (int i = 0;  i < LATENCY_BUCKETS;  ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return latency_bucket_limit(i) * 1e-6;
+        }
+    }
+    return 0.0;
+}
+
+// copy the buckets of a histogram that may still be updated; returns the
+// number of values in the copy
+static uint64_t latency_snapshot(const LatencyHistogram *h, uint64_t buckets[LATENCY_BUCKETS]) {
+    uint64_t count = 0;
+    for (int i = 0;  i < LATENCY_BUCKETS;  ++i) {
+        buckets[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        count += buckets[i];
+    }
+    return count;
+}
+
+// write all stage latencies as a JSON object
+void dump_latency_json(FILE *f, double uptime_s) {
+    fprintf(f, "{\"uptime_s\": %.3f, \"stages\": {", uptime_s);
+    for (int s = 0;  s < NUM_STAGES;  ++s) {
+        const LatencyHistogram *h = &stage_latency[s];
+        uint64_t buckets[LATENCY_BUCKETS];
+        uint64_t count = latency_snapshot(h, buckets);
+        fprintf(f, "%s\n  \"%s\": {\"count\": %llu, \"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f}",
+                s ? "," : "", stage_names[s], (unsigned long long)count,
+                count ? (atomic_load(&h->sum_ns) * 1e-6 / count) : 0.0,
+                latency_percentile_ms(buckets, count, 50),
+                latency_percentile_ms(buckets, count, 95),
+                latency_percentile_ms(buckets, count, 99),
+                atomic_load(&h->max_ns) * 1e-6);
+    }
+    fprintf(f, "\n}}\n");
+}
+
+// write the latency JSON to stdout, or (atomically) replace a file with it
+void save_latency_json(const char *path, double uptime_s) {
+    if (!ENABLE_PROBES) {
+        return;
+    }
+    if (!path) {
+        dump_latency_json(stdout, uptime_s);
+        return;
+    }
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        fprintf(stderr, "can't write %s\n", tmp_path);
+        return;
+    }
+    dump_latency_json(f, uptime_s);
+    fclose(f);
+    rename(tmp_path, path);
+}
+
+// allocation counting for --count-allocs: AddressSanitizer (which the build
+// command at the top enables) can call a hook for every allocation, which we
+// use to count them per thread role, to see what the steady state still
+// allocates. the demux thread can't get below one allocation per packet:
+// av_read_frame() allocates the payload of every packet, and there's no way
+// to make it use a pool. without ASan, the hook API isn't there.
+enum { ALLOC_ROLE_NONE = -1, ALLOC_ROLE_DEMUX, ALLOC_ROLE_DECODE, ALLOC_ROLE_DISPLAY, NUM_ALLOC_ROLES };
+static const char* const alloc_role_names[NUM_ALLOC_ROLES] = { "demux", "decode", "display" };
+_Atomic uint64_t alloc_counts[NUM_ALLOC_ROLES];
+static _Thread_local int alloc_role = ALLOC_ROLE_NONE;
+
+extern int __sanitizer_install_malloc_and_free_hooks(void (*malloc_hook)(const volatile void *ptr, size_t size),
+                                                     void (*free_hook)(const volatile void *ptr)) __attribute__((weak));
+
+static void count_malloc(const volatile void *ptr, size_t size) {
+    (void)ptr, (void)size;
+    if (alloc_role != ALLOC_ROLE_NONE) {
+        atomic_fetch_add_explicit(&alloc_counts[alloc_role], 1, memory_order_relaxed);
+    }
+}
+
+static void count_free(const volatile void *ptr) {
+    (void)ptr;
+}
+
+bool install_alloc_counter(void) {
+    return __sanitizer_install_malloc_and_free_hooks
+        && __sanitizer_install_malloc_and_free_hooks(count_malloc, count_free);
+}
+
+// startup phases for the time-to-first-frame report; phases that run once
+// per stream span from the earliest start to the latest end
+#define FOR_EACH_STARTUP_PHASE(X) \
+    X(DISPLAY,       "display")        \
+    X(OPEN_INPUT,    "open input")     \
+    X(STREAM_INFO,   "stream info")    \
+    X(DECODER,       "decoder open")   \
+    X(EGL,           "window/EGL")     \
+    X(SHADER,        "shaders")        \
+    X(INTEROP_PROBE, "interop probe")  \
+    X(FIRST_DECODE,  "first decode")   \
+    X(FIRST_PRESENT, "first present")
+#define DECLARE_STARTUP_ENUM(id, name) STARTUP_##id,
+enum { FOR_EACH_STARTUP_PHASE(DECLARE_STARTUP_ENUM) NUM_STARTUP_PHASES };
+#define DECLARE_STARTUP_NAME(id, name) name,
+static const char* const startup_phase_names[NUM_STARTUP_PHASES] = { FOR_EACH_STARTUP_PHASE(DECLARE_STARTUP_NAME) };
+
+typedef struct StartupPhase {
+    _Atomic int64_t begin, end;  // now_ns() timestamps, 0 = not yet
+} StartupPhase;
+StartupPhase startup_phases[NUM_STARTUP_PHASES];
+int64_t startup_t0;  // when main() started
+static _Thread_local bool outside_startup;  // set on threads that only work for later inputs
+
+void startup_phase_begin(int phase) {
+    if (outside_startup) {
+        return;
+    }
+    int64_t unset = 0;
+    atomic_compare_exchange_strong(&startup_phases[phase].begin, &unset, now_ns());
+}
+
+void startup_phase_end(int phase) {
+    if (outside_startup) {
+        return;
+    }
+    int64_t t = now_ns();
+    int64_t end = atomic_load(&startup_phases[phase].end);
+    while ((t > end) && !atomic_compare_exchange_weak(&startup_phases[phase].end, &end, t)) {}
+}
+
+void dump_startup_phases(int64_t t_first_frame) {
+    printf("\ntime to first frame: %.1f ms\n", (t_first_frame - startup_t0) * 1e-6);
+    for (int i = 0;  i < NUM_STARTUP_PHASES;  ++i) {
+        int64_t begin = atomic_load(&startup_phases[i].begin);
+        int64_t end   = atomic_load(&startup_phases[i].end);
+        if (!begin || !end) {
+            continue;  // phase didn't run
+        }
+        printf("  %-14s %8.1f .. %8.1f ms (%.1f ms)\n", startup_phase_names[i],
+               (begin - startup_t0) * 1e-6, (end - startup_t0) * 1e-6, (end - begin) * 1e-6);
+    }
+}
+
 // callback to negotiate the output pixel format.
-// we don't negotiate here, we just want VA-API.
+// we want VA-API if the decoder offers it for this stream; otherwise, we
+// take the first software format and decode on the CPU.
+static int software_plane_layout(int format);
+
 static enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts) {
-    (void)ctx, (void)pix_fmts;
-    return AV_PIX_FMT_VAAPI;
+    const enum AVPixelFormat *p;
+    for (p = pix_fmts;  *p != AV_PIX_FMT_NONE;  ++p) {
+        if ((*p == AV_PIX_FMT_VAAPI) && ctx->hw_device_ctx) {
+            return AV_PIX_FMT_VAAPI;
+        }
+    }
+    for (p = pix_fmts;  *p != AV_PIX_FMT_NONE;  ++p) {
+        if (software_plane_layout(*p) >= 0) {
+            printf("VA-API not available for this stream, decoding %s in software\n", av_get_pix_fmt_name(*p));
+            return *p;
+        }
+    }
+    fprintf(stderr, "VA-API not available for this stream, and %s frames can't be displayed\n",
+            av_get_pix_fmt_name(ctx->sw_pix_fmt));
+    return AV_PIX_FMT_NONE;
 }
 
 // configure a single OpenGL texture
@@ -82,23 +430,383 @@ static void setup_texture() {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 }
 
-// set a suitable OpenGL viewport for a specified window size
-static void resize_window(int screen_width, int screen_height, const AVCodecContext* ctx) {
+// compute a suitable OpenGL viewport for a video inside a screen area
+static void fit_viewport(int screen_x, int screen_y, int screen_width, int screen_height,
+                         const AVCodecContext* ctx, int viewport[4]) {
     int display_width = screen_width;
     int display_height = (screen_width * ctx->height + ctx->width / 2) / ctx->width;
     if (display_height > screen_height) {
         display_width = (screen_height * ctx->width + ctx->height / 2) / ctx->height;
         display_height = screen_height;
     }
-    glViewport((screen_width  - display_width)  / 2,
-               (screen_height - display_height) / 2,
-               display_width, display_height);
+    viewport[0] = screen_x + (screen_width  - display_width)  / 2;
+    viewport[1] = screen_y + (screen_height - display_height) / 2;
+    viewport[2] = display_width;
+    viewport[3] = display_height;
 }
 
+// how to export VA surfaces: as one layer per plane (R8 + GR88), or as one
+// composed layer with two planes; auto = find out which is faster at startup
+enum { INTEROP_AUTO = -1, INTEROP_COMPOSED = 0, INTEROP_SEPARATE = 1 };
+static const char* const interop_mode_names[2] = { "composed layers", "separate layers" };
+
+// what the frame server does with a frame a subscriber can't take yet:
+// skip it for that subscriber, or wait a bit for the subscriber
+enum { SUBSCRIBE_DROP, SUBSCRIBE_BLOCK };
+static const char* const subscribe_policy_names[2] = { "drop", "block" };
+
+// how local input files are read (see InputIO)
+enum { IO_FFMPEG, IO_MMAP, IO_READAHEAD };
+static const char* const io_mode_names[3] = { "ffmpeg", "mmap", "readahead" };
+
+// command-line options
+typedef struct Options {
+    const char *inputs[MAX_STREAMS];
+    int num_inputs;
+    const char *render_nodes[MAX_DEVICES];  // DRM render nodes to decode on
+    int num_render_nodes;
+    int max_sessions;         // streams per decoding device
+    bool software;            // decode on the CPU even where VA-API is available
+    bool simulate_scheduler;  // try the scheduling policy on simulated devices
+    bool self_test;           // check the GPU-independent logic, and exit
+    bool headless;
+    bool live;                // low-latency mode for live sources
+    bool playlist;            // play the inputs one after another, in one tile
+    bool loop;                // start over at the end of the inputs
+    const char *stats_path;   // latency JSON file; NULL = stdout
+    double stats_interval;    // seconds between latency dumps; 0 = only at exit
+    bool paced;               // present frames according to their timestamps
+    int interop_mode;         // INTEROP_*
+    int swap_interval;        // 0 = don't wait for VSync, 1 = every VSync, ...
+    int gl_major, gl_minor;   // requested Core Profile version
+    bool count_allocs;        // count heap allocations per frame after warm-up
+    bool fast_start;          // probe the inputs while setting up the display
+    int64_t probe_size;       // demuxer probing limit in bytes; 0 = FFmpeg's default
+    int64_t analyze_ms;       // demuxer probing limit in stream time; -1 = FFmpeg's default
+    const char *param_cache;  // directory with cached stream parameters, or NULL
+    int frames_in_flight;     // swaps the GPU may lag behind (2..MAX_FRAMES_IN_FLIGHT)
+    int packet_queue_depth, frame_queue_depth;  // pipeline queue sizes
+    bool implicit_sync;       // let dma-buf fences order decoding and drawing (--sync implicit)
+    const char *serve_path;   // frame server socket, or NULL
+    const char *subscribe_path;  // run as a frame server subscriber instead
+    int subscribe_policy;     // SUBSCRIBE_*
+    int subscribe_depth;      // frames the subscriber may hold
+    int subscribe_stream;     // input to subscribe to, -1 = all
+    int thumb_width, thumb_height;  // --thumbnails size; 0 = off
+    bool thumb_luma;          // read back luma only instead of RGBA
+    bool auto_skip;           // adapt skip_frame to the load (paced playback only)
+    int io_mode;              // IO_*
+    bool keyframe_index;      // build or load the keyframe index of local inputs
+    double start_seconds;     // initial seek, if positive
+    const char *metrics_path;    // Prometheus text file to keep up to date, or NULL
+    const char *metrics_socket;  // Unix socket to serve the metrics on, or NULL
+} Options;
+
 void show_help(int argc, char* argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <input.mp4> [/dev/dri/renderDxxx]\n", argv[0]);
-        exit(2);
+    (void)argc;
+    fprintf(stderr, "Usage: %s [options] <input.mp4> [input2.mp4 ...] [/dev/dri/renderDxxx ...]\n"
+                    "       %s --subscribe SOCKET [--subscribe-policy drop|block] [--subscribe-depth N]\n"
+                    "                             [--subscribe-stream N]\n"
+                    "       %s --simulate-scheduler\n"
+                    "       %s --self-test\n"
+                    "Render nodes after the inputs are used for decoding; the streams are spread\n"
+                    "across them (and software decoding) by codec support and load.\n"
+                    "Options:\n"
+                    "  --headless             render offscreen as fast as possible, without X11\n"
+                    "  --no-pacing            ignore timestamps, display frames as soon as they're decoded\n"
+                    "  --no-auto-skip         don't skip frames automatically when decoding falls behind\n"
+                    "  --playlist             play the inputs one after another instead of side by side\n"
+                    "  --loop                 start over at the end of the input(s)\n"
+                    "  --live                 low-latency mode for live sources (cameras, pipes):\n"
+                    "                         no demuxer buffering, probe at most %d KiB / %d ms,\n"
+                    "                         low-delay decoding, always show the newest frame,\n"
+                    "                         and measure the time from packet arrival to swap\n"
+                    "  --software             decode on the CPU, without VA-API\n"
+                    "  --interop MODE         export surfaces as 'separate' or 'composed' layers,\n"
+                    "                         or 'auto' to measure which is faster (default)\n"
+                    "  --swap-interval N      VSyncs per swap; 0 = don't wait for VSync (default 1)\n"
+                    "  --gl-version M.N       OpenGL Core Profile version to request (default 3.3)\n"
+                    "  --frames-in-flight N   swaps the GPU may lag behind, 2-%d (default 2)\n"
+                    "  --packet-queue N       packets queued between demuxer and decoder (default %d)\n"
+                    "  --frame-queue N        decoded frames queued for display (default %d); every\n"
+                    "                         one of them pins a VA surface (at most %d, or %d\n"
+                    "                         with --serve)\n"
+                    "  --sync MODE            wait for decoded surfaces with vaSyncSurface ('va',\n"
+                    "                         default), or rely on 'implicit' dma-buf fences, which\n"
+                    "                         not every driver attaches to its surfaces\n"
+                    "  --count-allocs         report steady-state heap allocations per decoded frame\n"
+                    "  --fast-start           open the inputs while setting up the display, and\n"
+                    "                         probe at most %d KiB / %d ms of them\n"
+                    "  --probe-size BYTES     limit how much of the inputs the demuxer probes\n"
+                    "  --analyze-duration MS  limit how much stream time the demuxer probes\n"
+                    "  --param-cache DIR      reuse the stream parameters of earlier runs\n"
+                    "  --io MODE              read local inputs through FFmpeg ('ffmpeg', default),\n"
+                    "                         by mapping them ('mmap'), or in big chunks on a\n"
+                    "                         thread of their own ('readahead')\n"
+                    "  --index                index the keyframes of local inputs in the background,\n"
+                    "                         in <input>.kfidx files that later runs reuse\n"
+                    "  --seek SEC             start SEC seconds into the inputs\n"
+                    "  --sessions N           decode at most N streams per device (default %d)\n"
+                    "  --simulate-scheduler   show how the scheduler would handle a few simulated\n"
+                    "                         devices and streams, check that it's what's\n"
+                    "                         expected, and exit\n"
+                    "  --self-test            check the interop cache and the like against fake\n"
+                    "                         backends (no GPU needed), and exit\n"
+                    "  --serve SOCKET         publish all decoded frames on a Unix socket; the\n"
+                    "                         subscribers can hold %d of them together\n"
+                    "  --thumbnails WxH[:luma]  also read back a downscaled copy of every frame,\n"
+                    "                         and report how much motion there is\n"
+                    "  --stats-json FILE      write per-stage latencies to FILE instead of stdout\n"
+                    "  --metrics FILE         keep live playback metrics in FILE, in the Prometheus\n"
+                    "                         text format (rewritten every %d ms)\n"
+                    "  --metrics-socket PATH  serve the same metrics on a Unix socket\n"
+                    "  --stats-interval SEC   also write them every SEC seconds\n",
+                    argv[0], argv[0], argv[0], argv[0], LIVE_PROBE_SIZE / 1024, LIVE_ANALYZE_MS, MAX_FRAMES_IN_FLIGHT,
+                    PACKET_QUEUE_DEPTH, FRAME_QUEUE_DEPTH, MAX_HELD_FRAMES,
+                    MAX_HELD_FRAMES - SERVER_HELD_FRAMES - SERVER_QUEUE_DEPTH, FAST_PROBE_SIZE / 1024, FAST_ANALYZE_MS,
+                    DEVICE_MAX_SESSIONS, SERVER_HELD_FRAMES, METRICS_INTERVAL_MS);
+    exit(2);
+}
+
+// parse an integer option argument; false if it isn't one, or out of range
+static bool parse_int(const char *arg, int min, int max, int *value) {
+    char *end;
+    errno = 0;
+    long v = strtol(arg, &end, 10);
+    if ((end == arg) || *end || errno || (v < min) || (v > max)) {
+        return false;
+    }
+    *value = (int)v;
+    return true;
+}
+
+// the same for 64-bit integers
+static bool parse_int64(const char *arg, int64_t min, int64_t max, int64_t *value) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(arg, &end, 10);
+    if ((end == arg) || *end || errno || (v < min) || (v > max)) {
+        return false;
+    }
+    *value = v;
+    return true;
+}
+
+// ... and for numbers with a fraction (not NaN or infinity, which are out of
+// any range)
+static bool parse_double(const char *arg, double min, double max, double *value) {
+    char *end;
+    errno = 0;
+    double v = strtod(arg, &end);
+    if ((end == arg) || *end || errno || !((v >= min) && (v <= max))) {
+        return false;
+    }
+    *value = v;
+    return true;
+}
+
+void parse_options(Options *opts, int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        { "headless",       no_argument,       NULL, 'H' },
+        { "no-pacing",      no_argument,       NULL, 'P' },
+        { "no-auto-skip",   no_argument,       NULL, 'K' },
+        { "live",           no_argument,       NULL, 'L' },
+        { "playlist",       no_argument,       NULL, 'Q' },
+        { "loop",           no_argument,       NULL, 'l' },
+        { "software",       no_argument,       NULL, 'D' },
+        { "interop",        required_argument, NULL, 'M' },
+        { "swap-interval",  required_argument, NULL, 'S' },
+        { "gl-version",     required_argument, NULL, 'G' },
+        { "frames-in-flight", required_argument, NULL, 'N' },
+        { "packet-queue",   required_argument, NULL, 'q' },
+        { "frame-queue",    required_argument, NULL, 'f' },
+        { "sync",           required_argument, NULL, 'Y' },
+        { "serve",          required_argument, NULL, 'V' },
+        { "thumbnails",     required_argument, NULL, 'T' },
+        { "index",          no_argument,       NULL, 'X' },
+        { "seek",           required_argument, NULL, 'k' },
+        { "sessions",       required_argument, NULL, 'E' },
+        { "simulate-scheduler", no_argument,   NULL, 'Z' },
+        { "self-test",      no_argument,       NULL, 'B' },
+        { "subscribe",      required_argument, NULL, 'U' },
+        { "subscribe-policy", required_argument, NULL, 'o' },
+        { "subscribe-depth",  required_argument, NULL, 'd' },
+        { "subscribe-stream", required_argument, NULL, 's' },
+        { "count-allocs",   no_argument,       NULL, 'A' },
+        { "fast-start",     no_argument,       NULL, 'F' },
+        { "probe-size",     required_argument, NULL, 'p' },
+        { "analyze-duration", required_argument, NULL, 'a' },
+        { "param-cache",    required_argument, NULL, 'C' },
+        { "io",             required_argument, NULL, 'O' },
+        { "stats-json",     required_argument, NULL, 'J' },
+        { "stats-interval", required_argument, NULL, 'I' },
+        { "metrics",        required_argument, NULL, 'R' },
+        { "metrics-socket", required_argument, NULL, 'W' },
+        { "help",           no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    memset(opts, 0, sizeof(*opts));
+    opts->max_sessions = DEVICE_MAX_SESSIONS;
+    opts->paced = true;
+    opts->auto_skip = true;
+    opts->interop_mode = INTEROP_AUTO;
+    opts->swap_interval = 1;
+    opts->gl_major = 3;
+    opts->gl_minor = 3;
+    opts->analyze_ms = -1;
+    opts->frames_in_flight = 2;
+    opts->packet_queue_depth = PACKET_QUEUE_DEPTH;
+    opts->frame_queue_depth = FRAME_QUEUE_DEPTH;
+    opts->subscribe_depth = 2;
+    opts->subscribe_stream = -1;
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'H': opts->headless = true; opts->paced = false; break;
+            case 'P': opts->paced = false; break;
+            case 'K': opts->auto_skip = false; break;
+            case 'L': opts->live = true; opts->paced = false; break;
+            case 'Q': opts->playlist = true; break;
+            case 'l': opts->loop = true; break;
+            case 'D': opts->software = true; break;
+            case 'X': opts->keyframe_index = true; break;
+            case 'k':
+                if (!parse_double(optarg, 0.0, 1e9, &opts->start_seconds)) {
+                    show_help(argc, argv);
+                }
+                break;
+            case 'E':
+                if (!parse_int(optarg, 1, MAX_STREAMS, &opts->max_sessions)) {
+                    show_help(argc, argv);
+                }
+                break;
+            case 'Z': opts->simulate_scheduler = true; break;
+            case 'B': opts->self_test = true; break;
+            case 'M':
+                if      (!strcmp(optarg, "auto"))     { opts->interop_mode = INTEROP_AUTO; }
+                else if (!strcmp(optarg, "separate")) { opts->interop_mode = INTEROP_SEPARATE; }
+                else if (!strcmp(optarg, "composed")) { opts->interop_mode = INTEROP_COMPOSED; }
+                else { show_help(argc, argv); }
+                break;
+            case 'S':
+                if (!parse_int(optarg, 0, 100, &opts->swap_interval)) {
+                    show_help(argc, argv);
+                }
+                break;
+            case 'A': opts->count_allocs = true; break;
+            case 'N':
+                if (!parse_int(optarg, 2, MAX_FRAMES_IN_FLIGHT, &opts->frames_in_flight)) {
+                    show_help(argc, argv);
+                }
+                break;
+            case 'q':
+            case 'f': {
+                int *depth = (c == 'q') ? &opts->packet_queue_depth : &opts->frame_queue_depth;
+                if (!parse_int(optarg, 1, MAX_QUEUE_DEPTH, depth)) {
+                    show_help(argc, argv);
+                }
+                break;
+            }
+            case 'Y':
+                if      (!strcmp(optarg, "implicit")) { opts->implicit_sync = true; }
+                else if (!strcmp(optarg, "va"))       { opts->implicit_sync = false; }
+                else { show_help(argc, argv); }
+                break;
+            case 'F': opts->fast_start = true; break;
+            case 'V': opts->serve_path = optarg; break;
+            case 'T': {
+                char suffix[8] = "";
+                int n = sscanf(optarg, "%dx%d:%7s", &opts->thumb_width, &opts->thumb_height, suffix);
+                if ((n < 2) || (opts->thumb_width <= 0) || (opts->thumb_height <= 0) || ((n == 3) && strcmp(suffix, "luma"))) {
+                    show_help(argc, argv);
+                }
+                opts->thumb_luma = (n == 3);
+                break;
+            }
+            case 'U': opts->subscribe_path = optarg; break;
+            case 'o':
+                if      (!strcmp(optarg, "drop"))  { opts->subscribe_policy = SUBSCRIBE_DROP; }
+                else if (!strcmp(optarg, "block")) { opts->subscribe_policy = SUBSCRIBE_BLOCK; }
+                else { show_help(argc, argv); }
+                break;
+            case 'd':
+                if (!parse_int(optarg, 1, SERVER_HELD_FRAMES, &opts->subscribe_depth)) {
+                    show_help(argc, argv);
+                }
+                break;
+            case 's':
+                if (!parse_int(optarg, -1, MAX_STREAMS - 1, &opts->subscribe_stream)) {
+                    show_help(argc, argv);
+                }
+                break;
+            case 'p':  // (FFmpeg won't probe less than 32 bytes)
+                if (!parse_int64(optarg, 32, INT64_MAX, &opts->probe_size)) {
+                    show_help(argc, argv);
+                }
+                break;
+            case 'a':  // (FFmpeg gets it in microseconds)
+                if (!parse_int64(optarg, 0, INT64_MAX / 1000, &opts->analyze_ms)) {
+                    show_help(argc, argv);
+                }
+                break;
+            case 'C': opts->param_cache = optarg; break;
+            case 'O':
+                if      (!strcmp(optarg, "ffmpeg"))    { opts->io_mode = IO_FFMPEG; }
+                else if (!strcmp(optarg, "mmap"))      { opts->io_mode = IO_MMAP; }
+                else if (!strcmp(optarg, "readahead")) { opts->io_mode = IO_READAHEAD; }
+                else { show_help(argc, argv); }
+                break;
+            case 'G':
+                if (sscanf(optarg, "%d.%d", &opts->gl_major, &opts->gl_minor) != 2) {
+                    show_help(argc, argv);
+                }
+                break;
+            case 'J': opts->stats_path = optarg; break;
+            case 'I':
+                if (!parse_double(optarg, 0.0, 1e6, &opts->stats_interval)) {
+                    show_help(argc, argv);
+                }
+                break;
+            case 'R': opts->metrics_path = optarg; break;
+            case 'W': opts->metrics_socket = optarg; break;
+            default:  show_help(argc, argv);
+        }
+    }
+    // (with --serve, the frame server holds some more)
+    int max_frame_queue = MAX_HELD_FRAMES - (opts->serve_path ? SERVER_HELD_FRAMES + SERVER_QUEUE_DEPTH : 0);
+    if (opts->frame_queue_depth > max_frame_queue) {
+        fprintf(stderr, "--frame-queue %d doesn't fit the interop cache, using %d\n", opts->frame_queue_depth,
+                max_frame_queue);
+        opts->frame_queue_depth = max_frame_queue;
+    }
+    if (opts->live) {
+        if (!opts->probe_size)      { opts->probe_size = LIVE_PROBE_SIZE; }
+        if (opts->analyze_ms < 0)   { opts->analyze_ms = LIVE_ANALYZE_MS; }
+    }
+    if (opts->fast_start) {
+        if (!opts->probe_size)      { opts->probe_size = FAST_PROBE_SIZE; }
+        if (opts->analyze_ms < 0)   { opts->analyze_ms = FAST_ANALYZE_MS; }
+    }
+    // all positional arguments are inputs, except for the render nodes at the end
+    int first_node = argc;
+    while ((first_node - optind >= 2) && !strncmp(argv[first_node - 1], "/dev/dri/", 9)) {
+        first_node--;
+    }
+    for (int i = first_node;  i < argc;  ++i) {
+        if (opts->num_render_nodes >= MAX_DEVICES) {
+            fail("render node count check");  // at most MAX_DEVICES
+        }
+        opts->render_nodes[opts->num_render_nodes++] = argv[i];
+    }
+    argc = first_node;
+    if ((optind >= argc) && !opts->subscribe_path && !opts->simulate_scheduler && !opts->self_test) {
+        show_help(argc, argv);
+    }
+    while (optind < argc) {
+        if (opts->num_inputs >= MAX_STREAMS) {
+            fail("input count check");  // at most MAX_STREAMS
+        }
+        opts->inputs[opts->num_inputs++] = argv[optind++];
     }
 }
 
@@ -112,74 +820,892 @@ Display* open_x11_display() {
     return x_display;
 }
 
+// initialize VA-API; returns 0 if it's not available
 VADisplay initialize_vaapi(Display* x_display) {
-    // initialize VA-API
     VADisplay va_display = 0;
     va_display = vaGetDisplay(x_display);
     if (!va_display) {
-        fail("vaGetDisplay");
+        fprintf(stderr, "vaGetDisplay failed, using software decoding\n");
+        return 0;
+    }
+    int major, minor;
+    if (vaInitialize(va_display, &major, &minor) != VA_STATUS_SUCCESS) {
+        fprintf(stderr, "vaInitialize failed, using software decoding\n");
+        vaTerminate(va_display);
+        return 0;
+    }
+    return va_display;
+}
+
+// initialize VA-API on a DRM render node, for when there's no X server;
+// returns 0 if it's not available
+VADisplay initialize_vaapi_drm(const char *render_node) {
+    int fd = open(render_node, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "can't open %s, using software decoding\n", render_node);
+        return 0;
+    }
+    VADisplay va_display = vaGetDisplayDRM(fd);
+    if (!va_display) {
+        fprintf(stderr, "vaGetDisplayDRM failed, using software decoding\n");
+        close(fd);
+        return 0;
     }
     int major, minor;
     if (vaInitialize(va_display, &major, &minor) != VA_STATUS_SUCCESS) {
-        fail("vaInitialize");
+        fprintf(stderr, "vaInitialize failed, using software decoding\n");
+        vaTerminate(va_display);
+        close(fd);
+        return 0;
     }
+    // the fd needs to stay open for as long as the display is in use;
+    // we simply leave that to process exit
     return va_display;
 }
 
+// stream parameter cache (--param-cache): what avformat_find_stream_info()
+// found out about a source goes into a small text file, so that the next
+// open of the same source can skip the probe. local files are keyed by
+// size and modification time as well, so a replaced file isn't mistaken
+// for the old one.
+static void param_cache_path(char *path, size_t size, const char *dir, const char *url) {
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    for (const char *c = url;  *c;  ++c) {
+        hash = (hash ^ (uint8_t)*c) * 1099511628211ull;
+    }
+    struct stat st;
+    if (!stat(url, &st)) {
+        hash = (hash ^ (uint64_t)st.st_size)  * 1099511628211ull;
+        hash = (hash ^ (uint64_t)st.st_mtime) * 1099511628211ull;
+    }
+    snprintf(path, size, "%s/%016llx.params", dir, (unsigned long long)hash);
+}
+
+void param_cache_save(const char *dir, const char *url, const AVFormatContext *input_ctx, int video_stream) {
+    const AVCodecParameters *par = input_ctx->streams[video_stream]->codecpar;
+    if (par->extradata_size > PARAM_CACHE_MAX_EXTRADATA) {
+        return;  // wouldn't be loaded anyway
+    }
+    char path[4096], tmp_path[4200];
+    param_cache_path(path, sizeof(path), dir, url);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        fprintf(stderr, "can't write %s\n", tmp_path);
+        return;
+    }
+    fprintf(f, "streams %u\nindex %d\ncodec %d\nsize %d %d\nformat %d\nprofile %d %d\n"
+               "color %d %d\nsar %d %d\ndelay %d\nextradata ",
+            input_ctx->nb_streams, video_stream, (int)par->codec_id, par->width, par->height, par->format,
+            par->profile, par->level, (int)par->color_range, (int)par->color_space,
+            par->sample_aspect_ratio.num, par->sample_aspect_ratio.den, par->video_delay);
+    for (int i = 0;  i < par->extradata_size;  ++i) {
+        fprintf(f, "%02x", par->extradata[i]);
+    }
+    fprintf(f, "\n");
+    fclose(f);
+    rename(tmp_path, path);
+}
+
+// fill in what the demuxer doesn't know about the video stream from the
+// cache; returns the stream index, or -1 if there's no usable cache entry
+int param_cache_load(const char *dir, const char *url, AVFormatContext *input_ctx) {
+    char path[4096];
+    param_cache_path(path, sizeof(path), dir, url);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    unsigned nb_streams;
+    int index, codec, width, height, format, profile, level, range, space, sar_num, sar_den, delay;
+    int n = fscanf(f, " streams %u index %d codec %d size %d %d format %d profile %d %d"
+                      " color %d %d sar %d %d delay %d extradata",
+                   &nb_streams, &index, &codec, &width, &height, &format, &profile, &level,
+                   &range, &space, &sar_num, &sar_den, &delay);
+    uint8_t extradata[PARAM_CACHE_MAX_EXTRADATA];
+    int extradata_size = 0;
+    unsigned byte;
+    while ((extradata_size < PARAM_CACHE_MAX_EXTRADATA) && (fscanf(f, "%2x", &byte) == 1)) {
+        extradata[extradata_size++] = byte;
+    }
+    fclose(f);
+    // the container must look the same as when the entry was written;
+    // streams that only appear while reading packets don't qualify
+    if ((n != 13) || (nb_streams != input_ctx->nb_streams) || (index < 0) || ((unsigned)index >= nb_streams)) {
+        return -1;
+    }
+    AVCodecParameters *par = input_ctx->streams[index]->codecpar;
+    if ((par->codec_type != AVMEDIA_TYPE_VIDEO) || ((int)par->codec_id != codec)) {
+        return -1;
+    }
+    if (!par->width || !par->height) {
+        par->width  = width;
+        par->height = height;
+    }
+    if (par->format < 0)                             { par->format = format; }
+    if (par->profile < 0)                            { par->profile = profile; }
+    if (par->level < 0)                              { par->level = level; }
+    if (par->color_range == AVCOL_RANGE_UNSPECIFIED) { par->color_range = range; }
+    if (par->color_space == AVCOL_SPC_UNSPECIFIED)   { par->color_space = space; }
+    if (!par->sample_aspect_ratio.num)               { par->sample_aspect_ratio = (AVRational){ sar_num, sar_den }; }
+    if (!par->video_delay)                           { par->video_delay = delay; }
+    if (!par->extradata_size && extradata_size) {
+        par->extradata = av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!par->extradata) {
+            fail("av_mallocz");
+        }
+        memcpy(par->extradata, extradata, extradata_size);
+        par->extradata_size = extradata_size;
+    }
+    return index;
+}
+
+// input I/O (--io): by default, FFmpeg's file protocol reads local files
+// through a small buffer, with one read() per 32 KiB. the alternatives map
+// the whole file and copy straight out of the page cache ('mmap'), or read
+// big aligned chunks on a thread of their own that stays ahead of the
+// demuxer ('readahead'). both tell the kernel what's coming with
+// posix_fadvise(), and both count what they do.
+typedef struct InputIO {
+    int mode;              // IO_*
+    int fd;
+    int64_t size, pos;     // file size; the demuxer's read position
+    AVIOContext *avio;
+    // IO_MMAP
+    const uint8_t *map;
+    int64_t advised_end;   // the page cache has been told about up to here
+    // IO_READAHEAD: a ring of READAHEAD_CHUNKS chunks, covering consecutive
+    // chunk-aligned parts of the file from window_start on. the readahead
+    // thread fills chunk tail, the demuxer reads from head onwards and
+    // keeps one chunk behind its position around for short seeks back
+    uint8_t *chunks;
+    int chunk_len[READAHEAD_CHUNKS];
+    uint32_t head, tail;   // guarded by lock
+    int64_t window_start, filled_end;
+    uint32_t generation;   // bumped whenever the window moves elsewhere
+    bool eof, quit;
+    pthread_mutex_t lock;
+    pthread_cond_t filled, drained;
+    pthread_t thread;
+    // statistics
+    _Atomic uint64_t bytes, syscalls;
+    uint64_t window_moves;
+    int64_t blocked_ns;    // time the demuxer waited for data
+} InputIO;
+
+static void input_io_advise(InputIO *io, int64_t offset, int64_t len, int advice) {
+    posix_fadvise(io->fd, offset, len, advice);
+    RELAXED_ADD(io->syscalls, 1);
+}
+
+static void* readahead_thread_func(void *arg) {
+    InputIO *io = arg;
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (!io->quit && (io->eof || ((io->tail - io->head) == READAHEAD_CHUNKS))) {
+            pthread_cond_wait(&io->drained, &io->lock);
+        }
+        if (io->quit) {
+            break;
+        }
+        const uint32_t generation = io->generation, slot = io->tail % READAHEAD_CHUNKS;
+        const int64_t offset = io->window_start + (int64_t)(io->tail - io->head) * READAHEAD_CHUNK_SIZE;
+        pthread_mutex_unlock(&io->lock);
+        // the demuxer never looks at this chunk before it's been handed over
+        ssize_t n = pread(io->fd, io->chunks + (size_t)slot * READAHEAD_CHUNK_SIZE, READAHEAD_CHUNK_SIZE, offset);
+        RELAXED_ADD(io->syscalls, 1);
+        pthread_mutex_lock(&io->lock);
+        if (io->generation != generation) {
+            continue;  // the window has moved on in the meantime
+        }
+        if (n > 0) {
+            RELAXED_ADD(io->bytes, (uint64_t)n);
+            io->chunk_len[slot] = (int)n;
+            io->tail++;
+            io->filled_end = offset + n;
+        }
+        if (n < READAHEAD_CHUNK_SIZE) {
+            io->eof = true;  // (or a read error, which looks the same to the demuxer)
+        }
+        pthread_cond_signal(&io->filled);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+// restart the readahead at the chunk that contains pos (lock held)
+static void readahead_move_window(InputIO *io, int64_t pos) {
+    io->generation++;
+    io->window_start = io->filled_end = pos - (pos % READAHEAD_CHUNK_SIZE);
+    io->head = io->tail = 0;
+    io->eof = false;
+    io->window_moves++;
+    input_io_advise(io, io->window_start, (int64_t)READAHEAD_CHUNKS * READAHEAD_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+    pthread_cond_signal(&io->drained);
+}
+
+static int readahead_read(InputIO *io, uint8_t *buf, int buf_size) {
+    pthread_mutex_lock(&io->lock);
+    while ((io->pos < io->window_start) || (io->pos >= io->filled_end)) {
+        if ((io->pos < io->window_start) || (io->pos >= io->window_start + (int64_t)READAHEAD_CHUNKS * READAHEAD_CHUNK_SIZE)) {
+            readahead_move_window(io, io->pos);
+        } else if (io->eof) {
+            pthread_mutex_unlock(&io->lock);
+            return AVERROR_EOF;
+        }
+        int64_t t0 = now_ns();
+        pthread_cond_wait(&io->filled, &io->lock);
+        io->blocked_ns += now_ns() - t0;
+    }
+    // hand the chunks before the previous one back to the readahead thread
+    while (io->pos - io->window_start >= 2 * READAHEAD_CHUNK_SIZE) {
+        io->head++;
+        io->window_start += READAHEAD_CHUNK_SIZE;
+        pthread_cond_signal(&io->drained);
+    }
+    const int64_t offset = io->pos - io->window_start;
+    const uint32_t slot = (io->head + (uint32_t)(offset / READAHEAD_CHUNK_SIZE)) % READAHEAD_CHUNKS;
+    const int in_chunk = (int)(offset % READAHEAD_CHUNK_SIZE);
+    int n = io->chunk_len[slot] - in_chunk;
+    pthread_mutex_unlock(&io->lock);
+    if (n > buf_size) {
+        n = buf_size;
+    }
+    memcpy(buf, io->chunks + (size_t)slot * READAHEAD_CHUNK_SIZE + in_chunk, n);
+    io->pos += n;
+    return n;
+}
+
+static int mmap_read(InputIO *io, uint8_t *buf, int buf_size) {
+    if (io->pos >= io->size) {
+        return AVERROR_EOF;
+    }
+    int n = (int)((io->size - io->pos < buf_size) ? (io->size - io->pos) : buf_size);
+    // ask for the next chunk well before it's needed
+    if (io->pos + n + READAHEAD_CHUNK_SIZE > io->advised_end) {
+        io->advised_end = io->pos + (int64_t)READAHEAD_CHUNKS * READAHEAD_CHUNK_SIZE;
+        input_io_advise(io, io->pos, (int64_t)READAHEAD_CHUNKS * READAHEAD_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+    }
+    int64_t t0 = now_ns();
+    memcpy(buf, io->map + io->pos, n);  // page faults (if any) happen here
+    io->blocked_ns += now_ns() - t0;
+    RELAXED_ADD(io->bytes, (uint64_t)n);
+    io->pos += n;
+    return n;
+}
+
+static int input_io_read(void *opaque, uint8_t *buf, int buf_size) {
+    InputIO *io = opaque;
+    return (io->mode == IO_MMAP) ? mmap_read(io, buf, buf_size) : readahead_read(io, buf, buf_size);
+}
+
+static int64_t input_io_seek(void *opaque, int64_t offset, int whence) {
+    InputIO *io = opaque;
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE: return io->size;
+        case SEEK_SET: break;
+        case SEEK_CUR: offset += io->pos;  break;
+        case SEEK_END: offset += io->size; break;
+        default: return AVERROR(EINVAL);
+    }
+    if ((offset < 0) || (offset > io->size)) {
+        return AVERROR(EINVAL);
+    }
+    io->pos = offset;  // the readahead window follows with the next read
+    return offset;
+}
+
+// set up custom I/O for a local file; returns NULL if it isn't one, or is
+// empty (FFmpeg's own I/O handles that). anything but a regular file is left
+// to FFmpeg without opening it, as opening a FIFO would wait for a writer
+// (and O_NONBLOCK covers one that replaces the file in between)
+InputIO* input_io_open(const char *url, int mode) {
+    struct stat st;
+    if (stat(url, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+        return NULL;
+    }
+    int fd = open(url, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if ((fd < 0) || fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+        if (fd >= 0) { close(fd); }
+        return NULL;
+    }
+    InputIO *io = calloc(1, sizeof(InputIO));
+    if (!io) {
+        fail("calloc");
+    }
+    io->mode = mode;
+    io->fd = fd;
+    io->size = st.st_size;
+    input_io_advise(io, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (mode == IO_MMAP) {
+        void *map = mmap(NULL, io->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            fail("mmap");
+        }
+        io->map = map;
+    } else {
+        if (posix_memalign((void**)&io->chunks, 4096, (size_t)READAHEAD_CHUNKS * READAHEAD_CHUNK_SIZE)) {
+            fail("posix_memalign");
+        }
+        pthread_mutex_init(&io->lock, NULL);
+        pthread_cond_init(&io->filled, NULL);
+        pthread_cond_init(&io->drained, NULL);
+        if (pthread_create(&io->thread, NULL, readahead_thread_func, io)) {
+            fail("pthread_create");
+        }
+    }
+    uint8_t *buffer = av_malloc(IO_BUFFER_SIZE);
+    io->avio = buffer ? avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, io, input_io_read, NULL, input_io_seek) : NULL;
+    if (!io->avio) {
+        fail("avio_alloc_context");
+    }
+    return io;
+}
+
+// release custom I/O once the input that used it is closed (or never opened)
+static void input_io_close(InputIO *io) {
+    AVIOContext *avio = io->avio;
+    printf("input I/O (%s): %.1f MB read with %llu syscalls, %.1f ms blocked",
+           io_mode_names[io->mode], atomic_load(&io->bytes) / 1048576.0,
+           (unsigned long long)atomic_load(&io->syscalls), io->blocked_ns * 1e-6);
+    if (io->mode == IO_READAHEAD) {
+        printf(", readahead restarted %llu times", (unsigned long long)io->window_moves);
+        pthread_mutex_lock(&io->lock);
+        io->quit = true;
+        pthread_cond_signal(&io->drained);
+        pthread_mutex_unlock(&io->lock);
+        pthread_join(io->thread, NULL);
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->filled);
+        pthread_cond_destroy(&io->drained);
+        free(io->chunks);
+    } else {
+        munmap((void*)io->map, io->size);
+    }
+    printf("\n");
+    av_freep(&avio->buffer);  // (may not be the one we allocated anymore)
+    avio_context_free(&avio);
+    close(io->fd);
+    free(io);
+}
+
+// close an input, and its custom I/O if it has any
+void input_close(AVFormatContext **input_ctx) {
+    if (!*input_ctx) {
+        return;
+    }
+    AVIOContext *avio = ((*input_ctx)->flags & AVFMT_FLAG_CUSTOM_IO) ? (*input_ctx)->pb : NULL;
+    avformat_close_input(input_ctx);
+    if (avio) {
+        input_io_close(avio->opaque);
+    }
+}
+
 // open input file, video stream and decoder
-void open_source(AVCodecContext **decoder_ctx, int *video_stream, char* argv[], AVFormatContext **input_ctx, AVCodec **decoder)
+// (the decoder is only set up here, not opened); this doesn't touch any global state, so several inputs can be opened in
+// parallel. returns the call that failed, or NULL, and leaves nothing open
+// if it fails. interrupt (if set) lets another thread give up on a network
+// input that takes too long
+static const char* try_open_source(AVCodecContext **decoder_ctx, int *video_stream, const char *url,
+                                   AVFormatContext **input_ctx, AVCodec **decoder, const Options *opts,
+                                   const AVIOInterruptCB *interrupt)
 {
   #if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 9, 100)
       av_register_all();
   #endif
-  if (avformat_open_input(input_ctx, argv[1], NULL, NULL) != 0) {
-      fail("avformat_open_input");
+  AVDictionary *format_opts = NULL;
+  if (opts->probe_size > 0) {
+      av_dict_set_int(&format_opts, "probesize", opts->probe_size, 0);
+  }
+  if (opts->analyze_ms >= 0) {
+      av_dict_set_int(&format_opts, "analyzeduration", opts->analyze_ms * 1000, 0);
+  }
+  if (opts->live) {
+      // don't hold back the packets read while probing, and don't wait
+      // for enough of them to guess the frame rate
+      av_dict_set(&format_opts, "fflags", "nobuffer", 0);
+      av_dict_set_int(&format_opts, "fpsprobesize", 0, 0);
+  }
+  startup_phase_begin(STARTUP_OPEN_INPUT);
+  InputIO *io = (opts->io_mode != IO_FFMPEG) ? input_io_open(url, opts->io_mode) : NULL;
+  if (io || interrupt) {
+      *input_ctx = avformat_alloc_context();
+      if (!*input_ctx) {
+          fail("avformat_alloc_context");
+      }
   }
-  if (avformat_find_stream_info(*input_ctx, NULL) < 0) {
-      fail("avformat_find_stream_info");
+  if (io) {
+      (*input_ctx)->pb = io->avio;
+      (*input_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
   }
-  *video_stream = av_find_best_stream(*input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, decoder, 0);
-  if (*video_stream < 0) {
-      fail("av_find_best_stream");
+  if (interrupt) {
+      (*input_ctx)->interrupt_callback = *interrupt;
   }
+  int ret = avformat_open_input(input_ctx, url, NULL, &format_opts);
+  av_dict_free(&format_opts);
+  if (ret != 0) {
+      if (io) {
+          input_io_close(io);  // (the input context is gone already)
+      }
+      return "avformat_open_input";
+  }
+  startup_phase_end(STARTUP_OPEN_INPUT);
+
+  startup_phase_begin(STARTUP_STREAM_INFO);
+  const char *error = NULL;
+  *video_stream = opts->param_cache ? param_cache_load(opts->param_cache, url, *input_ctx) : -1;
+  if (*video_stream >= 0) {
+      *decoder = avcodec_find_decoder((*input_ctx)->streams[*video_stream]->codecpar->codec_id);
+      if (!*decoder) {
+          error = "avcodec_find_decoder";
+      }
+  } else {
+      if (avformat_find_stream_info(*input_ctx, NULL) < 0) {
+          error = "avformat_find_stream_info";
+      } else if ((*video_stream = av_find_best_stream(*input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, decoder, 0)) < 0) {
+          error = "av_find_best_stream";
+      } else if (opts->param_cache) {
+          param_cache_save(opts->param_cache, url, *input_ctx, *video_stream);
+      }
+  }
+  if (error) {
+      input_close(input_ctx);
+      return error;
+  }
+  startup_phase_end(STARTUP_STREAM_INFO);
   *decoder_ctx = avcodec_alloc_context3(*decoder);
   if (!*decoder_ctx) {
       fail("avcodec_alloc_context3");
   }
   if (avcodec_parameters_to_context(*decoder_ctx, (*input_ctx)->streams[*video_stream]->codecpar) < 0) {
-      fail("avcodec_parameters_to_context");
+      avcodec_free_context(decoder_ctx);
+      input_close(input_ctx);
+      return "avcodec_parameters_to_context";
+  }
+  return NULL;
+}
+
+// the same for an input that has to open
+void open_source(AVCodecContext **decoder_ctx, int *video_stream, const char *url, AVFormatContext **input_ctx, AVCodec **decoder,
+                 const Options *opts, const AVIOInterruptCB *interrupt)
+{
+  const char *error = try_open_source(decoder_ctx, video_stream, url, input_ctx, decoder, opts, interrupt);
+  if (error) {
+      fail(error);
   }
 }
+// keyframe index (--index): a background thread scans each local input once
+// and records where the keyframes of its video stream are. the index goes
+// into a sidecar file next to the input (<input>.kfidx), which later runs
+// simply map into memory. with it, a seek goes straight to the keyframe
+// before the target, instead of letting the demuxer search for one.
+#define KEYFRAME_INDEX_MAGIC   0x5846494b  // "KIFX"
+#define KEYFRAME_INDEX_VERSION 1
+
+typedef struct KeyframeIndexHeader {
+    uint32_t magic, version;
+    uint64_t file_size;    // the input's size and modification time, so that
+    int64_t file_mtime;    // a replaced input isn't mistaken for the old one
+    int32_t stream;
+    int32_t time_base_num, time_base_den;
+    uint32_t count;        // followed by this many entries
+} KeyframeIndexHeader;
+
+// sorted by pts; timestamps are in the video stream's time base
+typedef struct KeyframeEntry {
+    int64_t pts, dts;
+    int64_t pos;           // byte offset of the packet, or -1
+} KeyframeEntry;
+
+typedef struct KeyframeIndex {
+    const char *url;
+    int stream;
+    AVRational time_base;
+    pthread_t thread;
+    bool started;
+    atomic_bool ready;     // entries and count are valid
+    atomic_bool abort;     // stop scanning
+    const KeyframeEntry *entries;
+    uint32_t count;
+    void *map;             // the mapped sidecar file ...
+    size_t map_size;
+    KeyframeEntry *scanned;  // ... or the scan result, if it couldn't be saved
+} KeyframeIndex;
+
+static void keyframe_index_path(char *path, size_t size, const char *url) {
+    snprintf(path, size, "%s.kfidx", url);
+}
+
+// map an existing sidecar file if it matches the input
+static bool keyframe_index_map(KeyframeIndex *ki, const struct stat *st) {
+    char path[4096];
+    keyframe_index_path(path, sizeof(path), ki->url);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat map_st;
+    void *map = MAP_FAILED;
+    if (!fstat(fd, &map_st) && ((size_t)map_st.st_size >= sizeof(KeyframeIndexHeader))) {
+        map = mmap(NULL, map_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    const KeyframeIndexHeader *h = map;
+    if ((h->magic != KEYFRAME_INDEX_MAGIC) || (h->version != KEYFRAME_INDEX_VERSION)
+    ||  (h->file_size != (uint64_t)st->st_size) || (h->file_mtime != (int64_t)st->st_mtime)
+    ||  (h->stream != ki->stream) || (h->time_base_num != ki->time_base.num) || (h->time_base_den != ki->time_base.den)
+    ||  ((size_t)map_st.st_size != sizeof(*h) + (size_t)h->count * sizeof(KeyframeEntry))) {
+        munmap(map, map_st.st_size);
+        return false;
+    }
+    ki->map = map;
+    ki->map_size = map_st.st_size;
+    ki->entries = (const KeyframeEntry*)(h + 1);
+    ki->count = h->count;
+    return true;
+}
+
+static bool keyframe_index_save(const KeyframeIndex *ki, const struct stat *st, const KeyframeEntry *entries,
+                                uint32_t count) {
+    char path[4096], tmp_path[4200];
+    keyframe_index_path(path, sizeof(path), ki->url);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f) {
+        return false;
+    }
+    KeyframeIndexHeader h = {
+        .magic = KEYFRAME_INDEX_MAGIC, .version = KEYFRAME_INDEX_VERSION,
+        .file_size = st->st_size, .file_mtime = st->st_mtime, .stream = ki->stream,
+        .time_base_num = ki->time_base.num, .time_base_den = ki->time_base.den, .count = count,
+    };
+    bool ok = (fwrite(&h, sizeof(h), 1, f) == 1) && (fwrite(entries, sizeof(*entries), count, f) == count);
+    ok &= !fclose(f);
+    ok = ok && !rename(tmp_path, path);
+    if (!ok) {
+        unlink(tmp_path);
+    }
+    return ok;
+}
+
+static int compare_keyframes(const void *a, const void *b) {
+    int64_t pa = ((const KeyframeEntry*)a)->pts, pb = ((const KeyframeEntry*)b)->pts;
+    return (pa > pb) - (pa < pb);
+}
+
+// read all video packets of the input (with a demuxer of its own) and
+// collect the keyframes; returns the number of entries, or -1
+static int keyframe_index_scan(KeyframeIndex *ki, KeyframeEntry **entries) {
+    AVFormatContext *ctx = NULL;
+    if (avformat_open_input(&ctx, ki->url, NULL, NULL) != 0) {
+        return -1;
+    }
+    if ((unsigned)ki->stream >= ctx->nb_streams) {
+        avformat_close_input(&ctx);
+        return -1;
+    }
+    for (unsigned i = 0;  i < ctx->nb_streams;  ++i) {
+        ctx->streams[i]->discard = ((int)i == ki->stream) ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        fail("av_packet_alloc");
+    }
+    int count = 0, capacity = 0;
+    *entries = NULL;
+    while (!atomic_load(&ki->abort) && (av_read_frame(ctx, packet) >= 0)) {
+        if ((packet->stream_index == ki->stream) && (packet->flags & AV_PKT_FLAG_KEY)) {
+            if (count == capacity) {
+                capacity = capacity ? (capacity * 2) : 1024;
+                *entries = realloc(*entries, capacity * sizeof(KeyframeEntry));
+                if (!*entries) {
+                    fail("realloc");
+                }
+            }
+            KeyframeEntry *e = &(*entries)[count++];
+            e->pts = (packet->pts != AV_NOPTS_VALUE) ? packet->pts : packet->dts;
+            e->dts = packet->dts;
+            e->pos = packet->pos;
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    avformat_close_input(&ctx);
+    if (atomic_load(&ki->abort)) {
+        free(*entries);
+        *entries = NULL;
+        return -1;
+    }
+    qsort(*entries, count, sizeof(KeyframeEntry), compare_keyframes);
+    return count;
+}
+
+static void* keyframe_index_thread_func(void *arg) {
+    KeyframeIndex *ki = arg;
+    const int64_t t0 = now_ns();
+    struct stat st;
+    if (stat(ki->url, &st) || !S_ISREG(st.st_mode)) {
+        printf("keyframe index: %s isn't a local file, not indexing it\n", ki->url);
+        return NULL;
+    }
+    const char *how = "loaded";
+    if (!keyframe_index_map(ki, &st)) {
+        KeyframeEntry *entries;
+        int count = keyframe_index_scan(ki, &entries);
+        if (count < 0) {
+            return NULL;  // aborted, or the input can't be read
+        }
+        how = "built";
+        if (!keyframe_index_save(ki, &st, entries, count) || !keyframe_index_map(ki, &st)) {
+            how = "built (not saved)";
+            ki->scanned = entries;
+            ki->entries = entries;
+            ki->count = count;
+        } else {
+            free(entries);
+        }
+    }
+    atomic_store(&ki->ready, true);
+    printf("\nkeyframe index of %s %s: %u keyframes, %.1f ms\n", ki->url, how, ki->count, (now_ns() - t0) * 1e-6);
+    return NULL;
+}
+
+void keyframe_index_start(KeyframeIndex *ki, const char *url, int stream, AVRational time_base) {
+    memset(ki, 0, sizeof(*ki));
+    ki->url = url;
+    ki->stream = stream;
+    ki->time_base = time_base;
+    if (pthread_create(&ki->thread, NULL, keyframe_index_thread_func, ki)) {
+        fail("pthread_create");
+    }
+    ki->started = true;
+}
+
+void keyframe_index_stop(KeyframeIndex *ki) {
+    if (!ki->started) {
+        return;
+    }
+    atomic_store(&ki->abort, true);
+    pthread_join(ki->thread, NULL);
+    if (ki->map) {
+        munmap(ki->map, ki->map_size);
+    }
+    free(ki->scanned);
+    ki->started = false;
+}
+
+// the last keyframe at or before pts (or the first one, if there's none);
+// NULL if the index isn't available (yet)
+const KeyframeEntry* keyframe_index_find(KeyframeIndex *ki, int64_t pts) {
+    if (!ki->started || !atomic_load(&ki->ready) || !ki->count) {
+        return NULL;
+    }
+    uint32_t lo = 0, hi = ki->count;  // first entry with a larger pts in [lo, hi]
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ki->entries[mid].pts <= pts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return &ki->entries[lo ? (lo - 1) : 0];
+}
+
+
+// check whether the decoder can do VA-API decoding at all
+static bool codec_supports_vaapi(const AVCodec *decoder) {
+    for (int i = 0;;  ++i) {
+        const AVCodecHWConfig *cfg = avcodec_get_hw_config(decoder, i);
+        if (!cfg) {
+            return false;
+        }
+        if ((cfg->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) && (cfg->device_type == AV_HWDEVICE_TYPE_VAAPI)) {
+            return true;
+        }
+    }
+}
 
 // use av_hwdevice_ctx_alloc() and populate the underlying structure
-// to use the VA-API context ("display") we created before
-void populate_context(AVCodec *decoder, VADisplay va_display, AVCodecContext *decoder_ctx, AVBufferRef **hw_device_ctx)
+// to use the VA-API context ("display") we created before; all decoders
+// share this one device context
+AVBufferRef* create_hw_device_ctx(VADisplay va_display)
 {
-  *hw_device_ctx = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_VAAPI);
-  if (!*hw_device_ctx) {
+  AVBufferRef *hw_device_ctx = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_VAAPI);
+  if (!hw_device_ctx) {
       fail("av_hwdevice_ctx_alloc");
   }
-  AVHWDeviceContext *hwctx = (void*) (*hw_device_ctx)->data;
+  AVHWDeviceContext *hwctx = (void*) hw_device_ctx->data;
   AVVAAPIDeviceContext *vactx = hwctx->hwctx;
   vactx->display = va_display;
-  if (av_hwdevice_ctx_init(*hw_device_ctx) < 0) {
+  if (av_hwdevice_ctx_init(hw_device_ctx) < 0) {
       fail("av_hwdevice_ctx_init");
   }
+  return hw_device_ctx;
+}
+
+// set up the decoder for VA-API decoding on the given device;
+// without a device, set up frame-threaded software decoding.
+// held_frames is the number of frames queued for display or kept outside
+// the pipeline.
+// with low_delay, every frame comes out as soon as it's decoded: no
+// reordering delay, and slice instead of frame threads, which would
+// hold back one frame per thread (streams with B-frames come out in
+// decoding order then, but live sources rarely have any). returns the call
+// that failed, or NULL
+static const char* try_populate_context(AVCodec *decoder, AVBufferRef *hw_device_ctx, AVCodecContext *decoder_ctx,
+                                        int held_frames, bool low_delay)
+{
+  if (hw_device_ctx && !codec_supports_vaapi(decoder)) {
+      printf("%s has no VA-API support, using software decoding\n", decoder->name);
+      hw_device_ctx = NULL;
+  }
+  if (hw_device_ctx) {
+      decoder_ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+      // the surface pool has a fixed size, so we need to reserve surfaces for
+      // the held frames (including the ones in the queue), the one waiting
+      // to be pushed into the queue, the one waiting for its presentation
+      // time, the one being drawn, the one that's being displayed, and the
+      // ones the GPU may still sample
+      decoder_ctx->extra_hw_frames = 4 + MAX_FRAMES_IN_FLIGHT + held_frames;
+  } else {
+      // formats we can't upload would only fail with the first frame
+      if ((decoder_ctx->pix_fmt != AV_PIX_FMT_NONE) && (software_plane_layout(decoder_ctx->pix_fmt) < 0)) {
+          fprintf(stderr, "%s frames can't be displayed (only 4:2:0 with 8 or 10 bits)\n",
+                  av_get_pix_fmt_name(decoder_ctx->pix_fmt));
+          return "software pixel format check";
+      }
+      decoder_ctx->thread_count = 0;  // auto
+      decoder_ctx->thread_type = low_delay ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+  }
+  if (low_delay) {
+      decoder_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    #ifdef AV_CODEC_FLAG_COPY_OPAQUE
+      decoder_ctx->flags |= AV_CODEC_FLAG_COPY_OPAQUE;  // for the arrival time, see pipeline_stamp_arrival()
+    #endif
+  }
   decoder_ctx->get_format = get_hw_format;
-  decoder_ctx->hw_device_ctx = av_buffer_ref(*hw_device_ctx);
   if (avcodec_open2(decoder_ctx, decoder, NULL) < 0) {
-      fail("avcodec_open2");
+      return "avcodec_open2";
   }
   printf("Opened input video stream: %dx%d\n", decoder_ctx->width, decoder_ctx->height);
+  return NULL;
+}
+
+// the same for a decoder that has to open
+void populate_context(AVCodec *decoder, AVBufferRef *hw_device_ctx, AVCodecContext *decoder_ctx, int held_frames,
+                      bool low_delay)
+{
+  const char *error = try_populate_context(decoder, hw_device_ctx, decoder_ctx, held_frames, low_delay);
+  if (error) {
+      fail(error);
+  }
+}
+
+// a decoding device: a VA display with a device context, which all streams
+// decoding on it share. given render nodes, each of them is one; otherwise,
+// there's just the X server's GPU (or the default render node in headless
+// mode)
+typedef struct VaDevice {
+    const char *name;
+    VADisplay va_display;
+    AVBufferRef *hw_device_ctx;
+    enum AVCodecID codecs[MAX_DEVICE_CODECS];  // what it can decode
+    int num_codecs;
+} VaDevice;
+
+// the VA-API decoding profiles of each codec
+static const struct { enum AVCodecID codec; VAProfile profile; } va_profile_codecs[] = {
+    { AV_CODEC_ID_MPEG2VIDEO, VAProfileMPEG2Simple },
+    { AV_CODEC_ID_MPEG2VIDEO, VAProfileMPEG2Main },
+    { AV_CODEC_ID_MPEG4,      VAProfileMPEG4Simple },
+    { AV_CODEC_ID_MPEG4,      VAProfileMPEG4AdvancedSimple },
+    { AV_CODEC_ID_MPEG4,      VAProfileMPEG4Main },
+    { AV_CODEC_ID_H264,       VAProfileH264ConstrainedBaseline },
+    { AV_CODEC_ID_H264,       VAProfileH264Main },
+    { AV_CODEC_ID_H264,       VAProfileH264High },
+    { AV_CODEC_ID_VC1,        VAProfileVC1Simple },
+    { AV_CODEC_ID_VC1,        VAProfileVC1Main },
+    { AV_CODEC_ID_VC1,        VAProfileVC1Advanced },
+    { AV_CODEC_ID_MJPEG,      VAProfileJPEGBaseline },
+    { AV_CODEC_ID_VP8,        VAProfileVP8Version0_3 },
+    { AV_CODEC_ID_HEVC,       VAProfileHEVCMain },
+    { AV_CODEC_ID_HEVC,       VAProfileHEVCMain10 },
+    { AV_CODEC_ID_VP9,        VAProfileVP9Profile0 },
+    { AV_CODEC_ID_VP9,        VAProfileVP9Profile2 },
+#if VA_CHECK_VERSION(1, 8, 0)
+    { AV_CODEC_ID_AV1,        VAProfileAV1Profile0 },
+#endif
+};
+
+// find out which codecs a device can decode (as in: has a VLD entrypoint
+// for at least one of their profiles)
+static void va_device_query_codecs(VaDevice *device) {
+    VADisplay dpy = device->va_display;
+    int num_profiles = 0;
+    VAProfile *profiles = calloc(vaMaxNumProfiles(dpy), sizeof(VAProfile));
+    VAEntrypoint *entrypoints = calloc(vaMaxNumEntrypoints(dpy), sizeof(VAEntrypoint));
+    if (!profiles || !entrypoints) {
+        fail("calloc");
+    }
+    if (vaQueryConfigProfiles(dpy, profiles, &num_profiles) != VA_STATUS_SUCCESS) {
+        num_profiles = 0;
+    }
+    device->num_codecs = 0;
+    for (int p = 0;  p < num_profiles;  ++p) {
+        int num_entrypoints = 0;
+        bool vld = false;
+        if (vaQueryConfigEntrypoints(dpy, profiles[p], entrypoints, &num_entrypoints) == VA_STATUS_SUCCESS) {
+            for (int e = 0;  e < num_entrypoints;  ++e) {
+                vld |= (entrypoints[e] == VAEntrypointVLD);
+            }
+        }
+        for (size_t i = 0;  vld && (i < sizeof(va_profile_codecs) / sizeof(va_profile_codecs[0]));  ++i) {
+            if (va_profile_codecs[i].profile != profiles[p]) {
+                continue;
+            }
+            bool known = false;
+            for (int c = 0;  c < device->num_codecs;  ++c) {
+                known |= (device->codecs[c] == va_profile_codecs[i].codec);
+            }
+            if (!known && (device->num_codecs < MAX_DEVICE_CODECS)) {
+                device->codecs[device->num_codecs++] = va_profile_codecs[i].codec;
+            }
+        }
+    }
+    free(entrypoints);
+    free(profiles);
+}
+
+// set up a device on a VA display that has already been initialized
+void va_device_init(VaDevice *device, const char *name, VADisplay va_display) {
+    memset(device, 0, sizeof(*device));
+    device->name = name;
+    device->va_display = va_display;
+    device->hw_device_ctx = create_hw_device_ctx(va_display);
+    va_device_query_codecs(device);
+    printf("decoding device %s: %s;", name, vaQueryVendorString(va_display));
+    for (int c = 0;  c < device->num_codecs;  ++c) {
+        printf(" %s", avcodec_get_name(device->codecs[c]));
+    }
+    printf("\n");
 }
 
-Atom create_x11_window(Display* x_display, AVCodecContext *decoder_ctx, Window *window)
+void va_device_uninit(VaDevice *device) {
+    av_buffer_unref(&device->hw_device_ctx);
+    vaTerminate(device->va_display);
+}
+
+Atom create_x11_window(Display* x_display, int width, int height, Window *window)
 {
   XSetWindowAttributes xattr;
   xattr.override_redirect = False;
   xattr.border_pixel = 0;
   *window = XCreateWindow(x_display, DefaultRootWindow(x_display),
-           0, 0, decoder_ctx->width, decoder_ctx->height,
+           0, 0, width, height,
            0, CopyFromParent, InputOutput, CopyFromParent,
            CWOverrideRedirect | CWBorderPixel, &xattr);
   if (!*window) {
@@ -211,8 +1737,26 @@ EGLDisplay initialize_egl(Display* x_display)
   return egl_display;
 }
 
+// create a Core Profile context for an EGL config
+static EGLContext create_core_context(EGLDisplay egl_display, EGLConfig cfg, const Options *opts)
+{
+  EGLint ctx_attr[] = {
+      EGL_CONTEXT_OPENGL_PROFILE_MASK,
+          EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+          EGL_CONTEXT_MAJOR_VERSION, opts->gl_major,
+          EGL_CONTEXT_MINOR_VERSION, opts->gl_minor,
+      EGL_NONE
+  };
+  EGLContext egl_context = eglCreateContext(egl_display, cfg, EGL_NO_CONTEXT, ctx_attr);
+  if (egl_context == EGL_NO_CONTEXT) {
+      fail("eglCreateContext");
+  }
+  return egl_context;
+}
+
 // create the OpenGL rendering context using EGL
-void create_opengl_ctx(EGLContext *egl_context, EGLDisplay egl_display, EGLSurface *egl_surface, Window window)
+void create_opengl_ctx(EGLContext *egl_context, EGLDisplay egl_display, EGLSurface *egl_surface, Window window,
+                       const Options *opts)
 {
   EGLint visual_attr[] = {
       EGL_SURFACE_TYPE,    EGL_WINDOW_BIT,
@@ -232,48 +1776,319 @@ void create_opengl_ctx(EGLContext *egl_context, EGLDisplay egl_display, EGLSurfa
   if (*egl_surface == EGL_NO_SURFACE) {
       fail("eglCreateWindowSurface");
   }
-  EGLint ctx_attr[] = {
-      EGL_CONTEXT_OPENGL_PROFILE_MASK,
-          EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
-          EGL_CONTEXT_MAJOR_VERSION, CORE_PROFILE_MAJOR_VERSION,
-          EGL_CONTEXT_MINOR_VERSION, CORE_PROFILE_MINOR_VERSION,
-      EGL_NONE
-  };
-  *egl_context = eglCreateContext(egl_display, cfg, EGL_NO_CONTEXT, ctx_attr);
-  if (*egl_context == EGL_NO_CONTEXT) {
-      fail("eglCreateContext");
-  }
+  *egl_context = create_core_context(egl_display, cfg, opts);
   eglMakeCurrent(egl_display, *egl_surface, *egl_surface, *egl_context);
-  eglSwapInterval(egl_display, SWAP_INTERVAL);
+  eglSwapInterval(egl_display, opts->swap_interval);
 }
 
-// dump OpenGL configuration (for reference)
-void dump_opengl_cfg()
+// initialize EGL without a window system: use Mesa's surfaceless platform
+// if available, otherwise whatever the default display is
+EGLDisplay initialize_headless_egl()
 {
-  printf("OpenGL vendor:   %s\n", glGetString(GL_VENDOR));
-  printf("OpenGL renderer: %s\n", glGetString(GL_RENDERER));
-  printf("OpenGL version:  %s\n", glGetString(GL_VERSION));
-}
-
-// look up required EGL and OpenGL extension functions
-#define LOOKUP_FUNCTION(type, func) \
-    type func = (type) eglGetProcAddress(#func); \
-    if (!func) { fail("eglGetProcAddress(" #func ")"); }
+  EGLDisplay egl_display = EGL_NO_DISPLAY;
+  const char *client_ext = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (client_ext && strstr(client_ext, "EGL_MESA_platform_surfaceless")) {
+      LOOKUP_FUNCTION(PFNEGLGETPLATFORMDISPLAYEXTPROC, eglGetPlatformDisplayEXT)
+      egl_display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  }
+  if (egl_display == EGL_NO_DISPLAY) {
+      egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  }
+  if (egl_display == EGL_NO_DISPLAY) {
+      fail("eglGetDisplay");
+  }
+  if (!eglInitialize(egl_display, NULL, NULL)) {
+      fail("eglInitialize");
+  }
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+      fail("eglBindAPI");
+  }
+  return egl_display;
+}
+
+// create an OpenGL context without a window; it's made current without
+// any surface if EGL_KHR_surfaceless_context is there, otherwise with
+// a dummy pbuffer (we render into an FBO anyway)
+void create_headless_opengl_ctx(EGLContext *egl_context, EGLDisplay egl_display, EGLSurface *egl_surface,
+                                const Options *opts)
+{
+  EGLint visual_attr[] = {
+      EGL_SURFACE_TYPE,    EGL_PBUFFER_BIT,
+      EGL_RED_SIZE,        8,
+      EGL_GREEN_SIZE,      8,
+      EGL_BLUE_SIZE,       8,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+      EGL_NONE
+  };
+  EGLConfig cfg;
+  EGLint cfg_count;
+  if (!eglChooseConfig(egl_display, visual_attr, &cfg, 1, &cfg_count) || (cfg_count < 1)) {
+      fail("eglChooseConfig");
+  }
+  *egl_context = create_core_context(egl_display, cfg, opts);
+  *egl_surface = EGL_NO_SURFACE;
+  const char *ext = eglQueryString(egl_display, EGL_EXTENSIONS);
+  if (!ext || !strstr(ext, "EGL_KHR_surfaceless_context")) {
+      EGLint pbuffer_attr[] = { EGL_WIDTH, 16, EGL_HEIGHT, 16, EGL_NONE };
+      *egl_surface = eglCreatePbufferSurface(egl_display, cfg, pbuffer_attr);
+      if (*egl_surface == EGL_NO_SURFACE) {
+          fail("eglCreatePbufferSurface");
+      }
+  }
+  if (!eglMakeCurrent(egl_display, *egl_surface, *egl_surface, *egl_context)) {
+      fail("eglMakeCurrent");
+  }
+}
+
+// create the offscreen framebuffer for headless mode and make it the target
+GLuint create_offscreen_fbo(int width, int height, GLuint *renderbuffer)
+{
+  GLuint fbo;
+  glGenRenderbuffers(1, renderbuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, *renderbuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, *renderbuffer);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      fail("glCheckFramebufferStatus");
+  }
+  return fbo;
+}
+
+// dump OpenGL configuration (for reference)
+void dump_opengl_cfg()
+{
+  printf("OpenGL vendor:   %s\n", glGetString(GL_VENDOR));
+  printf("OpenGL renderer: %s\n", glGetString(GL_RENDERER));
+  printf("OpenGL version:  %s\n", glGetString(GL_VERSION));
+}
+
+// glBufferStorage() (for persistently mapped buffers), if the context has
+// it: it's core in OpenGL 4.4, and an extension before. returns NULL if not.
+static PFNGLBUFFERSTORAGEPROC gl_buffer_storage(void) {
+    static int has = -1;
+    if (has < 0) {
+        LOOKUP_FUNCTION(PFNGLGETSTRINGIPROC, glGetStringi)
+        GLint major = 0, minor = 0, n = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+        has = (major > 4) || ((major == 4) && (minor >= 4));
+        for (GLint i = 0;  (i < n) && !has;  ++i) {
+            has = !strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_buffer_storage");
+        }
+        if (!has) {
+            printf("OpenGL: no glBufferStorage, mapping pixel buffers for every transfer\n");
+        }
+    }
+    return has ? (PFNGLBUFFERSTORAGEPROC)eglGetProcAddress("glBufferStorage") : NULL;
+}
+
+// plane layouts that frames can come in; all of them are 4:2:0
+enum { PLANES_NV12, PLANES_P010, PLANES_YUV420, PLANES_YUV420P10, NUM_PLANE_LAYOUTS };
+#define MAX_PLANES 3
+typedef struct PlaneLayout {
+    const char *name;
+    int num_planes;
+    uint32_t va_fourcc;
+    uint32_t drm_formats[MAX_PLANES];  // for importing the planes into EGL
+    int bits;                          // significant bits per sample
+    double sample_max;                 // texel value 1.0 in sample units
+} PlaneLayout;
+static const PlaneLayout plane_layouts[NUM_PLANE_LAYOUTS] = {
+    { "NV12",   2, VA_FOURCC_NV12, { DRM_FORMAT_R8,  DRM_FORMAT_GR88 },  8,  255.0 },
+    { "P010",   2, VA_FOURCC_P010, { DRM_FORMAT_R16, DRM_FORMAT_GR1616 }, 10, 65535.0 / 64.0 },  // MSB-aligned
+    { "YUV420", 3, VA_FOURCC_I420, { DRM_FORMAT_R8,  DRM_FORMAT_R8, DRM_FORMAT_R8 }, 8, 255.0 },
+    // software decoding only (VA-API hands out P010 instead)
+    { "YUV420P10", 3, 0, { DRM_FORMAT_R16, DRM_FORMAT_R16, DRM_FORMAT_R16 }, 10, 65535.0 },  // LSB-aligned
+};
+
+// returns the PLANES_* layout of an exported surface, or -1 if unsupported
+static int plane_layout_for_fourcc(uint32_t fourcc) {
+    for (int i = 0;  i < NUM_PLANE_LAYOUTS;  ++i) {
+        if (fourcc && (plane_layouts[i].va_fourcc == fourcc)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// returns the PLANES_* layout of a software frame format, or -1 if we
+// can't display it (only 4:2:0 with 8 or 10 bits is supported)
+static int software_plane_layout(int format) {
+    switch (format) {
+        case AV_PIX_FMT_NV12:        return PLANES_NV12;
+        case AV_PIX_FMT_P010:        return PLANES_P010;
+        case AV_PIX_FMT_YUV420P:
+        case AV_PIX_FMT_YUVJ420P:    return PLANES_YUV420;
+        case AV_PIX_FMT_YUV420P10:   return PLANES_YUV420P10;
+        default:                     return -1;
+    }
+}
+
+// YCbCr -> RGB matrices, by their luma coefficients
+enum { MATRIX_BT601, MATRIX_BT709, MATRIX_BT2020, NUM_MATRICES };
+static const char* const matrix_names[NUM_MATRICES] = { "BT.601", "BT.709", "BT.2020" };
+static const double matrix_kr[NUM_MATRICES] = { 0.299,  0.2126, 0.2627 };
+static const double matrix_kb[NUM_MATRICES] = { 0.114,  0.0722, 0.0593 };
+
+// the matrix and range to use for a frame (or stream); untagged content
+// is assumed to be BT.709 if it's HD, BT.601 otherwise
+static void color_params(enum AVColorSpace colorspace, enum AVColorRange color_range, int format, int height,
+                         int *matrix, bool *full_range) {
+    switch (colorspace) {
+        case AVCOL_SPC_BT709:       *matrix = MATRIX_BT709;  break;
+        case AVCOL_SPC_BT2020_NCL:
+        case AVCOL_SPC_BT2020_CL:   *matrix = MATRIX_BT2020; break;
+        case AVCOL_SPC_BT470BG:
+        case AVCOL_SPC_SMPTE170M:   *matrix = MATRIX_BT601;  break;
+        default: *matrix = (height >= 720) ? MATRIX_BT709 : MATRIX_BT601;
+    }
+    *full_range = (color_range == AVCOL_RANGE_JPEG) || (format == AV_PIX_FMT_YUVJ420P);
+}
+
+// what a shader variant renders: the picture itself for the window, or a
+// box-filtered thumbnail (in color or luma only) for --thumbnails
+enum { OUTPUT_DISPLAY, OUTPUT_THUMB_RGB, OUTPUT_THUMB_LUMA, NUM_OUTPUTS };
+#define THUMB_TAPS 4  // bilinear taps per axis for the thumbnail box filter
+
+// one compiled fragment shader variant per layout, matrix, range and output;
+// each one has its conversion constants baked in, so there's no
+// branching in the shader, and variants are only compiled once, when
+// they're first used
+#define NUM_SHADER_VARIANTS (NUM_PLANE_LAYOUTS * NUM_MATRICES * 2 * NUM_OUTPUTS)
+typedef struct ShaderVariant {
+    GLuint prog;
+    GLint scale_location;  // uTexCoordScale
+    GLint tap_location;    // uTapStep (thumbnail variants only)
+    int layout;
+} ShaderVariant;
+static ShaderVariant shader_variants[NUM_SHADER_VARIANTS];
+static GLuint vertex_shader;
+
+static void compile_shader(GLuint shader, const char *src, const char *what) {
+    GLint ok;
+    glShaderSource(shader, 1, &src, NULL);
+    while (glGetError()) {}
+    glCompileShader(shader);  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (glGetError() || (ok != GL_TRUE)) { fail(what); }
+}
 
-// OpenGL shader setup
-GLuint opengl_shader_setup()
+// write the YCbCr -> RGB conversion for a variant as a GLSL mat4 that takes
+// the raw texel values (with a 1 in w) directly to RGB
+static void format_yuv2rgb_matrix(char *buf, size_t size, int layout, int matrix, bool full_range) {
+    const PlaneLayout *pl = &plane_layouts[layout];
+    const double kr = matrix_kr[matrix], kb = matrix_kb[matrix], kg = 1.0 - kr - kb;
+    // normalized Y' = texel * scale[0] + bias[0], Cb/Cr = texel * scale[1] + bias[1]
+    double scale[2], bias[2];
+    if (full_range) {
+        double max = (double)((1 << pl->bits) - 1);
+        scale[0] = scale[1] = pl->sample_max / max;
+        bias[0] = 0.0;
+        bias[1] = -(double)(1 << (pl->bits - 1)) / max;
+    } else {
+        double f = (double)(1 << (pl->bits - 8));
+        scale[0] = pl->sample_max / (219.0 * f);  bias[0] = -16.0 / 219.0;
+        scale[1] = pl->sample_max / (224.0 * f);  bias[1] = -128.0 / 224.0;
+    }
+    // rows R, G, B; columns Y', Cb, Cr
+    const double m[3][3] = {
+        { 1.0,  0.0,                            2.0 * (1.0 - kr) },
+        { 1.0, -2.0 * kb * (1.0 - kb) / kg,    -2.0 * kr * (1.0 - kr) / kg },
+        { 1.0,  2.0 * (1.0 - kb),               0.0 },
+    };
+    double col[4][3];
+    for (int r = 0;  r < 3;  ++r) {
+        col[0][r] = m[r][0] * scale[0];
+        col[1][r] = m[r][1] * scale[1];
+        col[2][r] = m[r][2] * scale[1];
+        col[3][r] = m[r][0] * bias[0] + (m[r][1] + m[r][2]) * bias[1];
+    }
+    snprintf(buf, size,
+        "const mat4 yuv2rgb = mat4(\n"
+        "    vec4( %.6f, %.6f, %.6f, 0.0 ),\n"
+        "    vec4( %.6f, %.6f, %.6f, 0.0 ),\n"
+        "    vec4( %.6f, %.6f, %.6f, 0.0 ),\n"
+        "    vec4( %.6f, %.6f, %.6f, 1.0 ));",
+        col[0][0], col[0][1], col[0][2], col[1][0], col[1][1], col[1][2],
+        col[2][0], col[2][1], col[2][2], col[3][0], col[3][1], col[3][2]);
+}
+
+// get the shader for a layout, matrix, range and output, compiling it if needed
+const ShaderVariant* shader_variant_get(int layout, int matrix, bool full_range, int output) {
+    ShaderVariant *variant = &shader_variants[((layout * NUM_MATRICES + matrix) * 2 + full_range) * NUM_OUTPUTS + output];
+    if (variant->prog) {
+        return variant;
+    }
+    char matrix_src[512], main_src[512], fs_src[3072];
+    format_yuv2rgb_matrix(matrix_src, sizeof(matrix_src), layout, matrix, full_range);
+    const char *fetch = (plane_layouts[layout].num_planes == 3)
+        ? "vec4(texture(uTex0, tc).x, texture(uTex1, tc).x, texture(uTex2, tc).x, 1.)"
+        : "vec4(texture(uTex0, tc).x, texture(uTex1, tc).xy, 1.)";
+    if (output == OUTPUT_DISPLAY) {
+        snprintf(main_src, sizeof(main_src), "    oColor = yuv2rgb * fetch(vTexCoord);");
+    } else {
+        // average THUMB_TAPS x THUMB_TAPS bilinear taps spread over the
+        // source area of one output pixel (the loops have constant bounds,
+        // so the compiler unrolls them); luma uses the matrix's own weights
+        const double kr = matrix_kr[matrix], kb = matrix_kb[matrix];
+        int n = snprintf(main_src, sizeof(main_src),
+                 "    vec4 sum = vec4(0.);"
+            "\n" "    for (int j = 0;  j < %d;  ++j)"
+            "\n" "        for (int i = 0;  i < %d;  ++i)"
+            "\n" "            sum += fetch(vTexCoord + (vec2(i, j) - %.1f) * uTapStep);"
+            "\n" "    oColor = yuv2rgb * (sum / %d.);",
+            THUMB_TAPS, THUMB_TAPS, (THUMB_TAPS - 1) * 0.5, THUMB_TAPS * THUMB_TAPS);
+        if (output == OUTPUT_THUMB_LUMA) {
+            snprintf(main_src + n, sizeof(main_src) - n,
+                "\n" "    oColor = vec4(vec3(dot(oColor.rgb, vec3(%.6f, %.6f, %.6f))), 1.);",
+                kr, 1.0 - kr - kb, kb);
+        }
+    }
+    snprintf(fs_src, sizeof(fs_src),
+             "#version 130"
+        "\n" "in vec2 vTexCoord;"
+        "\n" "uniform sampler2D uTex0, uTex1, uTex2;"
+        "\n" "uniform vec2 uTapStep;"
+        "\n" "%s"
+        "\n" "out vec4 oColor;"
+        "\n" "vec4 fetch(vec2 tc) { return %s; }"
+        "\n" "void main() {"
+        "\n" "%s"
+        "\n" "}", matrix_src, fetch, main_src);
+    GLuint prog = glCreateProgram();
+    GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
+    if (!prog) { fail("glCreateProgram"); }
+    if (!fs) { fail("glCreateShader"); }
+    compile_shader(fs, fs_src, "glCompileShader(GL_FRAGMENT_SHADER)");
+    glAttachShader(prog, vertex_shader);
+    glAttachShader(prog, fs);
+    glLinkProgram(prog);
+    if (glGetError()) { fail("glLinkProgram"); }
+    glDeleteShader(fs);  // stays alive as long as the program does
+    glUseProgram(prog);
+    glUniform1i(glGetUniformLocation(prog, "uTex0"), 0);
+    glUniform1i(glGetUniformLocation(prog, "uTex1"), 1);
+    glUniform1i(glGetUniformLocation(prog, "uTex2"), 2);
+    variant->prog = prog;
+    variant->scale_location = glGetUniformLocation(prog, "uTexCoordScale");
+    variant->tap_location = glGetUniformLocation(prog, "uTapStep");
+    variant->layout = layout;
+    static const char* const output_names[NUM_OUTPUTS] = { "display", "RGB thumbnails", "luma thumbnails" };
+    printf("compiled shader for %s, %s, %s range, %s\n", plane_layouts[layout].name, matrix_names[matrix],
+           full_range ? "full" : "limited", output_names[output]);
+    return variant;
+}
+
+// OpenGL shader setup: the vertex shader is shared by all variants
+void opengl_shader_setup()
 {
   GLuint vao;                   // OpenGL Core Profile requires
   LOOKUP_FUNCTION(PFNGLGENVERTEXARRAYSPROC,            glGenVertexArrays);
   glGenVertexArrays(1, &vao);   // using VAOs even in trivial cases,
   LOOKUP_FUNCTION(PFNGLBINDVERTEXARRAYPROC,            glBindVertexArray);
   glBindVertexArray(vao);       // so let's set up a dummy VAO
-  #define DECLARE_YUV2RGB_MATRIX_GLSL \
-      "const mat4 yuv2rgb = mat4(\n" \
-      "    vec4(  1.1644,  1.1644,  1.1644,  0.0000 ),\n" \
-      "    vec4(  0.0000, -0.2132,  2.1124,  0.0000 ),\n" \
-      "    vec4(  1.7927, -0.5329,  0.0000,  0.0000 ),\n" \
-      "    vec4( -0.9729,  0.3015, -1.1334,  1.0000 ));"
   const char *vs_src =
            "#version 130"
       "\n" "const vec2 coords[4] = vec2[]( vec2(0.,0.), vec2(1.,0.), vec2(0.,1.), vec2(1.,1.) );"
@@ -284,92 +2099,43 @@ GLuint opengl_shader_setup()
       "\n" "    vTexCoord = c * uTexCoordScale;"
       "\n" "    gl_Position = vec4(c * vec2(2.,-2.) + vec2(-1.,1.), 0., 1.);"
       "\n" "}";
-  const char *fs_src =
-           "#version 130"
-      "\n" "in vec2 vTexCoord;"
-      "\n" "uniform sampler2D uTexY, uTexC;"
-      "\n" DECLARE_YUV2RGB_MATRIX_GLSL
-      "\n" "out vec4 oColor;"
-      "\n" "void main() {"
-      "\n" "    oColor = yuv2rgb * vec4(texture(uTexY, vTexCoord).x, "
-                                       "texture(uTexC, vTexCoord).xy, 1.);"
-      "\n" "}";
-  GLuint prog = glCreateProgram();
-  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-  if (!prog) { fail("glCreateProgram"); }
-  if (!vs || !fs) { fail("glCreateShader"); }
-  glShaderSource(vs, 1, &vs_src, NULL);
-  glShaderSource(fs, 1, &fs_src, NULL);
-  GLint ok;
-  while (glGetError()) {}
-  glCompileShader(vs);  glGetShaderiv(vs, GL_COMPILE_STATUS, &ok);
-  if (glGetError() || (ok != GL_TRUE)) { fail("glCompileShader(GL_VERTEX_SHADER)"); }
-  glCompileShader(fs); glGetShaderiv(fs, GL_COMPILE_STATUS, &ok);
-  if (glGetError() || (ok != GL_TRUE)) { fail("glCompileShader(GL_FRAGMENT_SHADER)"); }
-  glAttachShader(prog, vs);
-  glAttachShader(prog, fs);
-  glLinkProgram(prog);
-  if (glGetError()) { fail("glLinkProgram"); }
-  glUseProgram(prog);
-  glUniform1i(glGetUniformLocation(prog, "uTexY"), 0);
-  glUniform1i(glGetUniformLocation(prog, "uTexC"), 1);
-
-  return prog;
+  vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+  if (!vertex_shader) { fail("glCreateShader"); }
+  compile_shader(vertex_shader, vs_src, "glCompileShader(GL_VERTEX_SHADER)");
+  // the most common variant is needed anyway, so build it right away
+  shader_variant_get(PLANES_NV12, MATRIX_BT709, false, OUTPUT_DISPLAY);
+}
+
+void opengl_shader_uninit()
+{
+  for (int i = 0;  i < NUM_SHADER_VARIANTS;  ++i) {
+      if (shader_variants[i].prog) {
+          glDeleteProgram(shader_variants[i].prog);
+      }
+  }
+  memset(shader_variants, 0, sizeof(shader_variants));
+  glDeleteShader(vertex_shader);
 }
 
 // OpenGL texture setup
-void opengl_texture_setup(GLuint textures[2])
+// set up the first count textures; the others are set to 0
+void opengl_texture_setup(GLuint textures[MAX_PLANES], int count)
 {
-  glGenTextures(2, textures);
-  for (int i = 0;  i < 2;  ++i) {
+  memset(textures, 0, MAX_PLANES * sizeof(GLuint));
+  glGenTextures(count, textures);
+  for (int i = 0;  i < count;  ++i) {
       glBindTexture(GL_TEXTURE_2D, textures[i]);
       setup_texture();
   }
   glBindTexture(GL_TEXTURE_2D, 0);
 }
 
-void handle_x11_events(Display* x_display, Atom WM_DELETE_WINDOW, bool *running, AVCodecContext *decoder_ctx) {
-  // handle X11 events
-  while (XPending(x_display)) {
-      XEvent ev;
-      XNextEvent(x_display, &ev);
-      switch (ev.type) {
-          case ClientMessage:
-              if (((Atom) ev.xclient.data.l[0]) == WM_DELETE_WINDOW) {
-                  *running = false;
-              }
-              break;
-          case KeyPress:
-              switch (XLookupKeysym(&ev.xkey, 0)) {
-                  case 'q':
-                      *running = false;
-                      break;
-                  case 'a':
-                      decoder_ctx->skip_frame = AVDISCARD_NONE;
-                      break;
-                  case 'b':
-                      decoder_ctx->skip_frame = AVDISCARD_NONREF;
-                      break;
-                  case 'p':
-                      decoder_ctx->skip_frame = AVDISCARD_BIDIR;
-                      break;
-                  default: break;
-              }
-              break;
-          case ConfigureNotify:
-              resize_window(((XConfigureEvent*)&ev)->width, ((XConfigureEvent*)&ev)->height, decoder_ctx);
-              break;
-          default:
-              break;
-      }
-  }
-}
-
 // retrieve a frame from the decoder
 bool retrieve_frame(AVCodecContext *decoder_ctx, AVFrame *frame, bool *want_new_packet,
                     int *frameno, VASurfaceID *va_surface) {
+  PROBE_BEGIN(RECEIVE_FRAME);
   int ret = avcodec_receive_frame(decoder_ctx, frame);
+  PROBE_END(RECEIVE_FRAME);
   if ((ret == AVERROR(EAGAIN)) || (ret == AVERROR_EOF)) {
       *want_new_packet = true;
       return false;  // no more frames ready from the decoder -> decode new ones
@@ -378,205 +2144,4535 @@ bool retrieve_frame(AVCodecContext *decoder_ctx, AVFrame *frame, bool *want_new_
       fail("avcodec_receive_frame");
   }
   *va_surface = (uintptr_t)frame->data[3];
-  printf("\rframe #%d (%c) ", ++*frameno, av_get_picture_type_char(frame->pict_type));
-  fflush(stdout);
+  ++*frameno;
   return true;
 }
 
-void convert_frame(VADisplay va_display, VASurfaceID va_surface, VADRMPRIMESurfaceDescriptor *prime) {
+// convert a surface into DRM-PRIME FDs; returns false on failure
+static bool export_surface(VADisplay va_display, VASurfaceID va_surface, bool separate_layers,
+                           VADRMPRIMESurfaceDescriptor *prime) {
+    return vaExportSurfaceHandle(va_display, va_surface,
+        VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
+        VA_EXPORT_SURFACE_READ_ONLY |
+        (separate_layers ? VA_EXPORT_SURFACE_SEPARATE_LAYERS : VA_EXPORT_SURFACE_COMPOSED_LAYERS),
+        prime) == VA_STATUS_SUCCESS;
+}
+
+// the VA display a hardware frame was decoded on (with several decoding
+// devices, that's not necessarily the same for all frames of a stream)
+static VADisplay frame_va_display(const AVFrame *frame) {
+    const AVHWFramesContext *frames_ctx = (const AVHWFramesContext*)frame->hw_frames_ctx->data;
+    const AVVAAPIDeviceContext *vactx = frames_ctx->device_ctx->hwctx;
+    return vactx->display;
+}
+
+void convert_frame(VADisplay va_display, VASurfaceID va_surface, bool separate_layers, VADRMPRIMESurfaceDescriptor *prime) {
 	  // convert the frame into a pair of DRM-PRIME FDs
-      if (vaExportSurfaceHandle(va_display, va_surface,
-          VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
-          VA_EXPORT_SURFACE_READ_ONLY |
-          #if USE_LAYERS
-              VA_EXPORT_SURFACE_SEPARATE_LAYERS,
-          #else
-              VA_EXPORT_SURFACE_COMPOSED_LAYERS,
-          #endif
-          prime) != VA_STATUS_SUCCESS)
+      PROBE_BEGIN(EXPORT);
+      if (!export_surface(va_display, va_surface, separate_layers, prime))
           { fail("vaExportSurfaceHandle"); }
-      if (prime->fourcc != VA_FOURCC_NV12) {
-          fail("export format check");  // we only support NV12 here
+      PROBE_END(EXPORT);
+      if (plane_layout_for_fourcc(prime->fourcc) < 0) {
+          fail("export format check");  // we only support NV12, P010 and I420 here
       }
-      vaSyncSurface(va_display, va_surface);
 }
 
-// import the frame into OpenGL
-void import_into_gl(VADRMPRIMESurfaceDescriptor *prime, EGLDisplay egl_display,
-                    GLuint textures[2], EGLImage images[2]) {
+// create EGLImages for the luma and chroma planes and attach them to the
+// textures; returns an error message on failure. images that couldn't be
+// created are set to EGL_NO_IMAGE_KHR, and the FDs are left open either way.
+static const char* create_images(const VADRMPRIMESurfaceDescriptor *prime, bool separate_layers,
+                                 EGLDisplay egl_display, GLuint textures[MAX_PLANES], EGLImage images[MAX_PLANES]) {
       LOOKUP_FUNCTION(PFNEGLCREATEIMAGEKHRPROC,            eglCreateImageKHR)
       LOOKUP_FUNCTION(PFNGLEGLIMAGETARGETTEXTURE2DOESPROC, glEGLImageTargetTexture2DOES)
-      for (int i = 0;  i < 2;  ++i) {
-          static const uint32_t formats[2] = { DRM_FORMAT_R8, DRM_FORMAT_GR88 };
-          #if USE_LAYERS
-              #define LAYER i
-              #define PLANE 0
-              if (prime->layers[i].drm_format != formats[i]) {
-                  fail("expected DRM format check");
-              }
-          #else
-              #define LAYER 0
-              #define PLANE i
-          #endif
+      for (int i = 0;  i < MAX_PLANES;  ++i) {
+          images[i] = EGL_NO_IMAGE_KHR;
+      }
+      int layout = plane_layout_for_fourcc(prime->fourcc);
+      if (layout < 0) {
+          return "export format check";
+      }
+      for (int i = 0;  i < plane_layouts[layout].num_planes;  ++i) {
+          const uint32_t format = plane_layouts[layout].drm_formats[i];
+          // with separate layers, each plane is the first plane of its own
+          // layer; otherwise, they're the planes of the first layer
+          int layer = separate_layers ? i : 0;
+          int plane = separate_layers ? 0 : i;
+          if (separate_layers && (prime->layers[i].drm_format != format)) {
+              return "expected DRM format check";
+          }
           EGLint img_attr[] = {
-              EGL_LINUX_DRM_FOURCC_EXT,      formats[i],
-              EGL_WIDTH,                     prime->width  / (i + 1),  // half size
-              EGL_HEIGHT,                    prime->height / (i + 1),  // for chroma
-              EGL_DMA_BUF_PLANE0_FD_EXT,     prime->objects[prime->layers[LAYER].object_index[PLANE]].fd,
-              EGL_DMA_BUF_PLANE0_OFFSET_EXT, prime->layers[LAYER].offset[PLANE],
-              EGL_DMA_BUF_PLANE0_PITCH_EXT,  prime->layers[LAYER].pitch[PLANE],
+              EGL_LINUX_DRM_FOURCC_EXT,      format,
+              EGL_WIDTH,                     prime->width  / (i ? 2 : 1),  // half size
+              EGL_HEIGHT,                    prime->height / (i ? 2 : 1),  // for chroma
+              EGL_DMA_BUF_PLANE0_FD_EXT,     prime->objects[prime->layers[layer].object_index[plane]].fd,
+              EGL_DMA_BUF_PLANE0_OFFSET_EXT, prime->layers[layer].offset[plane],
+              EGL_DMA_BUF_PLANE0_PITCH_EXT,  prime->layers[layer].pitch[plane],
               EGL_NONE
           };
           images[i] = eglCreateImageKHR(egl_display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, img_attr);
           if (!images[i]) {
-              fail(i ? "chroma eglCreateImageKHR" : "luma eglCreateImageKHR");
+              images[i] = EGL_NO_IMAGE_KHR;
+              return i ? "chroma eglCreateImageKHR" : "luma eglCreateImageKHR";
           }
           glActiveTexture(GL_TEXTURE0 + i);
           glBindTexture(GL_TEXTURE_2D, textures[i]);
           while (glGetError()) {}
           glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, images[i]);
           if (glGetError()) {
-              fail("glEGLImageTargetTexture2DOES");
+              return "glEGLImageTargetTexture2DOES";
           }
       }
+      return NULL;
+}
+
+// import the frame into OpenGL
+void import_into_gl(VADRMPRIMESurfaceDescriptor *prime, EGLDisplay egl_display, bool separate_layers,
+                    GLuint textures[MAX_PLANES], EGLImage images[MAX_PLANES]) {
+      PROBE_BEGIN(IMPORT);
+      const char *error = create_images(prime, separate_layers, egl_display, textures, images);
+      if (error) {
+          fail(error);
+      }
       for (int i = 0;  i < (int)prime->num_objects;  ++i) {
           close(prime->objects[i].fd);
       }
+      PROBE_END(IMPORT);
 }
 
-void main_loop(Display* x_display, GLuint textures[2], EGLDisplay egl_display, VADisplay va_display,
-               float texcoord_x1, GLuint prog, AVFrame *frame,
-               bool packet_valid, EGLSurface egl_surface, float texcoord_y1,
-               bool texture_size_valid, int video_stream, bool running, AVFormatContext *input_ctx,
-               AVCodecContext *decoder_ctx, Atom WM_DELETE_WINDOW, AVPacket packet)
-{
-  LOOKUP_FUNCTION(PFNEGLDESTROYIMAGEKHRPROC,           eglDestroyImageKHR)
-  bool want_new_packet = true;
-  int frameno = 0;
+// one export+import of the test surface; returns what failed, or NULL
+static const char* probe_interop_round(VADisplay va_display, EGLDisplay egl_display, VASurfaceID surface, int mode,
+                                       GLuint textures[MAX_PLANES], PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR) {
+    VADRMPRIMESurfaceDescriptor prime;
+    if (!export_surface(va_display, surface, mode, &prime)) {
+        return "vaExportSurfaceHandle";
+    }
+    EGLImage images[MAX_PLANES];
+    const char *error = create_images(&prime, mode, egl_display, textures, images);
+    for (int i = 0;  i < MAX_PLANES;  ++i) {
+        if (images[i] != EGL_NO_IMAGE_KHR) {
+            eglDestroyImageKHR(egl_display, images[i]);
+        }
+    }
+    for (int i = 0;  i < (int)prime.num_objects;  ++i) {
+        close(prime.objects[i].fd);
+    }
+    return error;
+}
 
-  while (running) {
-      handle_x11_events(x_display, WM_DELETE_WINDOW, &running, decoder_ctx);
+static int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
 
-      // prepare frame and packet for re-use
-      if (packet_valid) { av_packet_unref(&packet); packet_valid = false; }
+// find out which export mode works best with this driver: export and import
+// a test surface a couple of times in both modes, and compare the medians.
+// the modes take turns, so that neither gets all the first-use costs (the
+// first round, which is discarded, warms up both) or a quieter system.
+bool probe_interop_mode(VADisplay va_display, EGLDisplay egl_display, int width, int height) {
+    LOOKUP_FUNCTION(PFNEGLDESTROYIMAGEKHRPROC, eglDestroyImageKHR)
+    VASurfaceID surface;
+    if (vaCreateSurfaces(va_display, VA_RT_FORMAT_YUV420, width, height, &surface, 1, NULL, 0) != VA_STATUS_SUCCESS) {
+        printf("interop probe: can't create a test surface, using %s\n", interop_mode_names[INTEROP_SEPARATE]);
+        return true;
+    }
+    GLuint textures[MAX_PLANES];
+    opengl_texture_setup(textures, MAX_PLANES);
+    const char *error[2] = { NULL, NULL };
+    int64_t round_ns[2][INTEROP_PROBE_ROUNDS];
+    for (int n = -1;  n < INTEROP_PROBE_ROUNDS;  ++n) {
+        for (int i = 0;  i < 2;  ++i) {
+            int mode = (n & 1) ? (INTEROP_SEPARATE - i) : (INTEROP_COMPOSED + i);
+            if (error[mode]) {
+                continue;
+            }
+            int64_t t0 = now_ns();
+            error[mode] = probe_interop_round(va_display, egl_display, surface, mode, textures, eglDestroyImageKHR);
+            if (n >= 0) {
+                round_ns[mode][n] = now_ns() - t0;
+            }
+        }
+    }
+    double cost_ms[2];
+    for (int mode = INTEROP_COMPOSED;  mode <= INTEROP_SEPARATE;  ++mode) {
+        if (error[mode]) {
+            cost_ms[mode] = -1.0;
+            printf("interop probe: %s: %s failed\n", interop_mode_names[mode], error[mode]);
+        } else {
+            qsort(round_ns[mode], INTEROP_PROBE_ROUNDS, sizeof(int64_t), compare_int64);
+            cost_ms[mode] = round_ns[mode][INTEROP_PROBE_ROUNDS / 2] * 1e-6;
+            printf("interop probe: %s: %.3f ms per export+import (median)\n", interop_mode_names[mode], cost_ms[mode]);
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDeleteTextures(MAX_PLANES, textures);
+    vaDestroySurfaces(va_display, &surface, 1);
+    if ((cost_ms[INTEROP_COMPOSED] < 0.0) && (cost_ms[INTEROP_SEPARATE] < 0.0)) {
+        fail("interop probe");
+    }
+    bool separate = (cost_ms[INTEROP_SEPARATE] >= 0.0)
+                 && ((cost_ms[INTEROP_COMPOSED] < 0.0) || (cost_ms[INTEROP_SEPARATE] <= cost_ms[INTEROP_COMPOSED]));
+    printf("interop: using %s\n", interop_mode_names[separate]);
+    return separate;
+}
 
-      // read compressed data from stream and send it to the decoder
-      if (want_new_packet) {
-          if (av_read_frame(input_ctx, &packet) < 0) {
-              break;  // end of stream
-          }
-          packet_valid = true;
-          if (packet.stream_index != video_stream) {
-              continue;  // not a video packet
-          }
-          if (avcodec_send_packet(decoder_ctx, &packet) < 0) {
-              fail("avcodec_send_packet");
-          }
-          want_new_packet = false;
-      }
+// check that the frames of another decoding device can be imported into
+// this EGL display, i.e. that the display GPU can read its dma-bufs
+bool probe_device_import(VADisplay va_display, EGLDisplay egl_display, bool separate_layers) {
+    LOOKUP_FUNCTION(PFNEGLDESTROYIMAGEKHRPROC, eglDestroyImageKHR)
+    VASurfaceID surface;
+    if (vaCreateSurfaces(va_display, VA_RT_FORMAT_YUV420, 64, 64, &surface, 1, NULL, 0) != VA_STATUS_SUCCESS) {
+        return false;
+    }
+    const char *error = "vaExportSurfaceHandle";
+    VADRMPRIMESurfaceDescriptor prime;
+    if (export_surface(va_display, surface, separate_layers, &prime)) {
+        GLuint textures[MAX_PLANES];
+        EGLImage images[MAX_PLANES];
+        opengl_texture_setup(textures, MAX_PLANES);
+        error = create_images(&prime, separate_layers, egl_display, textures, images);
+        for (int i = 0;  i < MAX_PLANES;  ++i) {
+            if (images[i] != EGL_NO_IMAGE_KHR) {
+                eglDestroyImageKHR(egl_display, images[i]);
+            }
+        }
+        for (int i = 0;  i < (int)prime.num_objects;  ++i) {
+            close(prime.objects[i].fd);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glDeleteTextures(MAX_PLANES, textures);
+    }
+    vaDestroySurfaces(va_display, &surface, 1);
+    if (error) {
+        printf("device import probe: %s failed\n", error);
+    }
+    return !error;
+}
 
-      VASurfaceID va_surface;
-      if (!retrieve_frame(decoder_ctx, frame, &want_new_packet, &frameno, &va_surface)) continue;
+// the interop cache: the decoder only ever hands out a small, fixed pool of
+// VA surfaces, so instead of exporting and importing every single frame, we
+// do it once per surface and keep the resulting EGLImages and textures around
+// until the surface pool (i.e. the hw frames context) changes. it has room
+// for INTEROP_CACHE_SIZE surfaces, which parse_options() makes sure is enough
+// for the whole pool.
 
-      VADRMPRIMESurfaceDescriptor prime;
-      convert_frame(va_display, va_surface, &prime);
+// the operations the cache needs from VA-API and EGL, kept out of the cache
+// logic itself (see vaapi_egl_interop_backend())
+typedef struct InteropBackend {
+    void *opaque;
+    void (*export_surface)(void *opaque, VASurfaceID va_surface, VADRMPRIMESurfaceDescriptor *prime);
+    void (*import_surface)(void *opaque, VADRMPRIMESurfaceDescriptor *prime, GLuint textures[MAX_PLANES], EGLImage images[MAX_PLANES]);
+    void (*sync_surface)(void *opaque, VASurfaceID va_surface);
+    void (*release)(void *opaque, GLuint textures[MAX_PLANES], EGLImage images[MAX_PLANES]);
+} InteropBackend;
 
-      // check the actual size of the frame
-      if (!texture_size_valid) {
-          texcoord_x1 = (float)((double) decoder_ctx->width  / (double) prime.width);
-          texcoord_y1 = (float)((double) decoder_ctx->height / (double) prime.height);
-          glUniform2f(glGetUniformLocation(prog, "uTexCoordScale"), texcoord_x1, texcoord_y1);
-          texture_size_valid = true;
-      }
+typedef struct InteropEntry {
+    VASurfaceID va_surface;
+    int width, height;     // size of the exported surface (may be padded)
+    int layout;            // PLANES_*
+    GLuint textures[MAX_PLANES];
+    EGLImage images[MAX_PLANES];
+    uint64_t last_used;
+    bool valid;
+} InteropEntry;
 
-      EGLImage images[2];
-      import_into_gl(&prime, egl_display, textures, images);
+typedef struct InteropCache {
+    InteropBackend backend;
+    AVBufferRef *frames_ref;  // hw frames context the entries belong to
+    InteropEntry entries[INTEROP_CACHE_SIZE];
+    uint64_t clock;
+    uint64_t hits, misses, evictions, flushes;
+} InteropCache;
 
-      // draw the frame
-      glClear(GL_COLOR_BUFFER_BIT);
-      while (glGetError()) {}
-      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-      if (glGetError()) { fail("drawing"); }
+void interop_cache_init(InteropCache *cache, const InteropBackend *backend) {
+    memset(cache, 0, sizeof(*cache));
+    cache->backend = *backend;
+}
 
-      // display the frame
-         eglSwapBuffers(egl_display, egl_surface);
+// drop all cached surfaces
+void interop_cache_flush(InteropCache *cache) {
+    for (int i = 0;  i < INTEROP_CACHE_SIZE;  ++i) {
+        if (cache->entries[i].valid) {
+            cache->backend.release(cache->backend.opaque, cache->entries[i].textures, cache->entries[i].images);
+            cache->entries[i].valid = false;
+        }
+    }
+    av_buffer_unref(&cache->frames_ref);
+    cache->flushes++;
+}
 
-      // clean up the interop images
-      for (int i = 0;  i < 2;  ++i) {
-          glActiveTexture(GL_TEXTURE0 + i);
-          glBindTexture(GL_TEXTURE_2D, 0);
-          eglDestroyImageKHR(egl_display, images[i]);
-      }
-  }
+void interop_cache_uninit(InteropCache *cache) {
+    interop_cache_flush(cache);
 }
 
-int main(int argc, char* argv[]) {
-	show_help(argc, argv);
-	Display* x_display = open_x11_display();
-	VADisplay va_display = initialize_vaapi(x_display);
+// get the textures for a decoded frame, exporting and importing it if
+// it's a surface we haven't seen yet
+const InteropEntry* interop_cache_get(InteropCache *cache, const AVFrame *frame) {
+    VASurfaceID va_surface = (uintptr_t)frame->data[3];
+
+    // a different frames context means a different surface pool, even if
+    // the surface IDs happen to be the same; we keep a reference to the
+    // current one so that its address can't be recycled behind our back
+    if (!cache->frames_ref || !frame->hw_frames_ctx || (cache->frames_ref->data != frame->hw_frames_ctx->data)) {
+        if (cache->frames_ref) {
+            interop_cache_flush(cache);
+        }
+        if (frame->hw_frames_ctx) {
+            cache->frames_ref = av_buffer_ref(frame->hw_frames_ctx);
+        }
+    }
 
-    AVFormatContext *input_ctx = NULL;
-    AVCodec *decoder = NULL;
-    AVCodecContext *decoder_ctx = NULL;
-    AVBufferRef *hw_device_ctx = NULL;
-    int video_stream = -1;
-    open_source(&decoder_ctx, &video_stream, argv, &input_ctx, &decoder);
-    populate_context(decoder, va_display, decoder_ctx, &hw_device_ctx);
+    // look up the surface, and remember the least recently used slot
+    // in case we need to evict something
+    InteropEntry *entry = NULL, *victim = &cache->entries[0];
+    for (int i = 0;  i < INTEROP_CACHE_SIZE;  ++i) {
+        InteropEntry *e = &cache->entries[i];
+        if (e->valid && (e->va_surface == va_surface)) {
+            entry = e;
+            break;
+        }
+        if (victim->valid && (!e->valid || (e->last_used < victim->last_used))) {
+            victim = e;
+        }
+    }
 
-    Window window;
-    Atom WM_DELETE_WINDOW = create_x11_window(x_display, decoder_ctx, &window);
+    if (entry) {
+        cache->hits++;
+    } else {
+        cache->misses++;
+        entry = victim;
+        if (entry->valid) {
+            cache->backend.release(cache->backend.opaque, entry->textures, entry->images);
+            entry->valid = false;
+            cache->evictions++;
+        }
+        VADRMPRIMESurfaceDescriptor prime;
+        cache->backend.export_surface(cache->backend.opaque, va_surface, &prime);
+        cache->backend.import_surface(cache->backend.opaque, &prime, entry->textures, entry->images);
+        entry->va_surface = va_surface;
+        entry->layout = plane_layout_for_fourcc(prime.fourcc);
+        entry->width  = prime.width;
+        entry->height = prime.height;
+        entry->valid  = true;
+    }
+    entry->last_used = ++cache->clock;
 
-    EGLDisplay egl_display = initialize_egl(x_display);
+    // the surface content changes with every frame, so we still need to
+    // wait until the decoder is done with it
+    cache->backend.sync_surface(cache->backend.opaque, va_surface);
+    return entry;
+}
 
-    EGLSurface egl_surface;
-    EGLContext egl_context;
-    create_opengl_ctx(&egl_context, egl_display, &egl_surface, window);
+void interop_cache_dump_stats(const InteropCache *cache) {
+    printf("interop cache: %llu hits, %llu misses, %llu evictions, %llu flushes\n",
+           (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+           (unsigned long long)cache->evictions, (unsigned long long)cache->flushes);
+}
 
-    dump_opengl_cfg();
+// the real VA-API + EGL implementation of the interop backend
+typedef struct VaapiEglInterop {
+    VADisplay va_display;
+    EGLDisplay egl_display;
+    bool separate_layers;
+    bool implicit_sync;
+    PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
+} VaapiEglInterop;
 
-    GLuint prog = opengl_shader_setup();
+static void vaapi_egl_export_surface(void *opaque, VASurfaceID va_surface, VADRMPRIMESurfaceDescriptor *prime) {
+    VaapiEglInterop *interop = opaque;
+    convert_frame(interop->va_display, va_surface, interop->separate_layers, prime);
+}
 
-    GLuint textures[2];
-    opengl_texture_setup(textures);
+static void vaapi_egl_import_surface(void *opaque, VADRMPRIMESurfaceDescriptor *prime, GLuint textures[MAX_PLANES],
+                                     EGLImage images[MAX_PLANES]) {
+    VaapiEglInterop *interop = opaque;
+    // only as many textures as the layout has planes; glDeleteTextures()
+    // ignores the zeros in the others
+    int layout = plane_layout_for_fourcc(prime->fourcc);
+    opengl_texture_setup(textures, (layout < 0) ? MAX_PLANES : plane_layouts[layout].num_planes);
+    import_into_gl(prime, interop->egl_display, interop->separate_layers, textures, images);
+}
 
-    // initial window size setup
-    GLint vp[4];
-    glGetIntegerv(GL_VIEWPORT, vp);
-    resize_window(vp[2], vp[3], decoder_ctx);
+static void vaapi_egl_sync_surface(void *opaque, VASurfaceID va_surface) {
+    VaapiEglInterop *interop = opaque;
+    if (interop->implicit_sync) {
+        return;  // the kernel makes the GL wait for the decoder's dma-buf fence
+    }
+    PROBE_BEGIN(SYNC);
+    vaSyncSurface(interop->va_display, va_surface);
+    PROBE_END(SYNC);
+}
 
-    // allocate AVFrame for display
-    AVFrame *frame = av_frame_alloc();
-    if (!frame) {
-        fail("av_frame_alloc");
+static void vaapi_egl_release(void *opaque, GLuint textures[MAX_PLANES], EGLImage images[MAX_PLANES]) {
+    VaapiEglInterop *interop = opaque;
+    glDeleteTextures(MAX_PLANES, textures);
+    for (int i = 0;  i < MAX_PLANES;  ++i) {
+        if (images[i] != EGL_NO_IMAGE_KHR) {
+            interop->eglDestroyImageKHR(interop->egl_display, images[i]);
+        }
     }
+}
 
-    // main loop
-    AVPacket packet;
-    bool packet_valid = false;
-    bool running = true;
-    bool texture_size_valid = false;
-    float texcoord_x1 = 1.0f, texcoord_y1 = 1.0f;
-    main_loop(x_display, textures, egl_display, va_display, texcoord_x1, prog,
-              frame, packet_valid, egl_surface,
-              texcoord_y1, texture_size_valid, video_stream, running,
-              input_ctx, decoder_ctx, WM_DELETE_WINDOW, packet);
+InteropBackend vaapi_egl_interop_backend(VaapiEglInterop *interop, VADisplay va_display, EGLDisplay egl_display,
+                                         bool separate_layers, bool implicit_sync) {
+    LOOKUP_FUNCTION(PFNEGLDESTROYIMAGEKHRPROC,           eglDestroyImageKHR)
+    interop->va_display = va_display;
+    interop->egl_display = egl_display;
+    interop->separate_layers = separate_layers;
+    interop->implicit_sync = implicit_sync;
+    interop->eglDestroyImageKHR = eglDestroyImageKHR;
+    InteropBackend backend = {
+        .opaque         = interop,
+        .export_surface = vaapi_egl_export_surface,
+        .import_surface = vaapi_egl_import_surface,
+        .sync_surface   = vaapi_egl_sync_surface,
+        .release        = vaapi_egl_release,
+    };
+    return backend;
+}
 
-    // normally, we'd flush the decoder here to ensure we've shown *all* frames
-    // of the video, but this is left out as an exercise for the reader ;)
+// frame fences: after drawing, we put a fence into the GL command stream, and
+// a frame that has left the screen only goes back to the decoder once the
+// fence of the last swap that could have sampled it has signalled. at most
+// depth swaps can be in flight; beyond that, we wait for the oldest one.
+// the fence operations are function pointers, like those of the interop cache.
+typedef struct FenceBackend {
+    void *opaque;
+    void* (*insert)(void *opaque);
+    bool (*wait)(void *opaque, void *fence, int64_t timeout_ns);  // true = signalled
+    void (*destroy)(void *opaque, void *fence);
+} FenceBackend;
 
-    // clean up all the mess we made
-    if (packet_valid) { av_packet_unref(&packet); }
-    av_frame_free(&frame);
-    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-    eglDestroyContext(egl_display, egl_context);
-    eglDestroySurface(egl_display, egl_surface);
-    eglTerminate(egl_display);
-    XDestroyWindow(x_display, window);
-    XCloseDisplay(x_display);
-    avcodec_free_context(&decoder_ctx);
-    avformat_close_input(&input_ctx);
-    av_buffer_unref(&hw_device_ctx);
-    vaTerminate(va_display);
+typedef struct FrameFences {
+    FenceBackend backend;
+    void *fences[MAX_FRAMES_IN_FLIGHT];
+    int depth;
+    uint64_t submitted, completed;  // swap sequence numbers
+    uint64_t blocking_waits;
+    int64_t wait_ns;
+} FrameFences;
+
+void frame_fences_init(FrameFences *ff, const FenceBackend *backend, int depth) {
+    memset(ff, 0, sizeof(*ff));
+    ff->backend = *backend;
+    ff->depth = depth;
+}
+
+// retire the oldest swap once its fence has signalled (or right away if
+// timeout_ns is negative); returns false if it's still pending
+static bool frame_fences_retire_oldest(FrameFences *ff, int64_t timeout_ns) {
+    void **fence = &ff->fences[ff->completed % ff->depth];
+    if (!ff->backend.wait(ff->backend.opaque, *fence, timeout_ns)) {
+        return false;
+    }
+    ff->backend.destroy(ff->backend.opaque, *fence);
+    *fence = NULL;
+    ff->completed++;
+    return true;
+}
+
+// fence the commands submitted so far; returns the new swap's sequence number
+uint64_t frame_fences_submit(FrameFences *ff) {
+    if ((ff->submitted - ff->completed) >= (uint64_t)ff->depth) {
+        PROBE_BEGIN(SYNC);
+        int64_t t0 = now_ns();
+        frame_fences_retire_oldest(ff, -1);
+        ff->wait_ns += now_ns() - t0;
+        ff->blocking_waits++;
+        PROBE_END(SYNC);
+    }
+    ff->fences[ff->submitted % ff->depth] = ff->backend.insert(ff->backend.opaque);
+    return ++ff->submitted;
+}
+
+// retire all swaps the GPU has finished, without waiting
+void frame_fences_poll(FrameFences *ff) {
+    while ((ff->completed < ff->submitted) && frame_fences_retire_oldest(ff, 0)) {}
+}
+
+// wait for everything
+void frame_fences_finish(FrameFences *ff) {
+    while (ff->completed < ff->submitted) {
+        frame_fences_retire_oldest(ff, -1);
+    }
+}
+
+void frame_fences_dump_stats(const FrameFences *ff) {
+    printf("frame fences: %llu swaps, %d in flight, %llu blocking waits (%.3f ms avg)\n",
+           (unsigned long long)ff->submitted, ff->depth, (unsigned long long)ff->blocking_waits,
+           ff->blocking_waits ? (ff->wait_ns * 1e-6 / ff->blocking_waits) : 0.0);
+}
+
+// the real EGL_KHR_fence_sync implementation of the fence backend
+typedef struct EglFences {
+    EGLDisplay egl_display;
+    PFNEGLCREATESYNCKHRPROC     eglCreateSyncKHR;
+    PFNEGLCLIENTWAITSYNCKHRPROC eglClientWaitSyncKHR;
+    PFNEGLDESTROYSYNCKHRPROC    eglDestroySyncKHR;
+} EglFences;
+
+static void* egl_fence_insert(void *opaque) {
+    EglFences *ef = opaque;
+    EGLSyncKHR sync = ef->eglCreateSyncKHR(ef->egl_display, EGL_SYNC_FENCE_KHR, NULL);
+    if (sync == EGL_NO_SYNC_KHR) {
+        fail("eglCreateSyncKHR");
+    }
+    return sync;
+}
+
+static bool egl_fence_wait(void *opaque, void *fence, int64_t timeout_ns) {
+    EglFences *ef = opaque;
+    EGLint status = ef->eglClientWaitSyncKHR(ef->egl_display, fence, EGL_SYNC_FLUSH_COMMANDS_BIT_KHR,
+                                             (timeout_ns < 0) ? EGL_FOREVER_KHR : (EGLTimeKHR)timeout_ns);
+    if (status == EGL_FALSE) {
+        fail("eglClientWaitSyncKHR");
+    }
+    return status == EGL_CONDITION_SATISFIED_KHR;
+}
+
+static void egl_fence_destroy(void *opaque, void *fence) {
+    EglFences *ef = opaque;
+    ef->eglDestroySyncKHR(ef->egl_display, fence);
+}
+
+FenceBackend egl_fence_backend(EglFences *ef, EGLDisplay egl_display) {
+    LOOKUP_FUNCTION(PFNEGLCREATESYNCKHRPROC,     eglCreateSyncKHR)
+    LOOKUP_FUNCTION(PFNEGLCLIENTWAITSYNCKHRPROC, eglClientWaitSyncKHR)
+    LOOKUP_FUNCTION(PFNEGLDESTROYSYNCKHRPROC,    eglDestroySyncKHR)
+    ef->egl_display = egl_display;
+    ef->eglCreateSyncKHR     = eglCreateSyncKHR;
+    ef->eglClientWaitSyncKHR = eglClientWaitSyncKHR;
+    ef->eglDestroySyncKHR    = eglDestroySyncKHR;
+    FenceBackend backend = {
+        .opaque  = ef,
+        .insert  = egl_fence_insert,
+        .wait    = egl_fence_wait,
+        .destroy = egl_fence_destroy,
+    };
+    return backend;
+}
+
+// software decoding path: frames are copied into a ring of persistently mapped
+// pixel buffer objects, from which the GL uploads them into the plane
+// textures asynchronously. a fence per buffer tells us when it can be re-used.
+// without glBufferStorage, the buffers are mapped for every frame instead.
+typedef struct PboUploader {
+    GLuint textures[MAX_PLANES];
+    GLuint pbos[PBO_RING_SIZE];
+    uint8_t *mapped[PBO_RING_SIZE];
+    GLsync fences[PBO_RING_SIZE];
+    int next;              // next PBO to fill
+    int layout;            // current plane layout (PLANES_*)
+    int width, height;     // current texture size
+    size_t pbo_size;
+    uint64_t frames, bytes;
+    int64_t upload_ns;
+    PFNGLBUFFERSTORAGEPROC   glBufferStorage;  // NULL = no persistent mapping
+    PFNGLMAPBUFFERRANGEPROC  glMapBufferRange;
+    PFNGLUNMAPBUFFERPROC     glUnmapBuffer;
+    PFNGLFENCESYNCPROC       glFenceSync;
+    PFNGLCLIENTWAITSYNCPROC  glClientWaitSync;
+    PFNGLDELETESYNCPROC      glDeleteSync;
+} PboUploader;
+
+void pbo_uploader_init(PboUploader *up) {
+    memset(up, 0, sizeof(*up));
+    LOOKUP_FUNCTION(PFNGLMAPBUFFERRANGEPROC, glMapBufferRange)
+    LOOKUP_FUNCTION(PFNGLUNMAPBUFFERPROC,    glUnmapBuffer)
+    LOOKUP_FUNCTION(PFNGLFENCESYNCPROC,      glFenceSync)
+    LOOKUP_FUNCTION(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync)
+    LOOKUP_FUNCTION(PFNGLDELETESYNCPROC,     glDeleteSync)
+    up->glBufferStorage  = gl_buffer_storage();
+    up->glMapBufferRange = glMapBufferRange;
+    up->glUnmapBuffer    = glUnmapBuffer;
+    up->glFenceSync      = glFenceSync;
+    up->glClientWaitSync = glClientWaitSync;
+    up->glDeleteSync     = glDeleteSync;
+    opengl_texture_setup(up->textures, MAX_PLANES);
+}
+
+// wait until the GL is done reading from a PBO
+static void pbo_wait(PboUploader *up, int i) {
+    if (up->fences[i]) {
+        up->glClientWaitSync(up->fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+        up->glDeleteSync(up->fences[i]);
+        up->fences[i] = 0;
+    }
+}
+
+static void pbo_release_buffers(PboUploader *up) {
+    if (!up->pbo_size) {
+        return;
+    }
+    for (int i = 0;  i < PBO_RING_SIZE;  ++i) {
+        pbo_wait(up, i);
+        if (up->glBufferStorage) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, up->pbos[i]);
+            up->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(PBO_RING_SIZE, up->pbos);
+    up->pbo_size = 0;
+}
+
+// the texture formats for the planes of each layout
+static const struct { GLenum internal_format, format, type; int bytes_per_texel; } pbo_plane_formats[NUM_PLANE_LAYOUTS][2] = {
+    [PLANES_NV12]   = { { GL_R8,  GL_RED, GL_UNSIGNED_BYTE,  1 }, { GL_RG8,  GL_RG,  GL_UNSIGNED_BYTE,  2 } },
+    [PLANES_P010]   = { { GL_R16, GL_RED, GL_UNSIGNED_SHORT, 2 }, { GL_RG16, GL_RG,  GL_UNSIGNED_SHORT, 4 } },
+    [PLANES_YUV420] = { { GL_R8,  GL_RED, GL_UNSIGNED_BYTE,  1 }, { GL_R8,   GL_RED, GL_UNSIGNED_BYTE,  1 } },
+    [PLANES_YUV420P10] = { { GL_R16, GL_RED, GL_UNSIGNED_SHORT, 2 }, { GL_R16, GL_RED, GL_UNSIGNED_SHORT, 2 } },
+};
+
+// byte offset of a plane in a PBO, and the size and row length of its data
+static size_t pbo_plane_offset(const PboUploader *up, int plane) {
+    int cw = (up->width + 1) / 2, ch = (up->height + 1) / 2;
+    size_t luma   = (size_t)up->width * up->height * pbo_plane_formats[up->layout][0].bytes_per_texel;
+    size_t chroma = (size_t)cw * ch * pbo_plane_formats[up->layout][1].bytes_per_texel;
+    return plane ? (luma + chroma * (plane - 1)) : 0;
+}
+
+// (re-)allocate the PBOs and textures for a new frame size or layout
+static void pbo_uploader_resize(PboUploader *up, int layout, int width, int height) {
+    pbo_release_buffers(up);
+    int cw = (width + 1) / 2, ch = (height + 1) / 2;
+    up->layout = layout;
+    up->width = width;
+    up->height = height;
+    up->pbo_size = pbo_plane_offset(up, plane_layouts[layout].num_planes);
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(PBO_RING_SIZE, up->pbos);
+    for (int i = 0;  i < PBO_RING_SIZE;  ++i) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, up->pbos[i]);
+        if (!up->glBufferStorage) {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, up->pbo_size, NULL, GL_STREAM_DRAW);
+            continue;
+        }
+        up->glBufferStorage(GL_PIXEL_UNPACK_BUFFER, up->pbo_size, NULL, flags);
+        up->mapped[i] = up->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, up->pbo_size, flags);
+        if (!up->mapped[i]) {
+            fail("glMapBufferRange");
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    for (int p = 0;  p < plane_layouts[layout].num_planes;  ++p) {
+        const int f = p ? 1 : 0;
+        glBindTexture(GL_TEXTURE_2D, up->textures[p]);
+        glTexImage2D(GL_TEXTURE_2D, 0, pbo_plane_formats[layout][f].internal_format, p ? cw : width, p ? ch : height, 0,
+                     pbo_plane_formats[layout][f].format, pbo_plane_formats[layout][f].type, NULL);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// upload a software-decoded NV12, P010, YUV420P or YUV420P10 frame into the
+// textures; each plane goes into a texture of its own, so the data is copied
+// as is
+void pbo_upload_frame(PboUploader *up, const AVFrame *frame) {
+    PROBE_BEGIN(UPLOAD);
+    int64_t t0 = now_ns();
+    int layout = software_plane_layout(frame->format);
+    if (layout < 0) {
+        fail("software frame format check");  // see populate_context()
+    }
+    if ((frame->width != up->width) || (frame->height != up->height) || (layout != up->layout) || !up->pbo_size) {
+        pbo_uploader_resize(up, layout, frame->width, frame->height);
+    }
+    int i = up->next;
+    up->next = (i + 1) % PBO_RING_SIZE;
+    pbo_wait(up, i);
+
+    uint8_t *mapped = up->mapped[i];
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, up->pbos[i]);
+    if (!up->glBufferStorage) {
+        mapped = up->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, up->pbo_size,
+                                      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (!mapped) {
+            fail("glMapBufferRange");
+        }
+    }
+    const int num_planes = plane_layouts[layout].num_planes;
+    for (int p = 0;  p < num_planes;  ++p) {
+        int row_bytes = (p ? (up->width + 1) / 2 : up->width) * pbo_plane_formats[layout][p ? 1 : 0].bytes_per_texel;
+        int rows = p ? (up->height + 1) / 2 : up->height;
+        uint8_t *dst = mapped + pbo_plane_offset(up, p);
+        for (int y = 0;  y < rows;  ++y) {
+            memcpy(&dst[(size_t)y * row_bytes], &frame->data[p][y * frame->linesize[p]], row_bytes);
+        }
+    }
+    if (!up->glBufferStorage) {
+        up->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+
+    // the actual transfer happens asynchronously from the PBO
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int p = 0;  p < num_planes;  ++p) {
+        const int f = p ? 1 : 0;
+        glActiveTexture(GL_TEXTURE0 + p);
+        glBindTexture(GL_TEXTURE_2D, up->textures[p]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, p ? (up->width + 1) / 2 : up->width, p ? (up->height + 1) / 2 : up->height,
+                        pbo_plane_formats[layout][f].format, pbo_plane_formats[layout][f].type,
+                        (const void*)(uintptr_t)pbo_plane_offset(up, p));
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    up->fences[i] = up->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    up->frames++;
+    up->bytes += up->pbo_size;
+    up->upload_ns += now_ns() - t0;
+    PROBE_END(UPLOAD);
+}
+
+void pbo_uploader_dump_stats(const PboUploader *up) {
+    if (!up->frames) {
+        return;
+    }
+    printf("software upload: %llu frames, %.1f MiB, %.3f ms/frame, %.1f MiB/s\n",
+           (unsigned long long)up->frames, up->bytes / 1048576.0,
+           up->upload_ns * 1e-6 / up->frames,
+           up->upload_ns ? (up->bytes / 1048576.0) / (up->upload_ns * 1e-9) : 0.0);
+}
+
+void pbo_uploader_uninit(PboUploader *up) {
+    pbo_release_buffers(up);
+    glDeleteTextures(MAX_PLANES, up->textures);
+}
+
+// bounded lock-free single-producer/single-consumer ring buffer of pointers.
+// head and tail are free-running counters; a side that has to wait (because
+// the ring is full or empty) sleeps on space_seq or data_seq with a futex,
+// and is only woken up if it announced that it's waiting.
+typedef struct SpscRing {
+    const char *name;
+    void **slots;
+    uint32_t capacity;
+    _Atomic uint32_t head;  // next slot to read; written by the consumer only
+    _Atomic uint32_t tail;  // next slot to write; written by the producer only
+    _Atomic uint32_t producer_waiting, consumer_waiting;
+    // what the waiting side sleeps on: bumped by the other side when it's
+    // waiting, and by ring_close(). waiters read it before they look at
+    // head/tail and closed, so no wakeup can slip in between.
+    _Atomic uint32_t space_seq, data_seq;
+    atomic_bool closed;
+    // statistics, each owned by one side
+    uint64_t pushes, occupancy_sum, occupancy_max;  // producer
+    int64_t producer_stall_ns, consumer_stall_ns;
+} SpscRing;
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val, int64_t timeout_ns) {
+    struct timespec ts = { timeout_ns / 1000000000, timeout_ns % 1000000000 };
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT_PRIVATE, val, (timeout_ns < 0) ? NULL : &ts, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr) {
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+
+void ring_init(SpscRing *ring, const char *name, uint32_t capacity) {
+    memset(ring, 0, sizeof(*ring));
+    ring->name = name;
+    ring->capacity = capacity;
+    ring->slots = calloc(capacity, sizeof(void*));
+    if (!ring->slots) {
+        fail("ring allocation");
+    }
+}
+
+// wake up both sides and make all further operations fail
+void ring_close(SpscRing *ring) {
+    atomic_store(&ring->closed, true);
+    atomic_fetch_add(&ring->space_seq, 1);
+    atomic_fetch_add(&ring->data_seq, 1);
+    futex_wake(&ring->space_seq);
+    futex_wake(&ring->data_seq);
+}
+
+static void ring_signal(_Atomic uint32_t *waiting, _Atomic uint32_t *seq) {
+    if (atomic_load(waiting)) {
+        atomic_fetch_add(seq, 1);
+        futex_wake(seq);
+    }
+}
+
+// blocks while the ring is full; returns false if the ring has been closed
+bool ring_push(SpscRing *ring, void *item) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load(&ring->head);
+    if ((tail - head) >= ring->capacity) {
+        int64_t t0 = now_ns();
+        for (;;) {
+            uint32_t seq = atomic_load(&ring->space_seq);
+            atomic_store(&ring->producer_waiting, 1);
+            head = atomic_load(&ring->head);
+            if ((tail - head) < ring->capacity) { break; }
+            if (atomic_load(&ring->closed)) { break; }
+            futex_wait(&ring->space_seq, seq, -1);
+        }
+        atomic_store(&ring->producer_waiting, 0);
+        ring->producer_stall_ns += now_ns() - t0;
+    }
+    if (atomic_load(&ring->closed)) {
+        return false;
+    }
+    ring->slots[tail % ring->capacity] = item;
+    atomic_store(&ring->tail, tail + 1);
+    ring_signal(&ring->consumer_waiting, &ring->data_seq);
+    uint32_t occupancy = tail + 1 - head;
+    ring->pushes++;
+    ring->occupancy_sum += occupancy;
+    if (occupancy > ring->occupancy_max) { ring->occupancy_max = occupancy; }
+    return true;
+}
+
+// waits up to timeout_ns (forever if negative) for an item;
+// returns 1 if an item was retrieved, 0 on timeout, -1 if the ring is closed
+int ring_pop(SpscRing *ring, void **item, int64_t timeout_ns) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load(&ring->tail);
+    if (tail == head) {
+        int64_t t0 = now_ns();
+        for (;;) {
+            uint32_t seq = atomic_load(&ring->data_seq);
+            atomic_store(&ring->consumer_waiting, 1);
+            tail = atomic_load(&ring->tail);
+            if (tail != head) { break; }
+            if (atomic_load(&ring->closed)) { break; }
+            int64_t remaining = (timeout_ns < 0) ? -1 : (t0 + timeout_ns - now_ns());
+            if ((timeout_ns >= 0) && (remaining <= 0)) { break; }
+            futex_wait(&ring->data_seq, seq, remaining);
+        }
+        atomic_store(&ring->consumer_waiting, 0);
+        ring->consumer_stall_ns += now_ns() - t0;
+        if (tail == head) {
+            return atomic_load(&ring->closed) ? -1 : 0;
+        }
+    }
+    *item = ring->slots[head % ring->capacity];
+    atomic_store(&ring->head, head + 1);
+    ring_signal(&ring->producer_waiting, &ring->space_seq);
+    return 1;
+}
+
+// look at the next item without removing it (consumer only);
+// returns false if there is none
+bool ring_peek(SpscRing *ring, void **item) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (atomic_load(&ring->tail) == head) {
+        return false;
+    }
+    *item = ring->slots[head % ring->capacity];
+    return true;
+}
+
+// number of queued items, as seen by either side at this moment
+uint32_t ring_count(const SpscRing *ring) {
+    // head first: it can't pass the tail that's read after it, so this
+    // works from any thread
+    uint32_t head = atomic_load(&ring->head);
+    return atomic_load(&ring->tail) - head;
+}
+
+// like ring_push, but fails instead of waiting if the ring is full
+bool ring_try_push(SpscRing *ring, void *item) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (((tail - atomic_load(&ring->head)) >= ring->capacity) || atomic_load(&ring->closed)) {
+        return false;
+    }
+    ring->slots[tail % ring->capacity] = item;
+    atomic_store(&ring->tail, tail + 1);
+    ring_signal(&ring->consumer_waiting, &ring->data_seq);
+    return true;
+}
+
+// free all remaining items and the ring itself (both sides must be stopped)
+void ring_uninit(SpscRing *ring, void (*free_item)(void *item)) {
+    void *item;
+    atomic_store(&ring->closed, false);
+    while (ring_pop(ring, &item, 0) > 0) {
+        if (item) { free_item(item); }
+    }
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+void ring_dump_stats(const SpscRing *ring) {
+    printf("%s queue: depth %u, avg occupancy %.1f, max occupancy %llu, producer stalled %.1f ms, consumer stalled %.1f ms\n",
+           ring->name, ring->capacity,
+           ring->pushes ? ((double)ring->occupancy_sum / (double)ring->pushes) : 0.0,
+           (unsigned long long)ring->occupancy_max,
+           ring->producer_stall_ns * 1e-6, ring->consumer_stall_ns * 1e-6);
+}
+
+// a seek, as requested by the display loop. the demux thread seeks, and
+// then sends a packet with stream_index SEEK_MARKER through the packet queue;
+// the decode thread flushes the decoder when it gets there, and drops the
+// frames before the target. frames carry the serial number of the seek
+// they belong to in their opaque field, so the display loop can tell which
+// ones are from before the seek.
+#define SEEK_MARKER -1
+#define CLIP_MARKER -2
+typedef struct SeekRequest {
+    uint32_t serial;
+    int64_t target;        // pts to resume from, in the stream's time base
+    int64_t pos, dts;      // the keyframe to seek to; pos -1 = not known
+} SeekRequest;
+
+// the next input of a playlist (--playlist, --loop), opened on a thread of
+// its own while the current one plays. at the end of the current input, the
+// demux thread switches to it and passes it on in a CLIP_MARKER packet; the
+// decode thread drains the decoder, keeps using it or switches to a new one,
+// and passes the clip on to the display loop as a frame without any data
+// (see clip_marker()), right behind the last frame of the previous input.
+typedef struct Clip {
+    const char *url;
+    AVFormatContext *input_ctx;
+    int video_stream;
+    AVCodec *decoder;
+    AVCodecContext *decoder_ctx;  // not opened yet; the decode thread opens or frees it
+    int held_frames;              // for populate_context()
+    bool low_delay;
+    bool reuse_decoder;           // same codec parameters as the previous input
+    AVCodecContext *old_decoder;  // the decoder it replaced, if it did
+    AVCodecContext *active_decoder;  // the one the decode thread went on with (not owned)
+    const char *error;            // the call that failed if it can't be decoded; then its
+                                  // packets are dropped, and the previous decoder stays
+} Clip;
+
+// whether a decoder can go on with other codec parameters after a flush
+static bool codec_params_compatible(const AVCodecParameters *a, const AVCodecParameters *b) {
+    return (a->codec_id == b->codec_id) && (a->width == b->width) && (a->height == b->height)
+        && (a->format == b->format) && (a->profile == b->profile) && (a->extradata_size == b->extradata_size)
+        && (!a->extradata_size || !memcmp(a->extradata, b->extradata, a->extradata_size));
+}
+
+// free a clip that never made it to the display loop
+static void clip_free(Clip *clip) {
+    input_close(&clip->input_ctx);
+    avcodec_free_context(&clip->decoder_ctx);
+    avcodec_free_context(&clip->old_decoder);
+    free(clip);
+}
+
+// the opening of a playlist's next input, on a thread of its own. the thread
+// is detached: if the stream stops while it's still at it (a FIFO nobody
+// writes to, a network input that doesn't answer), the stream just gives up
+// on it, and whichever of the two is done last frees it
+typedef struct Prefetch {
+    Clip *clip;            // NULL once the stream took it over
+    Options opts;          // a copy, as the thread may outlive the stream
+    const char *error;     // the call that failed, if the input can't be played
+    pthread_mutex_t lock;
+    pthread_cond_t opened;
+    bool done;
+    atomic_bool cancelled; // also interrupts the opening of a network input
+    int refs;
+} Prefetch;
+
+// the clip behind a frame that marks the beginning of the next input, or NULL
+static inline Clip* clip_marker(const AVFrame *frame) {
+    return frame->buf[0] ? NULL : frame->opaque;
+}
+
+// the decoding pipeline: a demux thread feeds packets to a decode thread,
+// which feeds decoded frames to the display loop in the main thread.
+// a NULL item in a queue signals the end of the stream. used AVPacket and
+// AVFrame objects flow back through pool queues, so that once the pipeline
+// is warmed up, we don't allocate them anymore (the payloads of the packets
+// are still allocated by the demuxer, see install_alloc_counter()).
+typedef struct Pipeline {
+    AVFormatContext *input_ctx;
+    AVCodecContext *decoder_ctx;
+    int video_stream;
+    bool byte_seek;        // seek to keyframes by byte offset rather than dts
+    bool live;             // stamp every frame with the arrival time of its packet
+    bool show_progress;    // print the frame count now and then; set before pipeline_start()
+  #ifdef AV_CODEC_FLAG_COPY_OPAQUE
+    AVBufferPool *arrival_pool;  // for those stamps
+  #endif
+    pthread_mutex_t seek_lock;
+    SeekRequest seek;              // guarded by seek_lock
+    _Atomic uint32_t seek_serial;  // serial of the newest request
+    atomic_bool demux_done;        // too late to seek
+    atomic_bool stopping;          // interrupts the demuxer, see pipeline_interrupted()
+    _Atomic uint64_t decoded_forward;  // frames decoded after a seek, before the target
+    SpscRing packets, frames;
+    SpscRing packet_pool;  // decode thread -> demux thread
+    SpscRing frame_pool;   // display loop -> decode thread
+    int frame_event_fd;  // eventfd that's signalled for every new frame
+    _Atomic uint64_t busy_ns;  // time the decode thread spent in the decoder
+    _Atomic uint64_t decoded;  // frames passed on to the display loop
+    _Atomic int skip_frame;    // AVDiscard the decode thread applies to its decoder
+    // moving to another decoder (see stream_migrate()): the display loop
+    // hands in the new one, and the decode thread hands back the old one
+    // once it has switched
+    _Atomic(AVCodecContext*) next_decoder;
+    _Atomic(AVCodecContext*) old_decoder;
+    // the next input at the end of the current one (called on the demux
+    // thread; may block until it's open), or NULL if there is none; set
+    // before pipeline_start()
+    Clip* (*next_clip)(void *opaque);
+    void *next_clip_opaque;
+    _Atomic uint32_t clips;  // inputs the demux thread has moved on to
+    Clip *stranded_clip;     // a clip the decode thread couldn't pass on any more
+    pthread_t demux_thread, decode_thread;
+} Pipeline;
+
+// AVIOInterruptCB of the pipeline's inputs: a demuxer that waits for data
+// (from a live source that stalled, say) gives up once the pipeline stops
+int pipeline_interrupted(void *opaque) {
+    Pipeline *pipeline = opaque;
+    return atomic_load(&pipeline->stopping);
+}
+
+// demux thread: stamp a packet with the time it arrived, in a way that the
+// decoder passes on to the frame that comes out of it, even if that's
+// delayed or reordered. newer libavcodec copies the packet's opaque_ref to
+// the frame; older versions turn the packet's metadata into the frame's
+static void pipeline_stamp_arrival(Pipeline *pipeline, AVPacket *packet) {
+  #ifdef AV_CODEC_FLAG_COPY_OPAQUE
+    AVBufferRef *stamp = av_buffer_pool_get(pipeline->arrival_pool);
+    if (stamp) {
+        *(int64_t*)stamp->data = now_ns();
+        av_buffer_unref(&packet->opaque_ref);
+        packet->opaque_ref = stamp;
+    }
+  #else
+    (void)pipeline;
+    char stamp[32];
+    int size = snprintf(stamp, sizeof(stamp), "arrival%c%lld", '\0', (long long)now_ns()) + 1;
+    uint8_t *data = av_packet_new_side_data(packet, AV_PKT_DATA_STRINGS_METADATA, size);
+    if (data) {
+        memcpy(data, stamp, size);
+    }
+  #endif
+}
+
+// the arrival time of a frame's packet, or 0 if it wasn't stamped
+static inline int64_t frame_arrival_time(const AVFrame *frame) {
+  #ifdef AV_CODEC_FLAG_COPY_OPAQUE
+    return frame->opaque_ref ? *(const int64_t*)frame->opaque_ref->data : 0;
+  #else
+    const AVDictionaryEntry *entry = av_dict_get(frame->metadata, "arrival", NULL, 0);
+    return entry ? strtoll(entry->value, NULL, 10) : 0;
+  #endif
+}
+
+static void signal_event_fd(int fd) {
+    uint64_t one = 1;
+    ssize_t res = write(fd, &one, sizeof(one));
+    (void)res;  // can only fail if the counter overflows, which is fine too
+}
+
+// reset an eventfd or timerfd after poll() reported it as readable
+static void drain_event_fd(int fd) {
+    uint64_t count;
+    ssize_t res = read(fd, &count, sizeof(count));
+    (void)res;
+}
+
+static void free_packet_item(void *item) {
+    AVPacket *packet = item;
+    av_packet_free(&packet);
+}
+
+// same for the packet queue, where the packets may be clip markers
+static void free_queued_packet(void *item) {
+    AVPacket *packet = item;
+    if (packet->stream_index == CLIP_MARKER) {
+        clip_free((Clip*)(uintptr_t)packet->pos);
+    }
+    av_packet_free(&packet);
+}
+
+static void free_frame_item(void *item) {
+    AVFrame *frame = item;
+    av_frame_free(&frame);
+}
+
+// get an empty packet from the pool, or a new one if there's none yet
+static AVPacket* pipeline_get_packet(Pipeline *pipeline) {
+    AVPacket *packet;
+    if (ring_pop(&pipeline->packet_pool, (void**)&packet, 0) > 0) {
+        return packet;
+    }
+    packet = av_packet_alloc();
+    if (!packet) {
+        fail("av_packet_alloc");
+    }
+    return packet;
+}
+
+// return a packet to the demux thread (this must only be called from the
+// decode thread, as each pool has exactly one producer)
+static void pipeline_recycle_packet(Pipeline *pipeline, AVPacket *packet) {
+    av_packet_unref(packet);
+    if (!ring_try_push(&pipeline->packet_pool, packet)) {
+        av_packet_free(&packet);
+    }
+}
+
+// same for frames
+static AVFrame* pipeline_get_frame(Pipeline *pipeline) {
+    AVFrame *frame;
+    if (ring_pop(&pipeline->frame_pool, (void**)&frame, 0) > 0) {
+        return frame;
+    }
+    frame = av_frame_alloc();
+    if (!frame) {
+        fail("av_frame_alloc");
+    }
+    return frame;
+}
+
+// give a frame that's no longer needed back to the decode thread
+// (this must only be called from the display loop)
+void pipeline_recycle_frame(Pipeline *pipeline, AVFrame *frame) {
+    av_frame_unref(frame);
+    if (!ring_try_push(&pipeline->frame_pool, frame)) {
+        av_frame_free(&frame);
+    }
+}
+
+// seek to the requested keyframe: by byte offset for containers with
+// discontinuous timestamps (MPEG-TS/PS), where that's what the demuxer would
+// do anyway, and by its exact dts for containers with an index of their own;
+// only without a keyframe index entry does the demuxer have to search
+static void demux_seek(Pipeline *pipeline, const SeekRequest *req) {
+    const int64_t t0 = now_ns();
+    const char *how;
+    int ret;
+    if ((req->pos >= 0) && pipeline->byte_seek) {
+        how = "keyframe offset";
+        ret = av_seek_frame(pipeline->input_ctx, -1, req->pos, AVSEEK_FLAG_BYTE);
+    } else if ((req->pos >= 0) && (req->dts != AV_NOPTS_VALUE)) {
+        how = "keyframe timestamp";
+        ret = av_seek_frame(pipeline->input_ctx, pipeline->video_stream, req->dts, AVSEEK_FLAG_BACKWARD);
+    } else {
+        how = "demuxer search";
+        ret = avformat_seek_file(pipeline->input_ctx, pipeline->video_stream, INT64_MIN, req->target, req->target, 0);
+    }
+    printf("\nseek #%u: by %s, %.2f ms%s\n", req->serial, how, (now_ns() - t0) * 1e-6, (ret < 0) ? " (failed)" : "");
+}
+
+// whether to seek to keyframes by byte offset (see demux_seek())
+static bool input_byte_seek(const AVFormatContext *input_ctx) {
+    const int format_flags = input_ctx->iformat->flags;
+    return (format_flags & AVFMT_TS_DISCONT) && !(format_flags & AVFMT_NO_BYTE_SEEK);
+}
+
+// demux thread: read compressed data from the stream
+static void* demux_thread_func(void *arg) {
+    Pipeline *pipeline = arg;
+    alloc_role = ALLOC_ROLE_DEMUX;
+    AVPacket *packet = NULL;
+    uint32_t serial = 0;
+    for (;;) {
+        if (!packet) {
+            packet = pipeline_get_packet(pipeline);
+        }
+        if (atomic_load(&pipeline->seek_serial) != serial) {
+            pthread_mutex_lock(&pipeline->seek_lock);
+            SeekRequest req = pipeline->seek;
+            pthread_mutex_unlock(&pipeline->seek_lock);
+            serial = req.serial;
+            demux_seek(pipeline, &req);
+            packet->stream_index = SEEK_MARKER;
+            packet->pts = req.target;
+            packet->pos = req.serial;
+            if (!ring_push(&pipeline->packets, packet)) {
+                av_packet_free(&packet);
+                return NULL;  // shutting down
+            }
+            packet = NULL;
+            continue;
+        }
+        PROBE_BEGIN(DEMUX);
+        if (av_read_frame(pipeline->input_ctx, packet) < 0) {
+            Clip *clip = pipeline->next_clip ? pipeline->next_clip(pipeline->next_clip_opaque) : NULL;
+            if (!clip) {
+                av_packet_free(&packet);
+                atomic_store(&pipeline->demux_done, true);
+                break;  // end of stream
+            }
+            // continue with the next input; the clip belongs to the other
+            // threads as soon as it's in the queue
+            AVFormatContext *input_ctx = clip->input_ctx;
+            int video_stream = clip->video_stream;
+            clip->reuse_decoder = codec_params_compatible(pipeline->input_ctx->streams[pipeline->video_stream]->codecpar,
+                                                          input_ctx->streams[video_stream]->codecpar);
+            packet->stream_index = CLIP_MARKER;
+            packet->pos = (int64_t)(uintptr_t)clip;
+            if (!ring_push(&pipeline->packets, packet)) {
+                av_packet_free(&packet);
+                clip_free(clip);
+                return NULL;  // shutting down
+            }
+            packet = NULL;
+            atomic_fetch_add(&pipeline->clips, 1);
+            pipeline->input_ctx = input_ctx;
+            pipeline->video_stream = video_stream;
+            pipeline->byte_seek = input_byte_seek(input_ctx);
+            continue;
+        }
+        PROBE_END(DEMUX);
+        if (packet->stream_index != pipeline->video_stream) {
+            av_packet_unref(packet);
+            continue;  // not a video packet; read the next one into it
+        }
+        if (pipeline->live) {
+            pipeline_stamp_arrival(pipeline, packet);
+        }
+        if (!ring_push(&pipeline->packets, packet)) {
+            av_packet_free(&packet);
+            return NULL;  // shutting down
+        }
+        packet = NULL;
+    }
+    ring_push(&pipeline->packets, NULL);
+    return NULL;
+}
+
+// what the decode thread keeps track of across packets
+typedef struct DecodeState {
+    int frameno;
+    int64_t t_progress;   // when the frame count was last printed
+    uint32_t serial;
+    int64_t seek_target;  // drop frames before this after a seek
+    AVFrame *frame;       // kept across packets if the decoder didn't fill it
+    bool skip_input;      // the current input can't be decoded; drop its packets
+} DecodeState;
+
+// pass on all the frames the decoder has ready; returns false if the
+// pipeline is shutting down
+static bool decode_receive_frames(Pipeline *pipeline, AVCodecContext *decoder_ctx, DecodeState *ds) {
+    bool want_new_packet = false;
+    while (!want_new_packet) {
+        if (!ds->frame) {
+            ds->frame = pipeline_get_frame(pipeline);
+        }
+        AVFrame *frame = ds->frame;
+        VASurfaceID va_surface;
+        int64_t t_busy = now_ns();
+        bool got_frame = retrieve_frame(decoder_ctx, frame, &want_new_packet, &ds->frameno, &va_surface);
+        const int64_t now = now_ns();
+        RELAXED_ADD(pipeline->busy_ns, now - t_busy);
+        if (!got_frame) {
+            break;
+        }
+        if (pipeline->show_progress && (now - ds->t_progress >= (int64_t)PROGRESS_INTERVAL_MS * 1000000)) {
+            printf("\rframe #%d (%c) ", ds->frameno, av_get_picture_type_char(frame->pict_type));
+            fflush(stdout);
+            ds->t_progress = now;
+        }
+        if (ds->seek_target != AV_NOPTS_VALUE) {
+            if ((frame->best_effort_timestamp != AV_NOPTS_VALUE) && (frame->best_effort_timestamp < ds->seek_target)) {
+                av_frame_unref(frame);
+                RELAXED_ADD(pipeline->decoded_forward, 1);
+                continue;  // still on the way from the keyframe to the target
+            }
+            ds->seek_target = AV_NOPTS_VALUE;
+        }
+        frame->opaque = (void*)(uintptr_t)ds->serial;
+        if (ds->frameno == 1) {
+            startup_phase_end(STARTUP_FIRST_DECODE);
+        }
+        if (!ring_push(&pipeline->frames, frame)) {
+            return false;  // shutting down
+        }
+        ds->frame = NULL;
+        RELAXED_ADD(pipeline->decoded, 1);
+        signal_event_fd(pipeline->frame_event_fd);
+    }
+    return true;
+}
+
+// the end of an input: drain the decoder, so that no frame of it is lost,
+// and then reset it for the next input, or switch to a new one (on the same
+// device, or on the one the stream is moving to) if that needs one. the
+// clip then goes on to the display loop. returns false if the pipeline is
+// shutting down
+static bool decode_next_clip(Pipeline *pipeline, Clip *clip, DecodeState *ds) {
+    avcodec_send_packet(pipeline->decoder_ctx, NULL);
+    if (!decode_receive_frames(pipeline, pipeline->decoder_ctx, ds)) {
+        pipeline->stranded_clip = clip;
+        return false;
+    }
+    // (after an input that couldn't be decoded, the decoder is still set up
+    // for the one before it)
+    clip->reuse_decoder &= !ds->skip_input;
+    ds->skip_input = false;
+    if (clip->reuse_decoder) {
+        avcodec_flush_buffers(pipeline->decoder_ctx);
+        avcodec_free_context(&clip->decoder_ctx);
+    } else {
+        AVCodecContext *next_decoder = atomic_exchange(&pipeline->next_decoder, NULL);
+        AVBufferRef *hw_device_ctx = (next_decoder ? next_decoder : pipeline->decoder_ctx)->hw_device_ctx;
+        clip->error = try_populate_context(clip->decoder, hw_device_ctx, clip->decoder_ctx, clip->held_frames,
+                                           clip->low_delay);
+        avcodec_free_context(&next_decoder);  // (it was set up for the previous input)
+        if (clip->error) {
+            ds->skip_input = true;  // keep the old decoder, and skip the input
+        } else {
+            clip->old_decoder = pipeline->decoder_ctx;
+            pipeline->decoder_ctx = clip->decoder_ctx;
+            clip->decoder_ctx = NULL;
+        }
+    }
+    clip->active_decoder = pipeline->decoder_ctx;
+    AVFrame *marker = pipeline_get_frame(pipeline);
+    marker->opaque = clip;
+    if (!ring_push(&pipeline->frames, marker)) {
+        av_frame_free(&marker);
+        pipeline->stranded_clip = clip;
+        return false;
+    }
+    signal_event_fd(pipeline->frame_event_fd);
+    return true;
+}
+
+// decode thread: send packets to the decoder and collect the frames
+static void* decode_thread_func(void *arg) {
+    Pipeline *pipeline = arg;
+    alloc_role = ALLOC_ROLE_DECODE;
+    DecodeState ds = { .seek_target = AV_NOPTS_VALUE };
+    AVPacket *packet;
+    int ret;
+    while (((ret = ring_pop(&pipeline->packets, (void**)&packet, -1)) > 0) && packet) {
+        if (packet->stream_index == CLIP_MARKER) {
+            Clip *clip = (Clip*)(uintptr_t)packet->pos;
+            pipeline_recycle_packet(pipeline, packet);
+            if (!decode_next_clip(pipeline, clip, &ds)) {
+                av_frame_free(&ds.frame);
+                return NULL;  // shutting down
+            }
+            continue;
+        }
+        if (packet->stream_index == SEEK_MARKER) {
+            avcodec_flush_buffers(pipeline->decoder_ctx);
+            ds.serial = (uint32_t)packet->pos;
+            ds.seek_target = packet->pts;
+            pipeline_recycle_packet(pipeline, packet);
+            continue;
+        }
+        if ((atomic_load(&pipeline->seek_serial) != ds.serial) || ds.skip_input) {
+            pipeline_recycle_packet(pipeline, packet);
+            continue;  // a seek is on its way, or the input can't be decoded
+        }
+        AVCodecContext *next_decoder = atomic_load(&pipeline->next_decoder);
+        if (next_decoder && (packet->flags & AV_PKT_FLAG_KEY)) {
+            // switch decoders at a keyframe, so the new one doesn't need
+            // anything from before; the old one is drained first, so that
+            // no frame is lost on the way
+            avcodec_send_packet(pipeline->decoder_ctx, NULL);
+            if (!decode_receive_frames(pipeline, pipeline->decoder_ctx, &ds)) {
+                pipeline_recycle_packet(pipeline, packet);
+                av_frame_free(&ds.frame);
+                return NULL;  // shutting down
+            }
+            atomic_store(&pipeline->next_decoder, NULL);
+            atomic_store(&pipeline->old_decoder, pipeline->decoder_ctx);
+            pipeline->decoder_ctx = next_decoder;
+        }
+        pipeline->decoder_ctx->skip_frame = atomic_load_explicit(&pipeline->skip_frame, memory_order_relaxed);
+        int64_t t_busy = now_ns();
+        PROBE_BEGIN(SEND_PACKET);
+        if (avcodec_send_packet(pipeline->decoder_ctx, packet) < 0) {
+            fail("avcodec_send_packet");
+        }
+        PROBE_END(SEND_PACKET);
+        RELAXED_ADD(pipeline->busy_ns, now_ns() - t_busy);
+        pipeline_recycle_packet(pipeline, packet);
+        if (!decode_receive_frames(pipeline, pipeline->decoder_ctx, &ds)) {
+            av_frame_free(&ds.frame);
+            return NULL;  // shutting down
+        }
+    }
+    if (ret > 0) {
+        // the end of the stream: drain the decoder, so that the last frames
+        // it holds back come out too
+        avcodec_send_packet(pipeline->decoder_ctx, NULL);
+        if (!decode_receive_frames(pipeline, pipeline->decoder_ctx, &ds)) {
+            av_frame_free(&ds.frame);
+            return NULL;  // shutting down
+        }
+    }
+    av_frame_free(&ds.frame);
+    ring_push(&pipeline->frames, NULL);
+    signal_event_fd(pipeline->frame_event_fd);
+    return NULL;
+}
+
+void pipeline_start(Pipeline *pipeline, AVFormatContext *input_ctx, AVCodecContext *decoder_ctx, int video_stream,
+                    int frame_event_fd, bool live, int packet_queue_depth, int frame_queue_depth) {
+    pipeline->input_ctx = input_ctx;
+    pipeline->live = live;
+    pipeline->frame_event_fd = frame_event_fd;
+    pipeline->decoder_ctx = decoder_ctx;
+    pipeline->video_stream = video_stream;
+    pipeline->byte_seek = input_byte_seek(input_ctx);
+    atomic_store(&pipeline->skip_frame, AVDISCARD_DEFAULT);
+  #ifdef AV_CODEC_FLAG_COPY_OPAQUE
+    if (live) {
+        pipeline->arrival_pool = av_buffer_pool_init(sizeof(int64_t), NULL);
+        if (!pipeline->arrival_pool) {
+            fail("av_buffer_pool_init");
+        }
+    }
+  #endif
+    pthread_mutex_init(&pipeline->seek_lock, NULL);
+    ring_init(&pipeline->packets, "packet", packet_queue_depth);
+    ring_init(&pipeline->frames,  "frame",  frame_queue_depth);
+    // enough room for every packet/frame that can be in flight at once
+    ring_init(&pipeline->packet_pool, "packet pool", packet_queue_depth + 2);
+    ring_init(&pipeline->frame_pool,  "frame pool",  frame_queue_depth + 8 + MAX_FRAMES_IN_FLIGHT);
+    startup_phase_begin(STARTUP_FIRST_DECODE);
+    if (pthread_create(&pipeline->demux_thread,  NULL, demux_thread_func,  pipeline)
+    ||  pthread_create(&pipeline->decode_thread, NULL, decode_thread_func, pipeline)) {
+        fail("pthread_create");
+    }
+}
+
+// stop the threads, no matter whether they're finished or not
+void pipeline_stop(Pipeline *pipeline) {
+    atomic_store(&pipeline->stopping, true);
+    ring_close(&pipeline->packets);
+    ring_close(&pipeline->frames);
+    pthread_join(pipeline->demux_thread, NULL);
+    pthread_join(pipeline->decode_thread, NULL);
+    ring_dump_stats(&pipeline->packets);
+    ring_dump_stats(&pipeline->frames);
+}
+
+// after pipeline_stop(): the next clip that was passed on to the display
+// loop (or was about to be), but not picked up; frames on the way are freed
+Clip* pipeline_take_clip(Pipeline *pipeline) {
+    AVFrame *frame;
+    while (ring_pop(&pipeline->frames, (void**)&frame, 0) > 0) {
+        Clip *clip = frame ? clip_marker(frame) : NULL;
+        av_frame_free(&frame);
+        if (clip) {
+            return clip;
+        }
+    }
+    Clip *clip = pipeline->stranded_clip;
+    pipeline->stranded_clip = NULL;
+    return clip;
+}
+
+// release everything that's still queued
+void pipeline_uninit(Pipeline *pipeline) {
+    ring_uninit(&pipeline->packets, free_queued_packet);
+    ring_uninit(&pipeline->frames,  free_frame_item);
+    ring_uninit(&pipeline->packet_pool, free_packet_item);
+    ring_uninit(&pipeline->frame_pool,  free_frame_item);
+  #ifdef AV_CODEC_FLAG_COPY_OPAQUE
+    av_buffer_pool_uninit(&pipeline->arrival_pool);  // (frees the stamps once they're all back)
+  #endif
+    pthread_mutex_destroy(&pipeline->seek_lock);
+}
+
+// ask the pipeline to continue at the target pts, from the given keyframe
+// (or NULL to let the demuxer find one); returns false if it's too late
+bool pipeline_seek(Pipeline *pipeline, int64_t target, const KeyframeEntry *keyframe) {
+    if (atomic_load(&pipeline->demux_done)) {
+        return false;
+    }
+    pthread_mutex_lock(&pipeline->seek_lock);
+    pipeline->seek.serial++;
+    pipeline->seek.target = target;
+    pipeline->seek.pos = keyframe ? keyframe->pos : -1;
+    pipeline->seek.dts = keyframe ? keyframe->dts : AV_NOPTS_VALUE;
+    atomic_store(&pipeline->seek_serial, pipeline->seek.serial);
+    pthread_mutex_unlock(&pipeline->seek_lock);
+    return true;
+}
+
+// frame server (--serve): every decoded frame is published to local
+// subscribers over a Unix domain socket. VA-API frames are passed as the DRM
+// PRIME fds of their surface (with SCM_RIGHTS) plus the surface descriptor,
+// so the pixels are never copied; software frames are copied into a memfd
+// and described the same way. a subscriber releases each frame when it's
+// done with it, and until then, the surface stays out of the decoder's pool.
+// the display loop only hands the frames to a thread of its own, which does
+// all the rest, so playback never waits for the subscribers. each subscriber
+// gets as many of the SERVER_HELD_FRAMES slots as it asks for (or is turned
+// away if there aren't enough left), so one that's slow can't starve the
+// others. what happens when a subscriber doesn't keep up is up to the
+// subscriber: it either misses frames, or holds up the server thread (for a
+// while), and then all subscribers miss the frames that come in meanwhile.
+#define FRAME_SERVER_MAGIC      0x53524653  // "SFRS"
+#define MAX_SUBSCRIBERS         16
+#define SERVER_BLOCK_TIMEOUT_MS 100  // longest wait for a blocking subscriber
+#define SERVER_IDLE_MS          100  // how often an idle server looks for subscribers
+
+// subscriber -> server, once after connecting
+typedef struct FrameServerHello {
+    uint32_t magic;
+    uint32_t policy;       // SUBSCRIBE_*
+    uint32_t max_pending;  // frames it may hold before the policy kicks in
+    int32_t stream;        // input to receive, -1 = all
+} FrameServerHello;
+
+// server -> subscriber, one per frame, with desc.num_objects fds attached
+typedef struct FrameServerFrame {
+    uint32_t magic;
+    uint32_t stream;
+    uint64_t sequence;     // identifies the frame when releasing it
+    uint64_t frame_number; // per stream, to detect missed frames
+    int64_t pts;
+    int32_t time_base_num, time_base_den;
+    uint32_t width, height;  // visible size; the surface may be larger
+    uint32_t flags;          // FRAME_SHM
+    uint32_t surface;        // VA surface ID (informational)
+    VADRMPRIMESurfaceDescriptor desc;  // the fds in here are the sender's
+} FrameServerFrame;
+#define FRAME_SHM 1  // linear copy in a memfd instead of a VA surface
+
+// subscriber -> server, when it's done with a frame
+typedef struct FrameServerRelease {
+    uint32_t magic;
+    uint64_t sequence;
+} FrameServerRelease;
+
+typedef struct Subscriber {
+    int fd;                // -1 = unused slot
+    bool ready;            // hello received
+    FrameServerHello hello;
+    uint32_t pending;      // frames sent but not released yet
+    uint64_t sent, dropped;
+} Subscriber;
+
+// a published frame that at least one subscriber still holds
+typedef struct HeldFrame {
+    uint64_t sequence;
+    uint32_t holders;      // bitmask of subscribers
+    AVFrame *frame;        // reference to the VA-API frame
+    int shm_fd;            // memfd for software frames
+    uint8_t *shm;
+    size_t shm_size;
+} HeldFrame;
+
+// a frame on its way from the display loop to the server thread
+typedef struct ServerJob {
+    AVFrame *frame;        // a reference of its own
+    int stream;
+    AVRational time_base;
+    uint64_t frame_number;
+} ServerJob;
+
+// everything but the jobs and the counters marked otherwise belongs to the
+// server thread
+typedef struct FrameServer {
+    const char *path;
+    int listen_fd;
+    Subscriber subscribers[MAX_SUBSCRIBERS];
+    HeldFrame held[SERVER_HELD_FRAMES];
+    uint32_t promised;     // slots the subscribers may hold together
+    uint64_t next_sequence;
+    uint64_t unsent;       // no subscriber took the frame
+    ServerJob jobs[SERVER_QUEUE_DEPTH];
+    SpscRing queue;        // display loop -> server thread
+    SpscRing free_jobs;    // server thread -> display loop
+    atomic_bool stopping;
+    pthread_t thread;
+    // display loop
+    uint64_t frame_numbers[MAX_STREAMS];
+    uint64_t published, overflows;  // overflows: the server thread was busy
+} FrameServer;
+
+static void* frame_server_thread_func(void *opaque);
+
+void frame_server_init(FrameServer *server, const char *path) {
+    memset(server, 0, sizeof(*server));
+    server->path = path;
+    for (int i = 0;  i < MAX_SUBSCRIBERS;  ++i) {
+        server->subscribers[i].fd = -1;
+    }
+    for (int i = 0;  i < SERVER_HELD_FRAMES;  ++i) {
+        server->held[i].shm_fd = -1;
+        server->held[i].frame = av_frame_alloc();
+        if (!server->held[i].frame) {
+            fail("av_frame_alloc");
+        }
+    }
+    ring_init(&server->queue, "frame server", SERVER_QUEUE_DEPTH);
+    ring_init(&server->free_jobs, "frame server jobs", SERVER_QUEUE_DEPTH);
+    for (int i = 0;  i < SERVER_QUEUE_DEPTH;  ++i) {
+        server->jobs[i].frame = av_frame_alloc();
+        if (!server->jobs[i].frame) {
+            fail("av_frame_alloc");
+        }
+        ring_try_push(&server->free_jobs, &server->jobs[i]);
+    }
+    server->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0) {
+        fail("socket");
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fail("socket path length check");
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(server->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(server->listen_fd, MAX_SUBSCRIBERS)) {
+        fail("bind/listen");
+    }
+    if (pthread_create(&server->thread, NULL, frame_server_thread_func, server)) {
+        fail("pthread_create");
+    }
+    printf("frame server: listening on %s\n", path);
+}
+
+// a subscriber no longer holds a frame
+static void held_frame_release(HeldFrame *held, int subscriber) {
+    held->holders &= ~(1u << subscriber);
+    if (!held->holders) {
+        av_frame_unref(held->frame);
+    }
+}
+
+static void frame_server_drop_subscriber(FrameServer *server, int i) {
+    Subscriber *sub = &server->subscribers[i];
+    printf("frame server: subscriber %d left (%llu frames sent, %llu dropped)\n", i,
+           (unsigned long long)sub->sent, (unsigned long long)sub->dropped);
+    close(sub->fd);
+    sub->fd = -1;
+    if (sub->ready) {
+        server->promised -= sub->hello.max_pending;
+    }
+    for (int h = 0;  h < SERVER_HELD_FRAMES;  ++h) {
+        if (server->held[h].holders & (1u << i)) {
+            held_frame_release(&server->held[h], i);
+        }
+    }
+}
+
+// accept new subscribers and handle the messages of the existing ones;
+// never blocks
+void frame_server_service(FrameServer *server) {
+    int fd;
+    while ((fd = accept(server->listen_fd, NULL, NULL)) >= 0) {
+        int i = 0;
+        while ((i < MAX_SUBSCRIBERS) && (server->subscribers[i].fd >= 0)) { ++i; }
+        if (i == MAX_SUBSCRIBERS) {
+            close(fd);  // full
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        server->subscribers[i] = (Subscriber){ .fd = fd };
+    }
+    for (int i = 0;  i < MAX_SUBSCRIBERS;  ++i) {
+        Subscriber *sub = &server->subscribers[i];
+        while (sub->fd >= 0) {
+            union { FrameServerHello hello; FrameServerRelease release; } msg;
+            ssize_t size = recv(sub->fd, &msg, sizeof(msg), MSG_DONTWAIT);
+            if ((size < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+                break;
+            }
+            if (size <= 0) {
+                frame_server_drop_subscriber(server, i);  // gone
+            } else if (!sub->ready) {
+                if ((size != sizeof(msg.hello)) || (msg.hello.magic != FRAME_SERVER_MAGIC)
+                || (msg.hello.policy > SUBSCRIBE_BLOCK) || !msg.hello.max_pending) {
+                    frame_server_drop_subscriber(server, i);  // protocol error
+                    break;
+                }
+                if (msg.hello.max_pending > SERVER_HELD_FRAMES - server->promised) {
+                    printf("frame server: subscriber %d wants to hold %u frames, but only %u are left\n", i,
+                           msg.hello.max_pending, SERVER_HELD_FRAMES - server->promised);
+                    frame_server_drop_subscriber(server, i);
+                    break;
+                }
+                sub->hello = msg.hello;
+                sub->ready = true;
+                server->promised += sub->hello.max_pending;
+                printf("frame server: subscriber %d joined (stream %d, %s policy, %u frames)\n", i,
+                       (int)sub->hello.stream, subscribe_policy_names[sub->hello.policy], sub->hello.max_pending);
+            } else if ((size == sizeof(msg.release)) && (msg.release.magic == FRAME_SERVER_MAGIC)) {
+                for (int h = 0;  h < SERVER_HELD_FRAMES;  ++h) {
+                    HeldFrame *held = &server->held[h];
+                    if ((held->holders & (1u << i)) && (held->sequence == msg.release.sequence)) {
+                        held_frame_release(held, i);
+                        sub->pending--;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// wait (until the deadline at most) for any subscriber message
+static void frame_server_wait(FrameServer *server, int64_t deadline) {
+    struct pollfd fds[MAX_SUBSCRIBERS];
+    int n = 0;
+    for (int i = 0;  i < MAX_SUBSCRIBERS;  ++i) {
+        if (server->subscribers[i].fd >= 0) {
+            fds[n++] = (struct pollfd){ .fd = server->subscribers[i].fd, .events = POLLIN };
+        }
+    }
+    int64_t remaining = deadline - now_ns();
+    if ((n > 0) && (remaining > 0)) {
+        poll(fds, n, (int)((remaining + 999999) / 1000000));
+    }
+    frame_server_service(server);
+}
+
+static HeldFrame* frame_server_free_slot(FrameServer *server) {
+    for (int h = 0;  h < SERVER_HELD_FRAMES;  ++h) {
+        if (!server->held[h].holders) {
+            return &server->held[h];
+        }
+    }
+    return NULL;
+}
+
+// copy 10-bit planar samples into P010 (MSB-aligned, chroma interleaved)
+static void copy_yuv420p10_to_p010(uint8_t *dst, uint32_t pitch, const AVFrame *frame, int p, int rows) {
+    const int w = p ? (frame->width + 1) / 2 : frame->width;
+    for (int y = 0;  y < rows;  ++y) {
+        uint16_t *out = (uint16_t*)&dst[(size_t)y * pitch];
+        if (!p) {
+            const uint16_t *in = (const uint16_t*)&frame->data[0][y * frame->linesize[0]];
+            for (int x = 0;  x < w;  ++x) {
+                out[x] = (uint16_t)(in[x] << 6);
+            }
+        } else {
+            const uint16_t *u = (const uint16_t*)&frame->data[1][y * frame->linesize[1]];
+            const uint16_t *v = (const uint16_t*)&frame->data[2][y * frame->linesize[2]];
+            for (int x = 0;  x < w;  ++x) {
+                out[2 * x]     = (uint16_t)(u[x] << 6);
+                out[2 * x + 1] = (uint16_t)(v[x] << 6);
+            }
+        }
+    }
+}
+
+// copy a software frame into the slot's memfd and describe it. 10-bit
+// planar frames are served as P010, like the hardware decoder's (there's
+// no VA fourcc for them)
+static bool frame_server_copy_to_shm(HeldFrame *held, const AVFrame *frame, VADRMPRIMESurfaceDescriptor *desc) {
+    int layout;
+    uint32_t drm_format;
+    switch (frame->format) {
+        case AV_PIX_FMT_NV12:      layout = PLANES_NV12;   drm_format = DRM_FORMAT_NV12;   break;
+        case AV_PIX_FMT_P010:
+        case AV_PIX_FMT_YUV420P10: layout = PLANES_P010;   drm_format = DRM_FORMAT_P010;   break;
+        case AV_PIX_FMT_YUV420P:
+        case AV_PIX_FMT_YUVJ420P:  layout = PLANES_YUV420; drm_format = DRM_FORMAT_YUV420; break;
+        default: return false;
+    }
+    const PlaneLayout *pl = &plane_layouts[layout];
+    const int sample_bytes = (pl->bits > 8) ? 2 : 1;
+    memset(desc, 0, sizeof(*desc));
+    desc->fourcc = pl->va_fourcc;
+    desc->width  = frame->width;
+    desc->height = frame->height;
+    desc->num_layers = 1;
+    desc->layers[0].drm_format = drm_format;
+    desc->layers[0].num_planes = pl->num_planes;
+    size_t size = 0;
+    for (int p = 0;  p < pl->num_planes;  ++p) {
+        int w = p ? (frame->width + 1) / 2 : frame->width;
+        int texel_bytes = ((p && (pl->num_planes == 2)) ? 2 : 1) * sample_bytes;
+        desc->layers[0].offset[p] = size;
+        desc->layers[0].pitch[p]  = w * texel_bytes;
+        size += (size_t)desc->layers[0].pitch[p] * (p ? (frame->height + 1) / 2 : frame->height);
+    }
+    if (size > held->shm_size) {
+        if (held->shm) {
+            munmap(held->shm, held->shm_size);
+            held->shm = NULL;
+        }
+        if (held->shm_fd < 0) {
+            held->shm_fd = syscall(SYS_memfd_create, "frame", 0);
+            if (held->shm_fd >= 0) {
+                fcntl(held->shm_fd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+        if ((held->shm_fd < 0) || ftruncate(held->shm_fd, size)) {
+            fail("memfd_create/ftruncate");
+        }
+        held->shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, held->shm_fd, 0);
+        if (held->shm == MAP_FAILED) {
+            fail("mmap");
+        }
+        held->shm_size = size;
+    }
+    for (int p = 0;  p < pl->num_planes;  ++p) {
+        int rows = p ? (frame->height + 1) / 2 : frame->height;
+        uint32_t pitch = desc->layers[0].pitch[p];
+        uint8_t *dst = held->shm + desc->layers[0].offset[p];
+        if (frame->format == AV_PIX_FMT_YUV420P10) {
+            copy_yuv420p10_to_p010(dst, pitch, frame, p, rows);
+            continue;
+        }
+        for (int y = 0;  y < rows;  ++y) {
+            memcpy(&dst[(size_t)y * pitch], &frame->data[p][y * frame->linesize[p]], pitch);
+        }
+    }
+    desc->num_objects = 1;
+    desc->objects[0].fd = held->shm_fd;
+    desc->objects[0].size = held->shm_size;
+    desc->objects[0].drm_format_modifier = DRM_FORMAT_MOD_LINEAR;
+    return true;
+}
+
+// send a frame message with the descriptor's fds; returns 1 if it was
+// sent, 0 if the subscriber's socket is full, and -1 on error
+static int send_frame_message(int fd, const FrameServerFrame *msg) {
+    int fds[4];
+    const int num_fds = msg->desc.num_objects;
+    for (int i = 0;  i < num_fds;  ++i) {
+        fds[i] = msg->desc.objects[i].fd;
+    }
+    union { char buf[CMSG_SPACE(sizeof(fds))]; struct cmsghdr align; } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = (void*)msg, .iov_len = sizeof(*msg) };
+    struct msghdr mh = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buf, .msg_controllen = CMSG_SPACE(sizeof(int) * num_fds),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * num_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    if (sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0) {
+        return 1;
+    }
+    return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+}
+
+// send a frame to all subscribers that want it (and can take it); on the
+// server thread
+static void frame_server_send(FrameServer *server, ServerJob *job) {
+    const AVFrame *frame = job->frame;
+
+    // find out who gets the frame; blocking subscribers get some time to
+    // release what they hold before they miss it
+    const int64_t deadline = now_ns() + (int64_t)SERVER_BLOCK_TIMEOUT_MS * 1000000;
+    uint32_t recipients = 0;
+    for (int i = 0;  i < MAX_SUBSCRIBERS;  ++i) {
+        Subscriber *sub = &server->subscribers[i];
+        if ((sub->fd < 0) || !sub->ready || ((sub->hello.stream >= 0) && (sub->hello.stream != job->stream))) {
+            continue;
+        }
+        while ((sub->fd >= 0) && (sub->pending >= sub->hello.max_pending) && (sub->hello.policy == SUBSCRIBE_BLOCK)
+        &&     (now_ns() < deadline) && !atomic_load(&server->stopping)) {
+            frame_server_wait(server, deadline);
+        }
+        if (sub->fd < 0) {
+            continue;  // left while we waited
+        }
+        if (sub->pending < sub->hello.max_pending) {
+            recipients |= 1u << i;
+        } else {
+            sub->dropped++;
+        }
+    }
+    // every subscriber holds no more than it was promised, so this can only
+    // fail if someone left in between and took their promise with them
+    HeldFrame *held = frame_server_free_slot(server);
+    if (!recipients || !held) {
+        server->unsent++;
+        return;
+    }
+
+    FrameServerFrame msg = {
+        .magic = FRAME_SERVER_MAGIC,
+        .stream = job->stream,
+        .sequence = ++server->next_sequence,
+        .frame_number = job->frame_number,
+        .pts = frame->best_effort_timestamp,
+        .time_base_num = job->time_base.num, .time_base_den = job->time_base.den,
+        .width = frame->width, .height = frame->height,
+    };
+    if (frame->format == AV_PIX_FMT_VAAPI) {
+        // the subscribers can't tell when decoding has finished, so make
+        // sure it has
+        VADisplay va_display = frame_va_display(frame);
+        msg.surface = (uintptr_t)frame->data[3];
+        if ((vaSyncSurface(va_display, msg.surface) != VA_STATUS_SUCCESS)
+        ||  !export_surface(va_display, msg.surface, false, &msg.desc)) {
+            server->unsent++;
+            return;
+        }
+    } else {
+        msg.flags = FRAME_SHM;
+        if (!frame_server_copy_to_shm(held, frame, &msg.desc)) {
+            server->unsent++;
+            return;
+        }
+    }
+
+    held->sequence = msg.sequence;
+    held->holders = 0;
+    for (int i = 0;  i < MAX_SUBSCRIBERS;  ++i) {
+        if (!(recipients & (1u << i))) {
+            continue;
+        }
+        Subscriber *sub = &server->subscribers[i];
+        if (sub->fd < 0) {
+            continue;  // left while we waited for someone else
+        }
+        int ret = send_frame_message(sub->fd, &msg);
+        if (ret > 0) {
+            held->holders |= 1u << i;
+            sub->pending++;
+            sub->sent++;
+        } else if (ret == 0) {
+            sub->dropped++;
+        } else {
+            frame_server_drop_subscriber(server, i);
+        }
+    }
+    if (!held->holders) {
+        server->unsent++;
+    } else if (frame->format == AV_PIX_FMT_VAAPI) {
+        av_frame_move_ref(held->frame, job->frame);
+    }
+    if (!(msg.flags & FRAME_SHM)) {
+        // the subscribers have their own copies of the fds now
+        for (int i = 0;  i < (int)msg.desc.num_objects;  ++i) {
+            close(msg.desc.objects[i].fd);
+        }
+    }
+}
+
+static void* frame_server_thread_func(void *opaque) {
+    FrameServer *server = opaque;
+    while (!atomic_load(&server->stopping)) {
+        ServerJob *job;
+        int ret = ring_pop(&server->queue, (void**)&job, (int64_t)SERVER_IDLE_MS * 1000000);
+        if (ret < 0) {
+            break;
+        }
+        frame_server_service(server);
+        if (ret > 0) {
+            frame_server_send(server, job);
+            av_frame_unref(job->frame);
+            ring_try_push(&server->free_jobs, job);
+        }
+    }
+    return NULL;
+}
+
+// hand a decoded frame to the server thread, from the display loop; never
+// blocks. if the server thread is still busy with earlier frames, e.g.
+// waiting for a blocking subscriber, nobody gets this one.
+void frame_server_publish(FrameServer *server, int stream, AVRational time_base, const AVFrame *frame) {
+    const uint64_t frame_number = server->frame_numbers[stream]++;
+    server->published++;
+    ServerJob *job;
+    if (ring_pop(&server->free_jobs, (void**)&job, 0) <= 0) {
+        server->overflows++;
+        return;
+    }
+    if (av_frame_ref(job->frame, frame) < 0) {
+        fail("av_frame_ref");
+    }
+    job->stream = stream;
+    job->time_base = time_base;
+    job->frame_number = frame_number;
+    ring_try_push(&server->queue, job);  // can't be full, there are no more jobs than slots
+}
+
+static void server_job_unref(void *item) {
+    ServerJob *job = item;
+    av_frame_unref(job->frame);
+}
+
+void frame_server_uninit(FrameServer *server) {
+    atomic_store(&server->stopping, true);
+    ring_close(&server->queue);
+    ring_close(&server->free_jobs);
+    pthread_join(server->thread, NULL);
+    ring_uninit(&server->queue, server_job_unref);
+    ring_uninit(&server->free_jobs, server_job_unref);
+    for (int i = 0;  i < SERVER_QUEUE_DEPTH;  ++i) {
+        av_frame_free(&server->jobs[i].frame);
+    }
+    for (int i = 0;  i < MAX_SUBSCRIBERS;  ++i) {
+        if (server->subscribers[i].fd >= 0) {
+            frame_server_drop_subscriber(server, i);
+        }
+    }
+    for (int h = 0;  h < SERVER_HELD_FRAMES;  ++h) {
+        HeldFrame *held = &server->held[h];
+        av_frame_free(&held->frame);
+        if (held->shm) {
+            munmap(held->shm, held->shm_size);
+        }
+        if (held->shm_fd >= 0) {
+            close(held->shm_fd);
+        }
+    }
+    close(server->listen_fd);
+    unlink(server->path);
+    printf("frame server: %llu frames published, %llu not sent to anyone (%llu of them while it was busy)\n",
+           (unsigned long long)server->published, (unsigned long long)(server->unsent + server->overflows),
+           (unsigned long long)server->overflows);
+}
+
+// subscriber mode (--subscribe): attach to a frame server, and map and
+// checksum every frame it gets (software frames only; the fds of VA-API
+// frames are just counted), to check the whole thing without any GPU
+void run_subscriber(const char *path, int policy, int max_pending, int stream) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if ((fd < 0) || (strlen(path) >= sizeof(addr.sun_path))) {
+        fail("socket");
+    }
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        fail("connect");
+    }
+    FrameServerHello hello = { FRAME_SERVER_MAGIC, policy, max_pending, stream };
+    if (send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+        fail("send");
+    }
+    uint64_t received = 0, missed = 0, shm_bytes = 0, checksum = 0;
+    uint64_t next_number[MAX_STREAMS];
+    memset(next_number, 0, sizeof(next_number));
+    const int64_t t0 = now_ns();
+    for (;;) {
+        FrameServerFrame msg;
+        union { char buf[CMSG_SPACE(sizeof(int) * 4)]; struct cmsghdr align; } control;
+        struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+        struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+        ssize_t size = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+        if (size <= 0) {
+            break;  // server gone
+        }
+        int fds[4], num_fds = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);  cmsg;  cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+            if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+                num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * num_fds);
+            }
+        }
+        if ((size != sizeof(msg)) || (msg.magic != FRAME_SERVER_MAGIC) || (msg.stream >= MAX_STREAMS)) {
+            fail("frame message check");
+        }
+        received++;
+        if (next_number[msg.stream]) {
+            missed += msg.frame_number - next_number[msg.stream];
+        }
+        next_number[msg.stream] = msg.frame_number + 1;
+        if ((msg.flags & FRAME_SHM) && (num_fds == 1)) {
+            size_t map_size = msg.desc.objects[0].size;
+            const uint8_t *data = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fds[0], 0);
+            if (data == MAP_FAILED) {
+                fail("mmap");
+            }
+            const uint8_t *luma = data + msg.desc.layers[0].offset[0];
+            for (uint32_t y = 0;  y < msg.height;  y += 16) {
+                checksum += luma[(size_t)y * msg.desc.layers[0].pitch[0]];
+            }
+            shm_bytes += map_size;
+            munmap((void*)data, map_size);
+        }
+        for (int i = 0;  i < num_fds;  ++i) {
+            close(fds[i]);
+        }
+        FrameServerRelease release = { FRAME_SERVER_MAGIC, msg.sequence };
+        send(fd, &release, sizeof(release), MSG_NOSIGNAL);
+        printf("\rreceived %llu frames, missed %llu ", (unsigned long long)received, (unsigned long long)missed);
+        fflush(stdout);
+    }
+    double elapsed = (now_ns() - t0) * 1e-9;
+    printf("\nsubscriber: %llu frames in %.3f s (%.2f frames/s), missed %llu, %.1f MiB mapped, checksum %llu\n",
+           (unsigned long long)received, elapsed, received / elapsed, (unsigned long long)missed,
+           shm_bytes / 1048576.0, (unsigned long long)checksum);
+    close(fd);
+}
+
+// adaptive load shedding (for paced playback): when a stream can't be
+// decoded in real time, its decoder is told to skip non-reference frames,
+// then all B-frames, then everything but keyframes, and it steps back up
+// once there's room again. decisions are made for all streams together
+// every SKIP_INTERVAL_MS, from how late the frames were presented, how many
+// decoded frames were queued and how busy the decode thread was.
+enum { SKIP_NONE, SKIP_NONREF, SKIP_BIDIR, SKIP_NONKEY, NUM_SKIP_LEVELS };
+static const enum AVDiscard skip_discards[NUM_SKIP_LEVELS] = {
+    AVDISCARD_NONE, AVDISCARD_NONREF, AVDISCARD_BIDIR, AVDISCARD_NONKEY
+};
+static const char* const skip_names[NUM_SKIP_LEVELS] = { "none", "nonref", "bidir", "nonkey" };
+
+typedef struct SkipControl {
+    bool enabled;          // off for unpaced playback, or after a manual change
+    int level;             // SKIP_*
+    int healthy;           // consecutive intervals without overload
+    int recover_after;     // healthy intervals needed to step back up
+    int64_t t_level;       // when the current level was entered
+    int64_t t_step_up;     // when the last step up happened
+    int64_t level_ns[NUM_SKIP_LEVELS];
+    uint64_t changes;
+    // the current interval: lag and queue depth samples of the presented
+    // frames, and the counter values it started with
+    int64_t t_window, lag_ns;
+    uint64_t samples, queued;
+    uint64_t busy_base, behind_base, resync_base;
+} SkipControl;
+
+void skip_control_init(SkipControl *sc, bool enabled, int64_t now) {
+    memset(sc, 0, sizeof(*sc));
+    sc->enabled = enabled;
+    sc->recover_after = SKIP_RECOVER_INTERVALS;
+    sc->t_level = sc->t_window = now;
+}
+
+// switch to another level, and tell the decode thread (which applies it to
+// whatever decoder it's using with the next packet)
+static void skip_control_set(SkipControl *sc, Pipeline *pipeline, int level, int64_t now) {
+    sc->level_ns[sc->level] += now - sc->t_level;
+    sc->t_level = now;
+    sc->level = level;
+    sc->changes++;
+    atomic_store_explicit(&pipeline->skip_frame, skip_discards[level], memory_order_relaxed);
+}
+
+void skip_control_dump_stats(const SkipControl *sc, int64_t now) {
+    if (!sc->enabled && !sc->changes) {
+        return;
+    }
+    int64_t total = 0, level_ns[NUM_SKIP_LEVELS];
+    for (int i = 0;  i < NUM_SKIP_LEVELS;  ++i) {
+        level_ns[i] = sc->level_ns[i] + ((i == sc->level) ? (now - sc->t_level) : 0);
+        total += level_ns[i];
+    }
+    printf("skip_frame: %llu changes;", (unsigned long long)sc->changes);
+    for (int i = 0;  i < NUM_SKIP_LEVELS;  ++i) {
+        printf(" %s %.1f s (%.1f%%)", skip_names[i], level_ns[i] * 1e-9, total ? (100.0 * level_ns[i] / total) : 0.0);
+    }
+    printf("\n");
+}
+
+// the stream scheduler: which device decodes which stream. a new stream
+// goes to the least loaded device that supports its codec and has a session
+// left, or to software decoding if there's none. during paced playback, the
+// decode load of the streams is measured, and when a device is saturated
+// (one of its streams is skipping frames, or its decoder is busy all the
+// time), one stream per interval may be moved to a device with more room.
+// the policy is a pair of function pointers, so that it can be replaced, and
+// tried out on simulated devices (--simulate-scheduler).
+#define SCHED_SOFTWARE -1  // the "device" of streams that are decoded on the CPU
+
+typedef struct SchedDevice {
+    const char *name;
+    const enum AVCodecID *codecs;
+    int num_codecs;
+    int max_sessions;
+    // maintained by the scheduler, from the state of the streams
+    int sessions;
+    double load;       // sum of the loads of its streams
+    bool saturated;    // one of its streams is overloaded
+} SchedDevice;
+
+typedef struct SchedStream {
+    enum AVCodecID codec;  // AV_CODEC_ID_NONE = software decoding only
+    double pixel_rate;     // pixels per second
+    double load;           // measured share of its decoder's time; < 0 = not yet
+    bool overloaded;       // skipping frames, or its decoder is busy all the time
+    int device;            // index, or SCHED_SOFTWARE
+    int holdoff;           // intervals until it may be moved again
+} SchedStream;
+
+typedef struct SchedulerPolicy {
+    const char *name;
+    void *opaque;
+    // pick a device for a new stream; SCHED_SOFTWARE if none can take it
+    int (*assign)(void *opaque, const SchedDevice *devices, int num_devices, const SchedStream *stream);
+    // pick a stream to move, and where to; returns false to leave them be
+    bool (*rebalance)(void *opaque, const SchedDevice *devices, int num_devices,
+                      const SchedStream *streams, int num_streams, int *stream, int *device);
+} SchedulerPolicy;
+
+typedef struct Scheduler {
+    SchedulerPolicy policy;
+    SchedDevice devices[MAX_DEVICES];
+    int num_devices;
+    SchedStream streams[MAX_STREAMS];
+    int num_streams;
+    uint64_t migrations;
+} Scheduler;
+
+// a stream's load, or an estimate from its pixel rate until it's measured
+double sched_stream_load(const SchedStream *stream) {
+    return (stream->load >= 0.0) ? stream->load : (stream->pixel_rate / SCHED_DEVICE_PIXEL_RATE);
+}
+
+bool sched_device_accepts(const SchedDevice *device, const SchedStream *stream) {
+    if (device->sessions >= device->max_sessions) {
+        return false;
+    }
+    for (int c = 0;  c < device->num_codecs;  ++c) {
+        if (device->codecs[c] == stream->codec) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the default policy: new streams go to the least loaded device that
+// isn't saturated (or, if they all are, to the least loaded one) ...
+static int least_loaded_assign(void *opaque, const SchedDevice *devices, int num_devices, const SchedStream *stream) {
+    (void)opaque;
+    int best = SCHED_SOFTWARE;
+    for (int d = 0;  d < num_devices;  ++d) {
+        if (!sched_device_accepts(&devices[d], stream)) {
+            continue;
+        }
+        if ((best == SCHED_SOFTWARE) || (devices[best].saturated && !devices[d].saturated)
+        || ((devices[best].saturated == devices[d].saturated) && (devices[d].load < devices[best].load))) {
+            best = d;
+        }
+    }
+    return best;
+}
+
+// ... and the busiest stream of a saturated device moves to the least loaded
+// device that isn't, if that leaves both less loaded than the saturated one
+static bool least_loaded_rebalance(void *opaque, const SchedDevice *devices, int num_devices,
+                                   const SchedStream *streams, int num_streams, int *stream, int *device) {
+    (void)opaque;
+    for (int from = 0;  from < num_devices;  ++from) {
+        if (!devices[from].saturated) {
+            continue;
+        }
+        int busiest = -1;
+        for (int s = 0;  s < num_streams;  ++s) {
+            if ((streams[s].device == from) && !streams[s].holdoff
+            && ((busiest < 0) || (sched_stream_load(&streams[s]) > sched_stream_load(&streams[busiest])))) {
+                busiest = s;
+            }
+        }
+        if (busiest < 0) {
+            continue;
+        }
+        int to = -1;
+        for (int d = 0;  d < num_devices;  ++d) {
+            if ((d != from) && !devices[d].saturated && sched_device_accepts(&devices[d], &streams[busiest])
+            && ((to < 0) || (devices[d].load < devices[to].load))) {
+                to = d;
+            }
+        }
+        if ((to >= 0) && (devices[to].load + sched_stream_load(&streams[busiest]) < devices[from].load)) {
+            *stream = busiest;
+            *device = to;
+            return true;
+        }
+    }
+    return false;
+}
+
+const SchedulerPolicy least_loaded_policy = {
+    .name      = "least loaded",
+    .assign    = least_loaded_assign,
+    .rebalance = least_loaded_rebalance,
+};
+
+void scheduler_init(Scheduler *sched, const SchedulerPolicy *policy) {
+    memset(sched, 0, sizeof(*sched));
+    sched->policy = *policy;
+}
+
+void scheduler_add_device(Scheduler *sched, const char *name, const enum AVCodecID *codecs, int num_codecs,
+                          int max_sessions) {
+    if (sched->num_devices >= MAX_DEVICES) {
+        fail("device count check");  // at most MAX_DEVICES
+    }
+    sched->devices[sched->num_devices++] = (SchedDevice){
+        .name = name, .codecs = codecs, .num_codecs = num_codecs, .max_sessions = max_sessions,
+    };
+}
+
+static const char* scheduler_device_name(const Scheduler *sched, int device) {
+    return (device == SCHED_SOFTWARE) ? "software" : sched->devices[device].name;
+}
+
+// recompute the sessions, load and saturation of the devices
+static void scheduler_refresh(Scheduler *sched) {
+    for (int d = 0;  d < sched->num_devices;  ++d) {
+        sched->devices[d].sessions = 0;
+        sched->devices[d].load = 0.0;
+        sched->devices[d].saturated = false;
+    }
+    for (int s = 0;  s < sched->num_streams;  ++s) {
+        const SchedStream *stream = &sched->streams[s];
+        if (stream->device != SCHED_SOFTWARE) {
+            SchedDevice *device = &sched->devices[stream->device];
+            device->sessions++;
+            device->load += sched_stream_load(stream);
+            device->saturated |= stream->overloaded;
+        }
+    }
+}
+
+// the policy's choice of device, if it's actually one that can take the stream
+static bool scheduler_valid_choice(const Scheduler *sched, const SchedStream *stream, int device) {
+    return (device == SCHED_SOFTWARE)
+        || ((device >= 0) && (device < sched->num_devices) && sched_device_accepts(&sched->devices[device], stream));
+}
+
+// place a new stream; returns its device, or SCHED_SOFTWARE
+int scheduler_add_stream(Scheduler *sched, enum AVCodecID codec, double pixel_rate) {
+    if (sched->num_streams >= MAX_STREAMS) {
+        fail("stream count check");  // at most MAX_STREAMS
+    }
+    scheduler_refresh(sched);
+    SchedStream *stream = &sched->streams[sched->num_streams];
+    *stream = (SchedStream){ .codec = codec, .pixel_rate = pixel_rate, .load = -1.0, .device = SCHED_SOFTWARE };
+    int device = sched->policy.assign(sched->policy.opaque, sched->devices, sched->num_devices, stream);
+    stream->device = scheduler_valid_choice(sched, stream, device) ? device : SCHED_SOFTWARE;
+    sched->num_streams++;
+    return stream->device;
+}
+
+// one round of rebalancing, after the load and overloaded fields of the
+// streams have been updated; returns true if *stream is to move to *device
+bool scheduler_rebalance(Scheduler *sched, int *stream, int *device) {
+    for (int s = 0;  s < sched->num_streams;  ++s) {
+        if (sched->streams[s].holdoff > 0) {
+            sched->streams[s].holdoff--;
+        }
+    }
+    scheduler_refresh(sched);
+    if (!sched->policy.rebalance(sched->policy.opaque, sched->devices, sched->num_devices,
+                                 sched->streams, sched->num_streams, stream, device)) {
+        return false;
+    }
+    if ((*stream < 0) || (*stream >= sched->num_streams) || (sched->streams[*stream].device == *device)
+    ||  !scheduler_valid_choice(sched, &sched->streams[*stream], *device)) {
+        return false;
+    }
+    SchedStream *moved = &sched->streams[*stream];
+    moved->device = *device;
+    moved->load = -1.0;  // the old measurement doesn't say much about the new device
+    moved->holdoff = SCHED_HOLDOFF_INTERVALS;
+    sched->migrations++;
+    scheduler_refresh(sched);
+    return true;
+}
+
+void scheduler_dump_stats(Scheduler *sched) {
+    scheduler_refresh(sched);
+    printf("scheduler (%s): %llu migrations;", sched->policy.name, (unsigned long long)sched->migrations);
+    int software = 0;
+    for (int s = 0;  s < sched->num_streams;  ++s) {
+        software += (sched->streams[s].device == SCHED_SOFTWARE);
+    }
+    for (int d = 0;  d < sched->num_devices;  ++d) {
+        const SchedDevice *device = &sched->devices[d];
+        printf(" %s %d/%d streams, load %.0f%%;", device->name, device->sessions, device->max_sessions,
+               device->load * 100.0);
+    }
+    printf(" software %d streams\n", software);
+}
+
+// --simulate-scheduler: the policy against simulated devices, which decode
+// a given number of pixels per second. a stream's load is its pixel rate
+// divided by that, and a device with a total load above 1 can't keep up, so
+// all of its streams are overloaded. one stream joins per interval, then the
+// first device throttles to half its speed, and the scheduler gets a few more
+// intervals to settle. every interval, the streams have to be on devices that
+// support their codecs, within the session limits; for the default policy,
+// the placements and moves have to be the expected ones as well. returns
+// false if anything isn't.
+#define SIM_SETTLE_INTERVALS 8
+bool run_scheduler_simulation(const SchedulerPolicy *policy) {
+    static const enum AVCodecID igpu_codecs[] = { AV_CODEC_ID_H264, AV_CODEC_ID_HEVC, AV_CODEC_ID_VP9 };
+    static const enum AVCodecID dgpu_codecs[] = { AV_CODEC_ID_H264, AV_CODEC_ID_HEVC, AV_CODEC_ID_VP9, AV_CODEC_ID_AV1 };
+    static const enum AVCodecID old_codecs[]  = { AV_CODEC_ID_MPEG2VIDEO, AV_CODEC_ID_H264 };
+    static const struct { const char *name; const enum AVCodecID *codecs; int num_codecs, max_sessions;
+                          double capacity; } sim_devices[] = {
+        { "igpu",   igpu_codecs, 3, 8, 1920.0 * 1080 * 300 },
+        { "dgpu",   dgpu_codecs, 4, 6, 3840.0 * 2160 * 240 },
+        { "legacy", old_codecs,  2, 2, 1920.0 * 1080 * 60  },
+    };
+    // (and the device the default policy puts them on)
+    static const struct { enum AVCodecID codec; int width, height, fps, expected; } sim_streams[] = {
+        { AV_CODEC_ID_H264,       1920, 1080, 30, 0 },
+        { AV_CODEC_ID_HEVC,       3840, 2160, 60, 1 },
+        { AV_CODEC_ID_H264,       1280,  720, 30, 2 },
+        { AV_CODEC_ID_VP9,        1920, 1080, 60, 0 },
+        { AV_CODEC_ID_MPEG2VIDEO,  720,  576, 25, 2 },
+        { AV_CODEC_ID_AV1,        3840, 2160, 30, 1 },
+        { AV_CODEC_ID_H264,       1920, 1080, 60, 0 },
+        { AV_CODEC_ID_HEVC,       1920, 1080, 60, 1 },
+        { AV_CODEC_ID_VC1,        1920, 1080, 30, SCHED_SOFTWARE },  // no device can decode it
+        { AV_CODEC_ID_HEVC,       3840, 2160, 30, 1 },
+        { AV_CODEC_ID_H264,       3840, 2160, 30, 0 },
+        { AV_CODEC_ID_VP9,        3840, 2160, 60, 1 },
+    };
+    // the moves the default policy makes once the igpu throttles: its
+    // busiest stream goes to the dgpu, whose last session it takes
+    static const struct { int interval, stream, device; } expected_moves[] = {
+        { 12, 10, 1 },
+    };
+    const int num_devices = sizeof(sim_devices) / sizeof(sim_devices[0]);
+    const int num_streams = sizeof(sim_streams) / sizeof(sim_streams[0]);
+    const int num_expected_moves = sizeof(expected_moves) / sizeof(expected_moves[0]);
+    const bool expect = (policy == &least_loaded_policy);
+    double capacity[MAX_DEVICES];
+    int moves = 0;
+    bool ok = true;
+    Scheduler sched;
+    scheduler_init(&sched, policy);
+    printf("simulating the '%s' policy on:\n", policy->name);
+    for (int d = 0;  d < num_devices;  ++d) {
+        scheduler_add_device(&sched, sim_devices[d].name, sim_devices[d].codecs, sim_devices[d].num_codecs,
+                             sim_devices[d].max_sessions);
+        capacity[d] = sim_devices[d].capacity;
+        printf("  %-6s %d sessions, %.0f Mpixels/s\n", sim_devices[d].name, sim_devices[d].max_sessions,
+               sim_devices[d].capacity * 1e-6);
+    }
+    for (int t = 0;  t < num_streams + SIM_SETTLE_INTERVALS;  ++t) {
+        if (t < num_streams) {
+            double pixel_rate = (double)sim_streams[t].width * sim_streams[t].height * sim_streams[t].fps;
+            int device = scheduler_add_stream(&sched, sim_streams[t].codec, pixel_rate);
+            printf("%3d: stream %d (%s %dx%d@%d) -> %s\n", t, t, avcodec_get_name(sim_streams[t].codec),
+                   sim_streams[t].width, sim_streams[t].height, sim_streams[t].fps,
+                   scheduler_device_name(&sched, device));
+            if (expect && (device != sim_streams[t].expected)) {
+                printf("FAILED: stream %d should have gone to %s\n", t,
+                       scheduler_device_name(&sched, sim_streams[t].expected));
+                ok = false;
+            }
+        } else if (t == num_streams) {
+            capacity[0] /= 2.0;
+            printf("%3d: %s throttles to %.0f Mpixels/s\n", t, sim_devices[0].name, capacity[0] * 1e-6);
+        }
+        // measure
+        double total[MAX_DEVICES] = { 0.0 };
+        for (int s = 0;  s < sched.num_streams;  ++s) {
+            SchedStream *stream = &sched.streams[s];
+            if (stream->device != SCHED_SOFTWARE) {
+                stream->load = stream->pixel_rate / capacity[stream->device];
+                total[stream->device] += stream->load;
+            }
+        }
+        for (int s = 0;  s < sched.num_streams;  ++s) {
+            SchedStream *stream = &sched.streams[s];
+            stream->overloaded = (stream->device != SCHED_SOFTWARE) && (total[stream->device] > 1.0);
+        }
+        int moved, to;
+        if (scheduler_rebalance(&sched, &moved, &to)) {
+            printf("%3d: stream %d moves to %s\n", t, moved, scheduler_device_name(&sched, to));
+            if (expect && ((moves >= num_expected_moves) || (expected_moves[moves].interval != t)
+                       ||  (expected_moves[moves].stream != moved) || (expected_moves[moves].device != to))) {
+                printf("FAILED: unexpected move\n");
+                ok = false;
+            }
+            moves++;
+        } else if (expect && (moves < num_expected_moves) && (expected_moves[moves].interval == t)) {
+            printf("FAILED: stream %d should have moved to %s\n", expected_moves[moves].stream,
+                   scheduler_device_name(&sched, expected_moves[moves].device));
+            ok = false;
+            moves++;
+        }
+        // whatever the policy, the streams have to be where they can be decoded
+        int sessions[MAX_DEVICES] = { 0 };
+        for (int s = 0;  s < sched.num_streams;  ++s) {
+            const SchedStream *stream = &sched.streams[s];
+            if (stream->device == SCHED_SOFTWARE) {
+                continue;
+            }
+            bool supported = false;
+            for (int c = 0;  c < sim_devices[stream->device].num_codecs;  ++c) {
+                supported |= (sim_devices[stream->device].codecs[c] == stream->codec);
+            }
+            if (!supported) {
+                printf("FAILED: stream %d is on %s, which can't decode it\n", s,
+                       scheduler_device_name(&sched, stream->device));
+                ok = false;
+            }
+            sessions[stream->device]++;
+        }
+        for (int d = 0;  d < num_devices;  ++d) {
+            if (sessions[d] > sim_devices[d].max_sessions) {
+                printf("FAILED: %s has %d of %d sessions\n", sim_devices[d].name, sessions[d],
+                       sim_devices[d].max_sessions);
+                ok = false;
+            }
+        }
+    }
+    if (expect && (moves != num_expected_moves)) {
+        printf("FAILED: %d of %d moves\n", moves, num_expected_moves);
+        ok = false;
+    }
+    scheduler_dump_stats(&sched);
+    printf("scheduler simulation: %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
+
+// the display loop's counters of a stream, for the telemetry thread (see
+// stream_publish_metrics())
+typedef struct StreamMetrics {
+    _Atomic uint64_t presented, late, dropped, resyncs, seeks;
+    _Atomic int skip_level;
+    _Atomic uint64_t interop_hits, interop_misses, interop_evictions, interop_flushes;
+} StreamMetrics;
+
+// one input (or playlist): its decoder, decoding threads, textures and
+// place on screen
+typedef struct Stream {
+    const char *url;
+    int index;
+    const Options *opts;
+    AVFormatContext *input_ctx;
+    AVCodec *decoder;
+    AVCodecContext *decoder_ctx;
+    int video_stream;
+    Pipeline pipeline;
+    VaapiEglInterop interop;
+    InteropCache cache;
+    PboUploader uploader;
+    FrameServer *server; // publishes every decoded frame, if set
+    AVFrame *pending;    // the frame waiting for its presentation time
+    AVFrame *shown;      // the frame on screen; its surface must stay alive
+    AVFrame *next;       // the frame that replaces it with the next swap
+    int64_t next_frame_due;  // ... and when it was due
+    // frames that have left the screen, but may still be sampled by the GPU
+    // until the swap with the given sequence number has completed
+    struct { AVFrame *frame; uint64_t swap; } retired[MAX_FRAMES_IN_FLIGHT + 1];
+    int retired_head, retired_count;
+    bool eof;
+    // presentation clock: the frame with timestamp pts_base is due at clock_base
+    AVRational time_base;
+    bool paced, clock_valid;
+    bool live;             // low-latency decoding, see --live
+    int64_t pts_base, clock_base;
+    uint64_t on_time, late, dropped, resyncs;
+    SkipControl skip;
+    KeyframeIndex keyframes;
+    int64_t position;      // pts of the newest frame, or of the last seek target
+    bool seeking;          // waiting for the first frame after a seek
+    int64_t t_seek;        // when that seek was requested
+    uint64_t seeks;
+    int64_t seek_ns, seek_max_ns;
+    // playlist (--playlist, --loop): the inputs played one after another,
+    // and the next one, which is opened on a thread of its own (the demux
+    // thread starts it and waits for it, see stream_next_clip())
+    const char *const *urls;
+    int num_urls, next_url;
+    pthread_mutex_t prefetch_lock;  // guards prefetch and prefetch_stopped
+    Prefetch *prefetch;
+    bool prefetch_stopped;
+    int held_frames;
+    int64_t next_due;        // when the frame after the newest one is due
+    int64_t clock_start;     // when the first frame of the next input is due
+    int64_t clip_due;        // ... as it was when the input changed
+    bool clip_started;       // the next frame to be shown is the first of an input
+    bool reused_decoder;     // ... and the decoder was kept for it
+    bool skipping_input;     // the current input can't be decoded, see Clip.error
+    const char *clip_url;
+    uint32_t clips;          // clips taken over from the pipeline
+    uint64_t clip_changes, decoder_reuses;
+    int64_t clip_gap_ns, clip_gap_max_ns;
+    int64_t t_migrate;          // when the last move to another decoder was requested
+    int64_t t_sched;            // when the scheduler last measured the decode load ...
+    uint64_t sched_busy_base;   // ... and the decode thread's busy time back then
+    StreamMetrics metrics;
+    GLuint textures[MAX_PLANES];  // textures of the newest frame
+    const ShaderVariant *shader;  // the shader that matches its layout and colours
+    int matrix;                   // ... and the colours it was chosen for
+    bool full_range;
+    float texcoord_scale[2];
+    int tile[4];      // the stream's part of the window ...
+    int viewport[4];  // ... and where in it the video is
+    uint64_t frames;
+} Stream;
+
+// pts of the beginning of the video stream
+static int64_t stream_start_time(const Stream *stream) {
+    int64_t start = stream->input_ctx->streams[stream->video_stream]->start_time;
+    return (start != AV_NOPTS_VALUE) ? start : 0;
+}
+
+// open the input; this can run on any thread
+void stream_open_input(Stream *stream, const char *url, const Options *opts) {
+    memset(stream, 0, sizeof(*stream));
+    stream->url = url;
+    stream->opts = opts;
+    stream->paced = opts->paced;
+    stream->live = opts->live;
+    const AVIOInterruptCB interrupt = { pipeline_interrupted, &stream->pipeline };
+    open_source(&stream->decoder_ctx, &stream->video_stream, url, &stream->input_ctx, &stream->decoder, opts,
+                &interrupt);
+    stream->time_base = stream->input_ctx->streams[stream->video_stream]->time_base;
+    stream->position = stream_start_time(stream);
+}
+
+void stream_open_decoder(Stream *stream, AVBufferRef *hw_device_ctx, int held_frames) {
+    startup_phase_begin(STARTUP_DECODER);
+    populate_context(stream->decoder, hw_device_ctx, stream->decoder_ctx, held_frames, stream->live);
+    startup_phase_end(STARTUP_DECODER);
+}
+
+// place the stream on a decoding device, and open its decoder there
+void stream_schedule(Stream *stream, Scheduler *sched, const VaDevice *devices, int held_frames) {
+    const AVStream *st = stream->input_ctx->streams[stream->video_stream];
+    double fps = (st->avg_frame_rate.num && st->avg_frame_rate.den) ? av_q2d(st->avg_frame_rate) : 30.0;
+    enum AVCodecID codec = codec_supports_vaapi(stream->decoder) ? st->codecpar->codec_id : AV_CODEC_ID_NONE;
+    int device = scheduler_add_stream(sched, codec, (double)st->codecpar->width * st->codecpar->height * fps);
+    stream->held_frames = held_frames;
+    printf("stream %d: decoding on %s\n", stream->index, scheduler_device_name(sched, device));
+    stream_open_decoder(stream, (device != SCHED_SOFTWARE) ? devices[device].hw_device_ctx : NULL, held_frames);
+}
+
+// move the stream's decoding to another device (NULL = software): the new
+// decoder is opened here, and the decode thread switches to it at the next
+// keyframe, after draining the old one
+void stream_migrate(Stream *stream, const VaDevice *device, int held_frames) {
+    AVCodecContext *decoder_ctx = avcodec_alloc_context3(stream->decoder);
+    if (!decoder_ctx) {
+        fail("avcodec_alloc_context3");
+    }
+    if (avcodec_parameters_to_context(decoder_ctx, stream->input_ctx->streams[stream->video_stream]->codecpar) < 0) {
+        fail("avcodec_parameters_to_context");
+    }
+    populate_context(stream->decoder, device ? device->hw_device_ctx : NULL, decoder_ctx, held_frames, stream->live);
+    stream->t_migrate = now_ns();
+    atomic_store(&stream->pipeline.next_decoder, decoder_ctx);
+}
+
+// pick up the old decoder once the decode thread has switched to the new one
+static void stream_collect_decoder(Stream *stream) {
+    AVCodecContext *old_decoder = atomic_exchange(&stream->pipeline.old_decoder, NULL);
+    if (!old_decoder) {
+        return;
+    }
+    stream->decoder_ctx = stream->pipeline.decoder_ctx;
+    avcodec_free_context(&old_decoder);
+    printf("\nstream %d: switched decoders after %.1f ms\n", stream->index, (now_ns() - stream->t_migrate) * 1e-6);
+}
+
+// --fast-start opens the inputs on threads of their own
+typedef struct StreamOpener {
+    Stream *stream;
+    const char *url;
+    const Options *opts;
+    pthread_t thread;
+} StreamOpener;
+
+static void* stream_open_thread_func(void *arg) {
+    StreamOpener *opener = arg;
+    stream_open_input(opener->stream, opener->url, opener->opts);
+    return NULL;
+}
+
+static int prefetch_interrupted(void *opaque) {
+    Prefetch *pf = opaque;
+    return atomic_load(&pf->cancelled);
+}
+
+// drop a reference; the last one frees it, along with the clip if it's still there
+static void prefetch_release(Prefetch *pf) {
+    pthread_mutex_lock(&pf->lock);
+    bool last = (--pf->refs == 0);
+    pthread_mutex_unlock(&pf->lock);
+    if (last) {
+        if (pf->clip) {
+            clip_free(pf->clip);
+        }
+        pthread_mutex_destroy(&pf->lock);
+        pthread_cond_destroy(&pf->opened);
+        free(pf);
+    }
+}
+
+static void* stream_prefetch_thread_func(void *arg) {
+    Prefetch *pf = arg;
+    Clip *clip = pf->clip;
+    outside_startup = true;
+    const AVIOInterruptCB interrupt = { prefetch_interrupted, pf };
+    const char *error = try_open_source(&clip->decoder_ctx, &clip->video_stream, clip->url, &clip->input_ctx,
+                                        &clip->decoder, &pf->opts, &interrupt);
+    pthread_mutex_lock(&pf->lock);
+    pf->error = error;
+    pf->done = true;
+    pthread_cond_broadcast(&pf->opened);
+    pthread_mutex_unlock(&pf->lock);
+    prefetch_release(pf);
+    return NULL;
+}
+
+// start opening the playlist's next input, if there is one (with
+// prefetch_lock held, once the pipeline is running)
+static void stream_prefetch(Stream *stream) {
+    if (stream->next_url >= stream->num_urls) {
+        if (!stream->opts->loop) {
+            return;
+        }
+        stream->next_url = 0;
+    }
+    Prefetch *pf = calloc(1, sizeof(Prefetch));
+    Clip *clip = calloc(1, sizeof(Clip));
+    if (!pf || !clip) {
+        fail("calloc");
+    }
+    clip->url = stream->urls[stream->next_url++];
+    clip->held_frames = stream->held_frames;
+    clip->low_delay = stream->live;
+    pf->clip = clip;
+    pf->opts = *stream->opts;
+    pf->refs = 2;  // the thread's and the stream's
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->opened, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stream_prefetch_thread_func, pf)) {
+        fail("pthread_create");
+    }
+    pthread_detach(thread);
+    stream->prefetch = pf;
+}
+
+// Pipeline.next_clip: wait until the next input is open, and start opening
+// the one after it; inputs that can't be opened are skipped. returns NULL
+// at the end of the playlist, or once stream_stop_prefetch() was called
+static Clip* stream_next_clip(void *opaque) {
+    Stream *stream = opaque;
+    for (int failures = 0;  failures < stream->num_urls;  ) {
+        pthread_mutex_lock(&stream->prefetch_lock);
+        Prefetch *pf = stream->prefetch;
+        pthread_mutex_unlock(&stream->prefetch_lock);
+        if (!pf) {
+            return NULL;
+        }
+        pthread_mutex_lock(&pf->lock);
+        while (!pf->done && !atomic_load(&pf->cancelled)) {
+            pthread_cond_wait(&pf->opened, &pf->lock);
+        }
+        pthread_mutex_unlock(&pf->lock);
+        pthread_mutex_lock(&stream->prefetch_lock);
+        if (stream->prefetch_stopped) {
+            pthread_mutex_unlock(&stream->prefetch_lock);
+            return NULL;  // (stream_close() releases it)
+        }
+        stream->prefetch = NULL;
+        stream_prefetch(stream);
+        pthread_mutex_unlock(&stream->prefetch_lock);
+        if (!pf->error) {
+            Clip *clip = pf->clip;
+            pf->clip = NULL;
+            // from now on, it's the pipeline that may have to interrupt it
+            clip->input_ctx->interrupt_callback = (AVIOInterruptCB){ pipeline_interrupted, &stream->pipeline };
+            prefetch_release(pf);
+            return clip;
+        }
+        printf("\n%s: can't play it (%s failed), skipping it\n", pf->clip->url, pf->error);
+        prefetch_release(pf);
+        failures++;
+    }
+    printf("\nnone of the playlist's inputs can be played anymore\n");
+    return NULL;
+}
+
+// give up on the input that is being opened, if any: neither the demux
+// thread nor pipeline_stop() wait for it anymore, and the thread that opens
+// it cleans up by itself whenever it gets done
+static void stream_stop_prefetch(Stream *stream) {
+    pthread_mutex_lock(&stream->prefetch_lock);
+    stream->prefetch_stopped = true;
+    Prefetch *pf = stream->prefetch;
+    if (pf) {
+        pthread_mutex_lock(&pf->lock);
+        atomic_store(&pf->cancelled, true);
+        pthread_cond_broadcast(&pf->opened);
+        pthread_mutex_unlock(&pf->lock);
+    }
+    pthread_mutex_unlock(&stream->prefetch_lock);
+}
+
+// play the given inputs one after another (the first one is open already);
+// with --loop, start over after the last one
+void stream_set_playlist(Stream *stream, const char *const *urls, int num_urls) {
+    stream->urls = urls;
+    stream->num_urls = num_urls;
+    stream->next_url = 1;
+    stream->clip_url = urls[0];
+    if ((num_urls > 1) || stream->opts->loop) {
+        stream->pipeline.next_clip = stream_next_clip;
+        stream->pipeline.next_clip_opaque = stream;
+        pthread_mutex_init(&stream->prefetch_lock, NULL);
+        stream_prefetch(stream);
+    }
+}
+
+// take over the next input from a clip that came out of the pipeline
+static void stream_collect_clip(Stream *stream, Clip *clip) {
+    keyframe_index_stop(&stream->keyframes);
+    input_close(&stream->input_ctx);
+    stream->input_ctx = clip->input_ctx;
+    stream->video_stream = clip->video_stream;
+    stream->decoder = clip->decoder;
+    stream->time_base = stream->input_ctx->streams[stream->video_stream]->time_base;
+    stream->position = stream_start_time(stream);
+    stream->clip_url = clip->url;
+    stream->clips++;
+    if (clip->active_decoder) {  // (not set if the pipeline stopped before it got there)
+        stream->decoder_ctx = clip->active_decoder;
+    }
+    stream->reused_decoder = clip->reuse_decoder;
+    stream->skipping_input = clip->error;
+    if (clip->error) {
+        printf("\n%s: can't decode it (%s failed), skipping it\n", clip->url, clip->error);
+    }
+    // only there if it couldn't be opened, or the pipeline stopped before
+    avcodec_free_context(&clip->decoder_ctx);
+    avcodec_free_context(&clip->old_decoder);
+    free(clip);
+    fit_viewport(stream->tile[0], stream->tile[1], stream->tile[2], stream->tile[3], stream->decoder_ctx,
+                 stream->viewport);
+    // the first frame is due when the last frame of the previous input ends
+    stream->clock_valid = false;
+    stream->clock_start = stream->clip_due = stream->next_due;
+    stream->clip_started = true;
+}
+
+// set up the interop cache and the software upload path (needs a GL context)
+void stream_setup_gl(Stream *stream, VADisplay va_display, EGLDisplay egl_display, bool separate_layers,
+                     bool implicit_sync) {
+    InteropBackend backend = vaapi_egl_interop_backend(&stream->interop, va_display, egl_display, separate_layers,
+                                                       implicit_sync);
+    interop_cache_init(&stream->cache, &backend);
+    pbo_uploader_init(&stream->uploader);
+
+    // build the shader the stream will most likely need now rather than
+    // with the first frame; if the guess is wrong, the right one is built
+    // when it's needed
+    const AVCodecContext *ctx = stream->decoder_ctx;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(ctx->pix_fmt);
+    int layout = PLANES_NV12, matrix;
+    bool full_range;
+    if (!ctx->hw_device_ctx) {
+        layout = software_plane_layout(ctx->pix_fmt);
+        layout = (layout < 0) ? PLANES_NV12 : layout;
+    } else if (desc && (desc->comp[0].depth > 8)) {
+        layout = PLANES_P010;  // what VA-API gives us for anything deeper
+    }
+    color_params(ctx->colorspace, ctx->color_range, ctx->pix_fmt, ctx->height, &matrix, &full_range);
+    stream->shader = shader_variant_get(layout, matrix, full_range, OUTPUT_DISPLAY);
+    stream->matrix = matrix;
+    stream->full_range = full_range;
+}
+
+void stream_close(Stream *stream) {
+    if (stream->pipeline.next_clip) {
+        stream_stop_prefetch(stream);
+    }
+    pipeline_stop(&stream->pipeline);
+    Clip *clip;
+    while ((clip = pipeline_take_clip(&stream->pipeline))) {
+        stream_collect_clip(stream, clip);
+    }
+    if (stream->pipeline.next_clip) {
+        if (stream->prefetch) {
+            prefetch_release(stream->prefetch);
+        }
+        pthread_mutex_destroy(&stream->prefetch_lock);
+    }
+    printf("presented %llu frames (%llu on time, %llu late), dropped %llu, clock resyncs %llu\n",
+           (unsigned long long)(stream->on_time + stream->late), (unsigned long long)stream->on_time,
+           (unsigned long long)stream->late, (unsigned long long)stream->dropped,
+           (unsigned long long)stream->resyncs);
+    skip_control_dump_stats(&stream->skip, now_ns());
+    if (stream->seeks) {
+        printf("seeks: %llu, first frame after %.1f ms avg, %.1f ms max, %llu frames decoded on the way\n",
+               (unsigned long long)stream->seeks, stream->seek_ns * 1e-6 / stream->seeks, stream->seek_max_ns * 1e-6,
+               (unsigned long long)atomic_load(&stream->pipeline.decoded_forward));
+    }
+    if (stream->clip_changes) {
+        printf("playlist: %llu input changes (%llu with the decoder kept), first frame of the next input %.1f ms "
+               "avg, %.1f ms max later than due\n", (unsigned long long)stream->clip_changes,
+               (unsigned long long)stream->decoder_reuses, stream->clip_gap_ns * 1e-6 / stream->clip_changes,
+               stream->clip_gap_max_ns * 1e-6);
+    }
+    keyframe_index_stop(&stream->keyframes);
+    stream_collect_decoder(stream);
+    AVCodecContext *next_decoder = atomic_exchange(&stream->pipeline.next_decoder, NULL);
+    avcodec_free_context(&next_decoder);
+    av_frame_free(&stream->pending);
+    av_frame_free(&stream->next);
+    av_frame_free(&stream->shown);
+    for (; stream->retired_count > 0;  stream->retired_count--) {
+        av_frame_free(&stream->retired[stream->retired_head++ % (MAX_FRAMES_IN_FLIGHT + 1)].frame);
+    }
+    interop_cache_dump_stats(&stream->cache);
+    interop_cache_uninit(&stream->cache);
+    pbo_uploader_dump_stats(&stream->uploader);
+    pbo_uploader_uninit(&stream->uploader);
+    pipeline_uninit(&stream->pipeline);
+    avcodec_free_context(&stream->decoder_ctx);
+    input_close(&stream->input_ctx);
+}
+
+// the time (on the now_ns() clock) at which a frame should be shown;
+// the clock starts (or, if resync is set, restarts after a discontinuity)
+// with the first frame it sees, and frames without a timestamp are always due
+static int64_t stream_due_time(Stream *stream, const AVFrame *frame, int64_t now, bool resync) {
+    int64_t pts = frame->best_effort_timestamp;
+    if (!stream->paced || (pts == AV_NOPTS_VALUE)) {
+        return now;
+    }
+    int64_t due = 0;
+    if (stream->clock_valid) {
+        due = stream->clock_base + av_rescale_q(pts - stream->pts_base, stream->time_base, (AVRational){ 1, 1000000000 });
+        if (!resync) {
+            return due;
+        }
+        if (llabs(due - now) > (int64_t)RESYNC_THRESHOLD_MS * 1000000) {
+            stream->clock_valid = false;
+            stream->resyncs++;
+        }
+    }
+    if (!stream->clock_valid) {
+        stream->pts_base = pts;
+        stream->clock_base = due = (stream->clock_start > now) ? stream->clock_start : now;
+        stream->clock_start = 0;
+        stream->clock_valid = true;
+    }
+    return due;
+}
+
+// jump to a position (in seconds from the start, or relative to the
+// current one), from the nearest keyframe before it if it's in the index
+void stream_seek(Stream *stream, double seconds, bool relative) {
+    const int64_t start = stream_start_time(stream);
+    int64_t target = (relative ? stream->position : start)
+                   + av_rescale_q((int64_t)(seconds * 1000.0), (AVRational){ 1, 1000 }, stream->time_base);
+    if (target < start) {
+        target = start;
+    }
+    if (!pipeline_seek(&stream->pipeline, target, keyframe_index_find(&stream->keyframes, target))) {
+        printf("\nstream %d: can't seek, the end of the input has been reached\n", stream->index);
+        return;
+    }
+    stream->position = target;
+    stream->seeking = true;
+    stream->t_seek = now_ns();
+}
+
+// the first frame after a seek has arrived
+static void stream_seek_done(Stream *stream, int64_t now) {
+    int64_t ns = now - stream->t_seek;
+    #if ENABLE_PROBES
+        latency_record(&stage_latency[STAGE_SEEK], ns);
+    #endif
+    stream->seeking = false;
+    stream->clock_valid = false;  // continue from here
+    stream->seeks++;
+    stream->seek_ns += ns;
+    if (ns > stream->seek_max_ns) {
+        stream->seek_max_ns = ns;
+    }
+}
+
+// take the next frame of a stream that is due (if there is one) and get it
+// into the stream's textures. this never waits, so that slow streams don't
+// hold back the others; if the stream's next frame isn't due yet, *wake_at
+// is lowered to its presentation time. frames that are already overdue by
+// the time their successor is due are dropped here, so they don't cost any
+// interop work.
+bool stream_update(Stream *stream, int64_t *wake_at) {
+    if (stream->eof || stream->next) {
+        return false;
+    }
+    const int64_t now = now_ns();
+    AVFrame *frame;
+    int64_t due;
+    for (;;) {
+        if (!stream->pending) {
+            int ret = ring_pop(&stream->pipeline.frames, (void**)&stream->pending, 0);
+            if (ret == 0) {
+                return false;
+            }
+            if ((ret < 0) || !stream->pending) {
+                stream->pending = NULL;
+                stream->eof = true;  // end of stream; keep showing the last frame
+                stream->seeking = false;  // (there's nothing left to seek to)
+                return false;
+            }
+            Clip *clip = clip_marker(stream->pending);
+            if (clip) {
+                pipeline_recycle_frame(&stream->pipeline, stream->pending);
+                stream->pending = NULL;
+                stream_collect_clip(stream, clip);
+                if (stream->opts->keyframe_index) {
+                    keyframe_index_start(&stream->keyframes, stream->clip_url, stream->video_stream, stream->time_base);
+                }
+                continue;  // on to the first frame of the next input
+            }
+            if ((uintptr_t)stream->pending->opaque != atomic_load(&stream->pipeline.seek_serial)) {
+                pipeline_recycle_frame(&stream->pipeline, stream->pending);  // from before a seek
+                stream->pending = NULL;
+                continue;
+            }
+            if (stream->seeking) {
+                stream_seek_done(stream, now);
+            }
+            if (stream->server) {
+                frame_server_publish(stream->server, stream->index, stream->time_base, stream->pending);
+            }
+        }
+        frame = stream->pending;
+        if ((uintptr_t)frame->opaque != atomic_load(&stream->pipeline.seek_serial)) {
+            pipeline_recycle_frame(&stream->pipeline, frame);  // was waiting when the seek came
+            stream->pending = NULL;
+            continue;
+        }
+        due = stream_due_time(stream, frame, now, true);
+        if (due > now) {
+            if (due < *wake_at) { *wake_at = due; }
+            return false;  // too early
+        }
+        AVFrame *successor;
+        if (ring_peek(&stream->pipeline.frames, (void**)&successor) && successor && !clip_marker(successor)
+        && (stream_due_time(stream, successor, now, false) <= now)) {
+            pipeline_recycle_frame(&stream->pipeline, stream->pending);  // too late, there's a newer one
+            stream->pending = NULL;
+            stream->dropped++;
+            continue;
+        }
+        break;
+    }
+    stream->pending = NULL;
+    if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+        stream->position = frame->best_effort_timestamp;
+    }
+    stream->next_due = due + av_rescale_q(frame->pkt_duration, stream->time_base, (AVRational){ 1, 1000000000 });
+    stream->skip.lag_ns += now - due;
+    stream->skip.queued += ring_count(&stream->pipeline.frames);
+    stream->skip.samples++;
+
+    int texture_width, texture_height, layout;
+    if (frame->format == AV_PIX_FMT_VAAPI) {
+        // get the frame's textures, exporting and importing it only if
+        // its surface hasn't been seen before (a frame from another device
+        // comes from another surface pool, so that flushes the cache)
+        stream->interop.va_display = frame_va_display(frame);
+        const InteropEntry *entry = interop_cache_get(&stream->cache, frame);
+        memcpy(stream->textures, entry->textures, sizeof(stream->textures));
+        texture_width  = entry->width;
+        texture_height = entry->height;
+        layout = entry->layout;
+    } else {
+        pbo_upload_frame(&stream->uploader, frame);
+        memcpy(stream->textures, stream->uploader.textures, sizeof(stream->textures));
+        texture_width  = stream->uploader.width;
+        texture_height = stream->uploader.height;
+        layout = stream->uploader.layout;
+    }
+    int matrix;
+    bool full_range;
+    color_params(frame->colorspace, frame->color_range, frame->format, frame->height, &matrix, &full_range);
+    stream->shader = shader_variant_get(layout, matrix, full_range, OUTPUT_DISPLAY);
+    stream->matrix = matrix;
+    stream->full_range = full_range;
+
+    // the actual size of the frame may be smaller than the texture
+    stream->texcoord_scale[0] = (float)((double) frame->width  / (double) texture_width);
+    stream->texcoord_scale[1] = (float)((double) frame->height / (double) texture_height);
+    stream->next = frame;
+    stream->next_frame_due = due;
+    stream->frames++;
+    return true;
+}
+
+// give the frames the GPU is done with back to the decoder
+void stream_reap_frames(Stream *stream, uint64_t completed_swap) {
+    while ((stream->retired_count > 0) && (stream->retired[stream->retired_head].swap <= completed_swap)) {
+        pipeline_recycle_frame(&stream->pipeline, stream->retired[stream->retired_head].frame);
+        stream->retired_head = (stream->retired_head + 1) % (MAX_FRAMES_IN_FLIGHT + 1);
+        stream->retired_count--;
+    }
+}
+
+// the next frame has been drawn in the given swap, so the previous one
+// isn't needed anymore once that swap has completed
+void stream_frame_shown(Stream *stream, uint64_t swap) {
+    if (stream->next) {
+        const int64_t now = now_ns();
+        // on time or late is up to when the swap is done, not when the
+        // frame was picked up
+        if ((now - stream->next_frame_due) > (int64_t)LATE_THRESHOLD_MS * 1000000) {
+            stream->late++;
+        } else {
+            stream->on_time++;
+        }
+        if (stream->clip_started) {
+            // the first frame of the playlist's next input; what counts
+            // is how much later than the end of the previous one it came
+            int64_t gap = (stream->clip_due && (now > stream->clip_due)) ? now - stream->clip_due : 0;
+            #if ENABLE_PROBES
+                latency_record(&stage_latency[STAGE_CLIP_GAP], gap);
+            #endif
+            printf("\n%s: %s decoder, first frame %.1f ms later than due\n",
+                   stream->clip_url, stream->reused_decoder ? "kept the" : "new", gap * 1e-6);
+            stream->clip_started = false;
+            stream->clip_changes++;
+            stream->decoder_reuses += stream->reused_decoder;
+            stream->clip_gap_ns += gap;
+            if (gap > stream->clip_gap_max_ns) {
+                stream->clip_gap_max_ns = gap;
+            }
+        }
+        if (stream->shown) {
+            if (stream->retired_count > MAX_FRAMES_IN_FLIGHT) {
+                fail("retired frame check");  // can't happen with at most MAX_FRAMES_IN_FLIGHT swaps pending
+            }
+            int i = (stream->retired_head + stream->retired_count++) % (MAX_FRAMES_IN_FLIGHT + 1);
+            stream->retired[i].frame = stream->shown;
+            stream->retired[i].swap  = swap;
+        }
+        stream->shown = stream->next;
+        stream->next = NULL;
+    }
+}
+
+// one round of skip_frame control for all streams: every stream that's
+// overloaded skips more frames right away, but only one stream per round
+// (the one that skips the most) may step back up, so that streams sharing
+// a decoder don't all step up at once and overload it again
+void skip_control_update(Stream *streams, int num_streams, int64_t now) {
+    Stream *recover = NULL;
+    for (int i = 0;  i < num_streams;  ++i) {
+        Stream *stream = &streams[i];
+        SkipControl *sc = &stream->skip;
+        if (!sc->enabled || stream->eof || (now <= sc->t_window)) {
+            continue;
+        }
+        // decode thread load, frames late or dropped, and clock restarts
+        // (which happen when a stream falls too far behind) in this interval
+        uint64_t busy = atomic_load_explicit(&stream->pipeline.busy_ns, memory_order_relaxed);
+        double load = (double)(busy - sc->busy_base) / (double)(now - sc->t_window);
+        uint64_t behind = (stream->late + stream->dropped) - sc->behind_base;
+        bool resynced = (stream->resyncs != sc->resync_base);
+        double lag_ms = sc->samples ? (sc->lag_ns * 1e-6 / sc->samples) : 0.0;
+        double queued = sc->samples ? ((double)sc->queued / sc->samples) : 0.0;
+        // being late only means the decoder is too slow if it hasn't got
+        // anything queued; otherwise, it's the display that can't keep up
+        bool late = (behind * 20 > sc->samples) || (lag_ms > LATE_THRESHOLD_MS) || resynced;
+        bool overloaded = (load > SKIP_LOAD_HIGH) || (late && (queued < 1.0));
+
+        if (overloaded) {
+            sc->healthy = 0;
+            if (sc->level < SKIP_NONKEY) {
+                // if the last step up didn't hold, wait longer before the next one
+                bool failed = sc->t_step_up && ((now - sc->t_step_up) < 4LL * SKIP_INTERVAL_MS * 1000000);
+                sc->recover_after = failed ? (sc->recover_after * 2) : SKIP_RECOVER_INTERVALS;
+                if (sc->recover_after > SKIP_MAX_RECOVER_INTERVALS) {
+                    sc->recover_after = SKIP_MAX_RECOVER_INTERVALS;
+                }
+                printf("\nstream %d: skip_frame %s -> %s (decode load %.0f%%, lag %.1f ms, %.1f frames queued)\n",
+                       stream->index, skip_names[sc->level], skip_names[sc->level + 1], load * 100.0, lag_ms, queued);
+                skip_control_set(sc, &stream->pipeline, sc->level + 1, now);
+            }
+        } else if ((sc->level > SKIP_NONE) && (load < SKIP_LOAD_LOW) && !behind && !resynced) {
+            if ((++sc->healthy >= sc->recover_after) && (!recover || (sc->level > recover->skip.level))) {
+                recover = stream;
+            }
+        } else {
+            sc->healthy = 0;
+        }
+        sc->t_window = now;
+        sc->lag_ns = 0;
+        sc->samples = sc->queued = 0;
+        sc->busy_base = busy;
+        sc->behind_base = stream->late + stream->dropped;
+        sc->resync_base = stream->resyncs;
+    }
+    if (recover) {
+        SkipControl *sc = &recover->skip;
+        printf("\nstream %d: skip_frame %s -> %s (after %d healthy intervals)\n",
+               recover->index, skip_names[sc->level], skip_names[sc->level - 1], sc->healthy);
+        skip_control_set(sc, &recover->pipeline, sc->level - 1, now);
+        sc->healthy = 0;
+        sc->t_step_up = now;
+    }
+}
+
+// a manual skip_frame change turns the automatic control off
+void skip_control_manual(Stream *streams, int num_streams, int level) {
+    const int64_t now = now_ns();
+    for (int i = 0;  i < num_streams;  ++i) {
+        streams[i].skip.enabled = false;
+        skip_control_set(&streams[i].skip, &streams[i].pipeline, level, now);
+    }
+}
+
+// one round of scheduling: measure the decode load of the streams, and
+// move one of them to another device if the scheduler says so (but only
+// one at a time)
+void scheduler_update(Scheduler *sched, Stream *streams, int num_streams, const VaDevice *devices, int held_frames,
+                      int64_t now) {
+    bool switching = false;
+    for (int i = 0;  i < num_streams;  ++i) {
+        Stream *stream = &streams[i];
+        SchedStream *ss = &sched->streams[i];
+        stream_collect_decoder(stream);
+        switching |= (atomic_load(&stream->pipeline.next_decoder) != NULL);
+        // a new decoder would be set up for the wrong input while the
+        // pipeline is already on to the next one
+        switching |= (atomic_load(&stream->pipeline.clips) != stream->clips);
+        // ... or for one that can't be decoded at all
+        switching |= stream->skipping_input;
+        uint64_t busy = atomic_load_explicit(&stream->pipeline.busy_ns, memory_order_relaxed);
+        if (stream->eof) {
+            ss->load = 0.0;
+        } else if (stream->t_sched && (now > stream->t_sched)) {
+            ss->load = (double)(busy - stream->sched_busy_base) / (double)(now - stream->t_sched);
+        }
+        ss->overloaded = !stream->eof && ((stream->skip.level > SKIP_NONE) || (ss->load > SKIP_LOAD_HIGH));
+        stream->sched_busy_base = busy;
+        stream->t_sched = now;
+    }
+    int moved, device;
+    if (!switching && scheduler_rebalance(sched, &moved, &device)) {
+        printf("\nstream %d: moving to %s\n", moved, scheduler_device_name(sched, device));
+        stream_migrate(&streams[moved], (device != SCHED_SOFTWARE) ? &devices[device] : NULL, held_frames);
+    }
+}
+
+// live telemetry (--metrics FILE, --metrics-socket PATH): per-stream frame
+// counters and rates, queue depths, skip_frame levels, interop cache stats
+// and stage latencies in the Prometheus text format. a thread of its own
+// rewrites the file every METRICS_INTERVAL_MS (e.g. for node_exporter's
+// textfile collector), and answers every connection to the socket with the
+// current values. everything it reads is an atomic: the queues, the decode
+// thread's counters and the latency histograms are anyway, and the display
+// loop mirrors its own counters into StreamMetrics with relaxed stores. so
+// collecting takes no locks, and the thread renders into a buffer that's
+// allocated up front.
+
+// mirror the display loop's counters for the telemetry thread
+void stream_publish_metrics(Stream *stream) {
+    StreamMetrics *m = &stream->metrics;
+    atomic_store_explicit(&m->presented, stream->on_time + stream->late, memory_order_relaxed);
+    atomic_store_explicit(&m->late, stream->late, memory_order_relaxed);
+    atomic_store_explicit(&m->dropped, stream->dropped, memory_order_relaxed);
+    atomic_store_explicit(&m->resyncs, stream->resyncs, memory_order_relaxed);
+    atomic_store_explicit(&m->seeks, stream->seeks, memory_order_relaxed);
+    atomic_store_explicit(&m->skip_level, stream->skip.level, memory_order_relaxed);
+    atomic_store_explicit(&m->interop_hits, stream->cache.hits, memory_order_relaxed);
+    atomic_store_explicit(&m->interop_misses, stream->cache.misses, memory_order_relaxed);
+    atomic_store_explicit(&m->interop_evictions, stream->cache.evictions, memory_order_relaxed);
+    atomic_store_explicit(&m->interop_flushes, stream->cache.flushes, memory_order_relaxed);
+}
+
+typedef struct Telemetry {
+    const Stream *streams;
+    int num_streams;
+    const char *path;         // file to rewrite, or NULL
+    int listen_fd;            // -1 = no socket
+    int stop_fd;              // eventfd that ends the thread
+    pthread_t thread;
+    int64_t t_start;
+    char *text;               // the current metrics
+    size_t length;
+    bool truncated;
+    // the previous sample, and the rates since then
+    int64_t t_sample;
+    uint64_t decoded[MAX_STREAMS], presented[MAX_STREAMS], busy_ns[MAX_STREAMS];
+    double decode_fps[MAX_STREAMS], present_fps[MAX_STREAMS], decode_load[MAX_STREAMS];
+    uint64_t scrapes;
+} Telemetry;
+
+static void metrics_printf(Telemetry *t, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void metrics_printf(Telemetry *t, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(t->text + t->length, METRICS_BUFFER_SIZE - t->length, fmt, args);
+    va_end(args);
+    if ((n < 0) || ((size_t)n >= METRICS_BUFFER_SIZE - t->length)) {
+        t->truncated = true;  // leave out the rest rather than cut a line in half
+        t->text[t->length] = '\0';
+        return;
+    }
+    t->length += n;
+}
+
+// a label value, with backslashes, quotes and newlines escaped
+static void metrics_label_value(Telemetry *t, const char *value) {
+    for (const char *c = value;  *c && !t->truncated;  ++c) {
+        if      (*c == '\\') { metrics_printf(t, "\\\\"); }
+        else if (*c == '"')  { metrics_printf(t, "\\\""); }
+        else if (*c == '\n') { metrics_printf(t, "\\n"); }
+        else                 { metrics_printf(t, "%c", *c); }
+    }
+}
+
+static void metrics_header(Telemetry *t, const char *name, const char *type, const char *help) {
+    metrics_printf(t, "# HELP vaapi_egl_%s %s\n# TYPE vaapi_egl_%s %s\n", name, help, name, type);
+}
+
+// one value per stream
+#define METRICS_PER_STREAM(t, name, type, help, fmt, expr) do { \
+        metrics_header(t, name, type, help); \
+        for (int i = 0;  i < (t)->num_streams;  ++i) { \
+            const Stream *stream = &(t)->streams[i]; \
+            (void)stream; \
+            metrics_printf(t, "vaapi_egl_" name "{stream=\"%d\"} " fmt "\n", i, expr); \
+        } \
+    } while (0)
+#define LOAD_RELAXED(var) atomic_load_explicit(&(var), memory_order_relaxed)
+
+// take a sample for the rates
+static void telemetry_sample(Telemetry *t, int64_t now) {
+    double elapsed = (now - t->t_sample) * 1e-9;
+    for (int i = 0;  i < t->num_streams;  ++i) {
+        const Stream *stream = &t->streams[i];
+        uint64_t decoded   = LOAD_RELAXED(stream->pipeline.decoded);
+        uint64_t presented = LOAD_RELAXED(stream->metrics.presented);
+        uint64_t busy_ns   = LOAD_RELAXED(stream->pipeline.busy_ns);
+        if (t->t_sample && (elapsed > 0.0)) {
+            t->decode_fps[i]  = (decoded - t->decoded[i]) / elapsed;
+            t->present_fps[i] = (presented - t->presented[i]) / elapsed;
+            t->decode_load[i] = (busy_ns - t->busy_ns[i]) * 1e-9 / elapsed;
+        }
+        t->decoded[i] = decoded;
+        t->presented[i] = presented;
+        t->busy_ns[i] = busy_ns;
+    }
+    t->t_sample = now;
+}
+
+// render the current values into t->text
+static void telemetry_render(Telemetry *t) {
+    t->length = 0;
+    t->truncated = false;
+    t->text[0] = '\0';
+    metrics_header(t, "uptime_seconds", "gauge", "Time since the start of playback.");
+    metrics_printf(t, "vaapi_egl_uptime_seconds %.3f\n", (now_ns() - t->t_start) * 1e-9);
+    metrics_header(t, "stream_info", "gauge", "The input of each stream.");
+    for (int i = 0;  i < t->num_streams;  ++i) {
+        metrics_printf(t, "vaapi_egl_stream_info{stream=\"%d\",input=\"", i);
+        metrics_label_value(t, t->streams[i].url);
+        metrics_printf(t, "\"} 1\n");
+    }
+    METRICS_PER_STREAM(t, "frames_decoded_total", "counter", "Frames that came out of the decoder.",
+                       "%llu", (unsigned long long)LOAD_RELAXED(stream->pipeline.decoded));
+    METRICS_PER_STREAM(t, "frames_presented_total", "counter", "Frames that were shown.",
+                       "%llu", (unsigned long long)LOAD_RELAXED(stream->metrics.presented));
+    METRICS_PER_STREAM(t, "frames_late_total", "counter", "Frames that were shown late.",
+                       "%llu", (unsigned long long)LOAD_RELAXED(stream->metrics.late));
+    METRICS_PER_STREAM(t, "frames_dropped_total", "counter", "Decoded frames that were too late to be shown.",
+                       "%llu", (unsigned long long)LOAD_RELAXED(stream->metrics.dropped));
+    METRICS_PER_STREAM(t, "clock_resyncs_total", "counter", "Restarts of the presentation clock.",
+                       "%llu", (unsigned long long)LOAD_RELAXED(stream->metrics.resyncs));
+    METRICS_PER_STREAM(t, "seeks_total", "counter", "Completed seeks.",
+                       "%llu", (unsigned long long)LOAD_RELAXED(stream->metrics.seeks));
+    METRICS_PER_STREAM(t, "decode_fps", "gauge", "Decoded frames per second.", "%.2f", t->decode_fps[i]);
+    METRICS_PER_STREAM(t, "present_fps", "gauge", "Presented frames per second.", "%.2f", t->present_fps[i]);
+    METRICS_PER_STREAM(t, "decode_load", "gauge", "Share of the time the decode thread spent in the decoder.",
+                       "%.3f", t->decode_load[i]);
+    METRICS_PER_STREAM(t, "packet_queue_depth", "gauge", "Packets waiting for the decoder.",
+                       "%u", ring_count(&stream->pipeline.packets));
+    METRICS_PER_STREAM(t, "frame_queue_depth", "gauge", "Decoded frames waiting to be shown.",
+                       "%u", ring_count(&stream->pipeline.frames));
+    METRICS_PER_STREAM(t, "skip_frame_level", "gauge", "Frames the decoder skips: 0 none, 1 nonref, 2 bidir, 3 nonkey.",
+                       "%d", LOAD_RELAXED(stream->metrics.skip_level));
+    METRICS_PER_STREAM(t, "interop_cache_hits_total", "counter", "Frames whose surface was already imported.",
+                       "%llu", (unsigned long long)LOAD_RELAXED(stream->metrics.interop_hits));
+    METRICS_PER_STREAM(t, "interop_cache_misses_total", "counter", "Frames whose surface had to be imported.",
+                       "%llu", (unsigned long long)LOAD_RELAXED(stream->metrics.interop_misses));
+    METRICS_PER_STREAM(t, "interop_cache_evictions_total", "counter", "Imported surfaces dropped for lack of room.",
+                       "%llu", (unsigned long long)LOAD_RELAXED(stream->metrics.interop_evictions));
+    METRICS_PER_STREAM(t, "interop_cache_flushes_total", "counter", "Times all imported surfaces were dropped.",
+                       "%llu", (unsigned long long)LOAD_RELAXED(stream->metrics.interop_flushes));
+    if (ENABLE_PROBES) {
+        static const int percentiles[] = { 50, 95, 99 };
+        metrics_header(t, "stage_latency_seconds", "summary", "Time spent in each stage of the pipeline.");
+        for (int s = 0;  s < NUM_STAGES;  ++s) {
+            const LatencyHistogram *h = &stage_latency[s];
+            uint64_t buckets[LATENCY_BUCKETS];
+            uint64_t count = latency_snapshot(h, buckets);
+            for (size_t q = 0;  q < sizeof(percentiles) / sizeof(percentiles[0]);  ++q) {
+                metrics_printf(t, "vaapi_egl_stage_latency_seconds{stage=\"%s\",quantile=\"%g\"} %.6f\n", stage_names[s],
+                               percentiles[q] / 100.0, latency_percentile_ms(buckets, count, percentiles[q]) * 1e-3);
+            }
+            metrics_printf(t, "vaapi_egl_stage_latency_seconds_sum{stage=\"%s\"} %.6f\n", stage_names[s],
+                           LOAD_RELAXED(h->sum_ns) * 1e-9);
+            metrics_printf(t, "vaapi_egl_stage_latency_seconds_count{stage=\"%s\"} %llu\n", stage_names[s],
+                           (unsigned long long)count);
+        }
+    }
+}
+
+static bool write_all(int fd, const char *data, size_t size, bool is_socket) {
+    while (size) {
+        ssize_t n = is_socket ? send(fd, data, size, MSG_NOSIGNAL) : write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// atomically replace the metrics file
+static void telemetry_write_file(Telemetry *t) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", t->path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    bool ok = write_all(fd, t->text, t->length, false);
+    close(fd);
+    if (ok) {
+        rename(tmp_path, t->path);
+    }
+}
+
+static void* telemetry_thread_func(void *arg) {
+    Telemetry *t = arg;
+    int64_t t_next = now_ns();
+    for (;;) {
+        if (now_ns() >= t_next) {
+            telemetry_sample(t, now_ns());
+            if (t->path) {
+                telemetry_render(t);
+                telemetry_write_file(t);
+            }
+            t_next += (int64_t)METRICS_INTERVAL_MS * 1000000;
+        }
+        struct pollfd fds[2] = {
+            { .fd = t->stop_fd,   .events = POLLIN },
+            { .fd = t->listen_fd, .events = POLLIN },
+        };
+        int64_t timeout_ms = (t_next - now_ns()) / 1000000;
+        if (poll(fds, 2, (timeout_ms > 0) ? (int)timeout_ms : 0) < 0) {
+            continue;  // interrupted
+        }
+        if (fds[0].revents & POLLIN) {
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(t->listen_fd, NULL, NULL)) >= 0) {
+                // a client that doesn't read mustn't hold up the file updates
+                struct timeval timeout = { 0, 100000 };
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                telemetry_render(t);
+                write_all(fd, t->text, t->length, true);
+                close(fd);
+                t->scrapes++;
+            }
+        }
+    }
+    return NULL;
+}
+
+// start collecting; path and socket_path may each be NULL
+void telemetry_start(Telemetry *t, const Stream *streams, int num_streams, const char *path,
+                     const char *socket_path) {
+    memset(t, 0, sizeof(*t));
+    t->streams = streams;
+    t->num_streams = num_streams;
+    t->path = path;
+    t->t_start = now_ns();
+    t->listen_fd = -1;
+    t->text = malloc(METRICS_BUFFER_SIZE);
+    t->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (!t->text || (t->stop_fd < 0)) {
+        fail("telemetry setup");
+    }
+    if (socket_path) {
+        t->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (t->listen_fd < 0) {
+            fail("socket");
+        }
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+            fail("socket path length check");
+        }
+        strcpy(addr.sun_path, socket_path);
+        unlink(socket_path);
+        if (bind(t->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(t->listen_fd, 4)) {
+            fail("bind/listen");
+        }
+        printf("telemetry: serving metrics on %s\n", socket_path);
+    }
+    if (pthread_create(&t->thread, NULL, telemetry_thread_func, t)) {
+        fail("pthread_create");
+    }
+}
+
+// stop the thread, after a final update of the file
+void telemetry_stop(Telemetry *t) {
+    signal_event_fd(t->stop_fd);
+    pthread_join(t->thread, NULL);
+    if (t->path) {
+        telemetry_sample(t, now_ns());
+        telemetry_render(t);
+        telemetry_write_file(t);
+    }
+    if (t->truncated) {
+        printf("telemetry: the metrics didn't fit into %d KiB, some were left out\n", METRICS_BUFFER_SIZE / 1024);
+    }
+    if (t->listen_fd >= 0) {
+        printf("telemetry: %llu scrapes\n", (unsigned long long)t->scrapes);
+        close(t->listen_fd);
+    }
+    close(t->stop_fd);
+    free(t->text);
+}
+
+// arrange the streams in a grid that fills the window
+void layout_tiles(Stream *streams, int num_streams, int width, int height) {
+    int cols = 1;
+    while (cols * cols < num_streams) { ++cols; }
+    int rows = (num_streams + cols - 1) / cols;
+    for (int i = 0;  i < num_streams;  ++i) {
+        int col = i % cols, row = i / cols;
+        int x0 = col * width / cols,  x1 = (col + 1) * width / cols;
+        int y0 = row * height / rows, y1 = (row + 1) * height / rows;
+        // OpenGL's origin is at the bottom, so start with the top row there
+        int *tile = streams[i].tile;
+        tile[0] = x0;
+        tile[1] = height - y1;
+        tile[2] = x1 - x0;
+        tile[3] = y1 - y0;
+        fit_viewport(tile[0], tile[1], tile[2], tile[3], streams[i].decoder_ctx, streams[i].viewport);
+    }
+}
+
+void handle_x11_events(Display* x_display, Atom WM_DELETE_WINDOW, bool *running, bool *paused, bool *redraw,
+                       Stream *streams, int num_streams) {
+  // handle X11 events
+  while (XPending(x_display)) {
+      XEvent ev;
+      XNextEvent(x_display, &ev);
+      switch (ev.type) {
+          case ClientMessage:
+              if (((Atom) ev.xclient.data.l[0]) == WM_DELETE_WINDOW) {
+                  *running = false;
+              }
+              break;
+          case KeyPress:
+              switch (XLookupKeysym(&ev.xkey, 0)) {
+                  case 'q':
+                      *running = false;
+                      break;
+                  case ' ':
+                      // restart the clocks after a pause, so that the frames
+                      // that were due in the meantime don't all get dropped
+                      *paused = !*paused;
+                      for (int i = 0;  i < num_streams;  ++i) {
+                          // the pause says nothing about the load, and the
+                          // decode thread went on until the queue was full:
+                          // start the load measurements over
+                          Stream *stream = &streams[i];
+                          stream->clock_valid = false;
+                          stream->skip.t_window = now_ns();
+                          stream->skip.busy_base = atomic_load_explicit(&stream->pipeline.busy_ns,
+                                                                        memory_order_relaxed);
+                          stream->t_sched = 0;
+                      }
+                      break;
+                  case 'a':
+                      skip_control_manual(streams, num_streams, SKIP_NONE);
+                      break;
+                  case 'b':
+                      skip_control_manual(streams, num_streams, SKIP_NONREF);
+                      break;
+                  case 'p':
+                      skip_control_manual(streams, num_streams, SKIP_BIDIR);
+                      break;
+                  case XK_Left:
+                  case XK_Right:
+                  case XK_Down:
+                  case XK_Up: {
+                      KeySym key = XLookupKeysym(&ev.xkey, 0);
+                      double step = ((key == XK_Left) || (key == XK_Down)) ? -SEEK_STEP_SECONDS : SEEK_STEP_SECONDS;
+                      if ((key == XK_Down) || (key == XK_Up)) {
+                          step *= 6.0;
+                      }
+                      for (int i = 0;  i < num_streams;  ++i) {
+                          stream_seek(&streams[i], step, true);
+                      }
+                      break;
+                  }
+                  default: break;
+              }
+              break;
+          case ConfigureNotify:
+              layout_tiles(streams, num_streams, ((XConfigureEvent*)&ev)->width, ((XConfigureEvent*)&ev)->height);
+              *redraw = true;
+              break;
+          case Expose:
+              *redraw = true;
+              break;
+          default:
+              break;
+      }
+  }
+}
+
+// thumbnails: with --thumbnails, every new frame of every stream is also
+// drawn, box-filtered, into a small framebuffer and read back through a
+// ring of persistently mapped pixel pack buffers. glReadPixels into a
+// buffer object only queues the copy; the result is picked up once the
+// fence behind it has signalled, so the render thread never waits for it.
+typedef struct Thumbnail {
+    int stream;
+    int64_t pts;
+    AVRational time_base;
+    int width, height;
+    int channels;          // 1 = luma, 4 = RGBA
+    const uint8_t *data;   // top row; rows are stride bytes apart, and the
+    ptrdiff_t stride;      // stride is negative, as the GL reads bottom-up
+    int64_t latency_ns;    // from queueing the readback to delivery
+} Thumbnail;
+typedef void (*ThumbnailCallback)(void *opaque, const Thumbnail *thumb);
+
+typedef struct ThumbnailSlot {
+    GLsync fence;
+    int stream;
+    int64_t pts;
+    AVRational time_base;
+    int64_t issued_ns;
+} ThumbnailSlot;
+
+#define MAX_THUMBNAIL_SLOTS (MAX_STREAMS * THUMBNAIL_RING_SIZE)
+typedef struct ThumbnailReader {
+    int width, height;
+    int output;            // OUTPUT_THUMB_*
+    int channels;
+    GLenum format;
+    GLint display_fbo;     // the framebuffer to go back to after drawing
+    GLuint fbo, renderbuffer;
+    GLuint pbos[MAX_THUMBNAIL_SLOTS];
+    uint8_t *mapped[MAX_THUMBNAIL_SLOTS];
+    ThumbnailSlot slots[MAX_THUMBNAIL_SLOTS];
+    int num_slots, head, count;  // FIFO of queued readbacks
+    size_t size;
+    ThumbnailCallback callback;
+    void *opaque;
+    uint64_t issued, delivered, skipped;
+    int64_t latency_ns, t_first, t_last;
+    PFNGLBUFFERSTORAGEPROC   glBufferStorage;  // NULL = map for every readback
+    PFNGLMAPBUFFERRANGEPROC  glMapBufferRange;
+    PFNGLUNMAPBUFFERPROC     glUnmapBuffer;
+    PFNGLFENCESYNCPROC       glFenceSync;
+    PFNGLCLIENTWAITSYNCPROC  glClientWaitSync;
+    PFNGLDELETESYNCPROC      glDeleteSync;
+} ThumbnailReader;
+
+void thumbnail_reader_init(ThumbnailReader *tr, int width, int height, bool luma, int num_streams,
+                           ThumbnailCallback callback, void *opaque) {
+    memset(tr, 0, sizeof(*tr));
+    LOOKUP_FUNCTION(PFNGLMAPBUFFERRANGEPROC, glMapBufferRange)
+    LOOKUP_FUNCTION(PFNGLUNMAPBUFFERPROC,    glUnmapBuffer)
+    LOOKUP_FUNCTION(PFNGLFENCESYNCPROC,      glFenceSync)
+    LOOKUP_FUNCTION(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync)
+    LOOKUP_FUNCTION(PFNGLDELETESYNCPROC,     glDeleteSync)
+    tr->glBufferStorage  = gl_buffer_storage();
+    tr->glMapBufferRange = glMapBufferRange;
+    tr->glUnmapBuffer    = glUnmapBuffer;
+    tr->glFenceSync      = glFenceSync;
+    tr->glClientWaitSync = glClientWaitSync;
+    tr->glDeleteSync     = glDeleteSync;
+    tr->width    = width;
+    tr->height   = height;
+    tr->output   = luma ? OUTPUT_THUMB_LUMA : OUTPUT_THUMB_RGB;
+    tr->channels = luma ? 1 : 4;
+    tr->format   = luma ? GL_RED : GL_RGBA;
+    tr->size     = (size_t)width * height * tr->channels;
+    tr->num_slots = num_streams * THUMBNAIL_RING_SIZE;
+    tr->callback = callback;
+    tr->opaque   = opaque;
+
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &tr->display_fbo);
+    glGenRenderbuffers(1, &tr->renderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, tr->renderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, luma ? GL_R8 : GL_RGBA8, width, height);
+    glGenFramebuffers(1, &tr->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, tr->fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, tr->renderbuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fail("glCheckFramebufferStatus");
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, tr->display_fbo);
+
+    const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);  // luma rows are tightly packed
+    glGenBuffers(tr->num_slots, tr->pbos);
+    for (int i = 0;  i < tr->num_slots;  ++i) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, tr->pbos[i]);
+        if (!tr->glBufferStorage) {
+            glBufferData(GL_PIXEL_PACK_BUFFER, tr->size, NULL, GL_STREAM_READ);
+            continue;
+        }
+        tr->glBufferStorage(GL_PIXEL_PACK_BUFFER, tr->size, NULL, flags);
+        tr->mapped[i] = tr->glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, tr->size, flags);
+        if (!tr->mapped[i]) {
+            fail("glMapBufferRange");
+        }
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    printf("thumbnails: %dx%d %s, %d readback buffers\n", width, height, luma ? "luma" : "RGBA", tr->num_slots);
+}
+
+// draw a stream's new frame into the thumbnail framebuffer and queue its
+// readback; if all buffers are still in use, the thumbnail is skipped
+void thumbnail_reader_issue(ThumbnailReader *tr, const Stream *stream) {
+    if (tr->count == tr->num_slots) {
+        tr->skipped++;
+        return;
+    }
+    PROBE_BEGIN(THUMBNAIL);
+    const ShaderVariant *variant = shader_variant_get(stream->shader->layout, stream->matrix, stream->full_range,
+                                                      tr->output);
+    const float sx = stream->texcoord_scale[0], sy = stream->texcoord_scale[1];
+    glBindFramebuffer(GL_FRAMEBUFFER, tr->fbo);
+    glViewport(0, 0, tr->width, tr->height);
+    glUseProgram(variant->prog);
+    glUniform2f(variant->scale_location, sx, sy);
+    glUniform2f(variant->tap_location, sx / (float)(tr->width * THUMB_TAPS), sy / (float)(tr->height * THUMB_TAPS));
+    for (int t = 0;  t < plane_layouts[variant->layout].num_planes;  ++t) {
+        glActiveTexture(GL_TEXTURE0 + t);
+        glBindTexture(GL_TEXTURE_2D, stream->textures[t]);
+    }
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    int i = (tr->head + tr->count++) % tr->num_slots;
+    ThumbnailSlot *slot = &tr->slots[i];
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, tr->pbos[i]);
+    glReadPixels(0, 0, tr->width, tr->height, tr->format, GL_UNSIGNED_BYTE, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot->fence     = tr->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot->stream    = stream->index;
+    slot->pts       = stream->next->best_effort_timestamp;
+    slot->time_base = stream->time_base;
+    slot->issued_ns = now_ns();
+    glBindFramebuffer(GL_FRAMEBUFFER, tr->display_fbo);
+    tr->issued++;
+    PROBE_END(THUMBNAIL);
+}
+
+// hand all finished thumbnails to the callback, oldest first; with wait set,
+// block until all queued ones are done. returns how many are still queued.
+int thumbnail_reader_harvest(ThumbnailReader *tr, bool wait) {
+    const ptrdiff_t row = (ptrdiff_t)tr->width * tr->channels;
+    while (tr->count) {
+        ThumbnailSlot *slot = &tr->slots[tr->head];
+        GLenum status = tr->glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? UINT64_MAX : 0);
+        if (status == GL_TIMEOUT_EXPIRED) {
+            break;
+        }
+        if (status == GL_WAIT_FAILED) {
+            fail("glClientWaitSync");
+        }
+        tr->glDeleteSync(slot->fence);
+        slot->fence = 0;
+        const uint8_t *mapped = tr->mapped[tr->head];
+        if (!tr->glBufferStorage) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, tr->pbos[tr->head]);
+            mapped = tr->glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, tr->size, GL_MAP_READ_BIT);
+            if (!mapped) {
+                fail("glMapBufferRange");
+            }
+        }
+        const int64_t t = now_ns();
+        Thumbnail thumb = {
+            .stream = slot->stream, .pts = slot->pts, .time_base = slot->time_base,
+            .width = tr->width, .height = tr->height, .channels = tr->channels,
+            .data = mapped + (tr->height - 1) * row, .stride = -row,
+            .latency_ns = t - slot->issued_ns,
+        };
+        #if ENABLE_PROBES
+            latency_record(&stage_latency[STAGE_READBACK], thumb.latency_ns);
+        #endif
+        tr->callback(tr->opaque, &thumb);
+        if (!tr->glBufferStorage) {
+            tr->glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+        if (!tr->delivered++) {
+            tr->t_first = t;
+        }
+        tr->t_last = t;
+        tr->latency_ns += thumb.latency_ns;
+        tr->head = (tr->head + 1) % tr->num_slots;
+        tr->count--;
+    }
+    return tr->count;
+}
+
+void thumbnail_reader_uninit(ThumbnailReader *tr) {
+    thumbnail_reader_harvest(tr, true);
+    for (int i = 0;  (i < tr->num_slots) && tr->glBufferStorage;  ++i) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, tr->pbos[i]);
+        tr->glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glDeleteBuffers(tr->num_slots, tr->pbos);
+    glDeleteFramebuffers(1, &tr->fbo);
+    glDeleteRenderbuffers(1, &tr->renderbuffer);
+    double elapsed = (tr->t_last - tr->t_first) * 1e-9;
+    printf("thumbnails: %llu delivered", (unsigned long long)tr->delivered);
+    if ((tr->delivered > 1) && (elapsed > 0.0)) {
+        printf(" (%.2f/s, %.2f MB/s)", (tr->delivered - 1) / elapsed, (tr->delivered - 1) * tr->size * 1e-6 / elapsed);
+    }
+    printf(", %llu skipped, readback latency %.3f ms avg\n", (unsigned long long)tr->skipped,
+           tr->delivered ? (tr->latency_ns * 1e-6 / tr->delivered) : 0.0);
+}
+
+// the built-in thumbnail consumer: a motion score per stream, as the mean
+// absolute difference (0-255) between consecutive thumbnails
+typedef struct MotionMeter {
+    uint8_t *prev[MAX_STREAMS];
+    double sum[MAX_STREAMS], max[MAX_STREAMS];
+    uint64_t count[MAX_STREAMS];
+} MotionMeter;
+
+static void motion_meter_callback(void *opaque, const Thumbnail *thumb) {
+    MotionMeter *mm = opaque;
+    const int s = thumb->stream;
+    const size_t row = (size_t)thumb->width * thumb->channels;
+    if (!mm->prev[s]) {
+        mm->prev[s] = malloc(row * thumb->height);  // once per stream
+        if (!mm->prev[s]) {
+            fail("malloc");
+        }
+    } else {
+        uint64_t diff = 0;
+        for (int y = 0;  y < thumb->height;  ++y) {
+            const uint8_t *a = thumb->data + y * thumb->stride, *b = mm->prev[s] + y * row;
+            for (size_t x = 0;  x < row;  ++x) {
+                diff += (uint64_t)abs((int)a[x] - (int)b[x]);
+            }
+        }
+        double score = (double)diff / (double)(row * thumb->height);
+        mm->sum[s] += score;
+        if (score > mm->max[s]) {
+            mm->max[s] = score;
+        }
+        mm->count[s]++;
+    }
+    for (int y = 0;  y < thumb->height;  ++y) {
+        memcpy(mm->prev[s] + y * row, thumb->data + y * thumb->stride, row);
+    }
+}
+
+void motion_meter_dump(MotionMeter *mm, int num_streams) {
+    for (int s = 0;  s < num_streams;  ++s) {
+        if (mm->count[s]) {
+            printf("stream %d: motion %.2f avg, %.2f max over %llu thumbnails\n", s, mm->sum[s] / mm->count[s],
+                   mm->max[s], (unsigned long long)mm->count[s]);
+        }
+        free(mm->prev[s]);
+        mm->prev[s] = NULL;
+    }
+}
+
+void main_loop(Display* x_display, Stream *streams, int num_streams,
+               EGLDisplay egl_display, EGLSurface egl_surface, bool running,
+               Atom WM_DELETE_WINDOW, int frame_event_fd, ThumbnailReader *thumbs, Scheduler *sched,
+               const VaDevice *devices, const Options *opts)
+{
+  const bool headless = opts->headless;
+  bool paused = false;
+
+  // the loop sleeps in poll() until there's an X11 event, a new decoded
+  // frame, or the timer for the next due frame (or stats dump) expires
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (timer_fd < 0) {
+      fail("timerfd_create");
+  }
+  struct pollfd fds[3] = {
+      { .fd = frame_event_fd, .events = POLLIN },
+      { .fd = timer_fd,       .events = POLLIN },
+      { .fd = headless ? -1 : ConnectionNumber(x_display), .events = POLLIN },
+  };
+
+  const int64_t t_launch = now_ns();
+  int64_t t_start = 0, t_next_stats = t_launch + (int64_t)(opts->stats_interval * 1e9);
+  const bool auto_skip = opts->paced && opts->auto_skip;
+  int64_t t_next_skip = t_launch + (int64_t)SKIP_INTERVAL_MS * 1000000;
+  // when everything decodes as fast as it can, the load says nothing
+  // about the devices, so streams only move during paced playback
+  const bool rebalance = opts->paced && (sched->num_devices > 1);
+  const int held_frames = opts->frame_queue_depth + (opts->serve_path ? SERVER_HELD_FRAMES + SERVER_QUEUE_DEPTH : 0);
+  const bool telemetry = opts->metrics_path || opts->metrics_socket;
+  int64_t t_next_sched = t_launch + (int64_t)SCHED_INTERVAL_MS * 1000000;
+  uint64_t frames = 0;
+  uint64_t alloc_base[NUM_ALLOC_ROLES] = { 0 }, decoded_base = 0;
+  EglFences egl_fences;
+  FenceBackend fence_backend = egl_fence_backend(&egl_fences, egl_display);
+  FrameFences fences;
+  frame_fences_init(&fences, &fence_backend, opts->frames_in_flight);
+  alloc_role = ALLOC_ROLE_DISPLAY;
+  startup_phase_begin(STARTUP_FIRST_PRESENT);
+
+  while (running) {
+      if ((opts->stats_interval > 0.0) && (now_ns() >= t_next_stats)) {
+          alloc_role = ALLOC_ROLE_NONE;  // not part of the frame loop
+          save_latency_json(opts->stats_path, (now_ns() - t_launch) * 1e-9);
+          alloc_role = ALLOC_ROLE_DISPLAY;
+          t_next_stats += (int64_t)(opts->stats_interval * 1e9);
+      }
+      bool redraw = false;
+      if (!headless) {
+          handle_x11_events(x_display, WM_DELETE_WINDOW, &running, &paused, &redraw, streams, num_streams);
+      }
+
+      // return the frames the GPU is done with, then
+      // collect due frames from all streams
+      frame_fences_poll(&fences);
+      for (int i = 0;  i < num_streams;  ++i) {
+          stream_reap_frames(&streams[i], fences.completed);
+      }
+      int64_t wake_at = INT64_MAX;
+      if (thumbs && thumbnail_reader_harvest(thumbs, false)) {
+          wake_at = now_ns() + 1000000;  // check on the queued readbacks again soon
+      }
+      bool updated = false, all_eof = true;
+      for (int i = 0;  (i < num_streams) && !paused;  ++i) {
+          updated |= stream_update(&streams[i], &wake_at);
+          all_eof &= streams[i].eof;
+          if (telemetry) {
+              stream_publish_metrics(&streams[i]);
+          }
+      }
+      if (all_eof && !paused) {
+          break;  // end of all streams
+      }
+      if (auto_skip && !paused && (now_ns() >= t_next_skip)) {
+          skip_control_update(streams, num_streams, now_ns());
+          t_next_skip = now_ns() + (int64_t)SKIP_INTERVAL_MS * 1000000;
+      }
+      if (rebalance && !paused && (now_ns() >= t_next_sched)) {
+          scheduler_update(sched, streams, num_streams, devices, held_frames, now_ns());
+          t_next_sched = now_ns() + (int64_t)SCHED_INTERVAL_MS * 1000000;
+      }
+
+      // if there's nothing to draw, sleep until something happens
+      if (!updated && !redraw) {
+          if ((opts->stats_interval > 0.0) && (t_next_stats < wake_at)) {
+              wake_at = t_next_stats;
+          }
+          if (auto_skip && !paused && (t_next_skip < wake_at)) {
+              wake_at = t_next_skip;
+          }
+          if (rebalance && !paused && (t_next_sched < wake_at)) {
+              wake_at = t_next_sched;
+          }
+          struct itimerspec timer = { { 0, 0 }, { 0, 0 } };  // all zero = disarm
+          if (wake_at != INT64_MAX) {
+              timer.it_value.tv_sec  = wake_at / 1000000000;
+              timer.it_value.tv_nsec = wake_at % 1000000000;
+          }
+          timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+          if (!headless && XPending(x_display)) {
+              continue;  // Xlib has already read events from the socket
+          }
+          if (poll(fds, 3, -1) < 0) {
+              continue;  // interrupted
+          }
+          if (fds[0].revents & POLLIN) { drain_event_fd(frame_event_fd); }
+          if (fds[1].revents & POLLIN) { drain_event_fd(timer_fd); }
+          continue;
+      }
+      PROBE_BEGIN(FRAME);
+
+      // draw all tiles
+      PROBE_BEGIN(DRAW);
+      glClear(GL_COLOR_BUFFER_BIT);
+      while (glGetError()) {}
+      for (int i = 0;  i < num_streams;  ++i) {
+          const Stream *stream = &streams[i];
+          if (!stream->shown && !stream->next) {
+              continue;  // nothing decoded yet
+          }
+          glViewport(stream->viewport[0], stream->viewport[1], stream->viewport[2], stream->viewport[3]);
+          glUseProgram(stream->shader->prog);
+          glUniform2f(stream->shader->scale_location, stream->texcoord_scale[0], stream->texcoord_scale[1]);
+          for (int t = 0;  t < plane_layouts[stream->shader->layout].num_planes;  ++t) {
+              glActiveTexture(GL_TEXTURE0 + t);
+              glBindTexture(GL_TEXTURE_2D, stream->textures[t]);
+          }
+          glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+      }
+      if (glGetError()) { fail("drawing"); }
+      PROBE_END(DRAW);
+      for (int i = 0;  thumbs && (i < num_streams);  ++i) {
+          if (streams[i].next) {
+              thumbnail_reader_issue(thumbs, &streams[i]);
+          }
+      }
+      uint64_t swap = frame_fences_submit(&fences);
+
+      // display the frame; in headless mode, just make sure
+      // the GL gets going, and don't wait for anything
+      PROBE_BEGIN(SWAP);
+      if (headless) {
+          glFlush();
+      } else {
+         eglSwapBuffers(egl_display, egl_surface);
+      }
+      PROBE_END(SWAP);
+      PROBE_END(FRAME);
+      #if ENABLE_PROBES
+      if (opts->live) {
+          // how long the new frames took from the arrival of their packets
+          // until now, when they're on their way to the screen
+          const int64_t t_swap = now_ns();
+          for (int i = 0;  i < num_streams;  ++i) {
+              int64_t t_arrival = streams[i].next ? frame_arrival_time(streams[i].next) : 0;
+              if (t_arrival > 0) {
+                  latency_record(&stage_latency[STAGE_ARRIVAL], t_swap - t_arrival);
+              }
+          }
+      }
+      #endif
+      if (!frames++) {
+          t_start = now_ns();  // don't count the time to the first frame
+          startup_phase_end(STARTUP_FIRST_PRESENT);
+          dump_startup_phases(t_start);
+      }
+      if (frames == ALLOC_WARMUP_FRAMES) {
+          for (int r = 0;  r < NUM_ALLOC_ROLES;  ++r) {
+              alloc_base[r] = atomic_load(&alloc_counts[r]);
+          }
+          for (int i = 0;  i < num_streams;  ++i) {
+              decoded_base += atomic_load(&streams[i].pipeline.decoded);
+          }
+      }
+
+      for (int i = 0;  i < num_streams;  ++i) {
+          stream_frame_shown(&streams[i], swap);
+      }
+  }
+  if (headless && (frames > 1)) {
+      glFinish();
+      double elapsed = (now_ns() - t_start) * 1e-9;
+      uint64_t stream_frames = 0;
+      for (int i = 0;  i < num_streams;  ++i) {
+          stream_frames += streams[i].frames;
+      }
+      printf("\nheadless: %llu frames in %.3f s, %.2f frames/s, %.3f ms/frame",
+             (unsigned long long)frames, elapsed, (frames - 1) / elapsed, elapsed * 1e3 / (frames - 1));
+      if (num_streams > 1) {
+          printf(" (%llu decoded frames from %d streams, %.2f frames/s)",
+                 (unsigned long long)stream_frames, num_streams, stream_frames / elapsed);
+      }
+      printf("\n");
+  }
+  #if ENABLE_PROBES
+  if (opts->live) {
+      const LatencyHistogram *h = &stage_latency[STAGE_ARRIVAL];
+      uint64_t buckets[LATENCY_BUCKETS];
+      uint64_t count = latency_snapshot(h, buckets);
+      if (count) {
+          printf("\nlive: packet arrival to swap %.1f ms avg, %.1f ms p50, %.1f ms p99, %.1f ms max (%llu frames)\n",
+                 atomic_load(&h->sum_ns) * 1e-6 / count, latency_percentile_ms(buckets, count, 50),
+                 latency_percentile_ms(buckets, count, 99), atomic_load(&h->max_ns) * 1e-6,
+                 (unsigned long long)count);
+      }
+  }
+  #endif
+  alloc_role = ALLOC_ROLE_NONE;
+  frame_fences_finish(&fences);
+  for (int i = 0;  i < num_streams;  ++i) {
+      stream_reap_frames(&streams[i], fences.completed);
+  }
+  frame_fences_dump_stats(&fences);
+  uint64_t counted = 0;  // decoded frames since the warm-up
+  for (int i = 0;  (frames > ALLOC_WARMUP_FRAMES) && (i < num_streams);  ++i) {
+      counted += atomic_load(&streams[i].pipeline.decoded);
+  }
+  counted = (counted > decoded_base) ? (counted - decoded_base) : 0;
+  if (opts->count_allocs && counted) {
+      // per decoded frame, not per swap: a swap shows a frame of every
+      // stream, and the same one again when the next isn't due yet
+      printf("\nallocations per decoded frame after %d frames of warm-up:", ALLOC_WARMUP_FRAMES);
+      for (int r = 0;  r < NUM_ALLOC_ROLES;  ++r) {
+          uint64_t n = atomic_load(&alloc_counts[r]) - alloc_base[r];
+          printf(" %s %.2f (%llu)", alloc_role_names[r], (double)n / counted, (unsigned long long)n);
+      }
+      printf("\n");
+  }
+  close(timer_fd);
+  save_latency_json(opts->stats_path, (now_ns() - t_launch) * 1e-9);
+}
+
+// --self-test: the parts of the player that don't need a GPU, against fake
+// backends that count what they're asked to do
+static int self_test_failures;
+
+#define SELF_TEST_CHECK(cond) self_test_check((cond), #cond, __LINE__)
+static void self_test_check(bool ok, const char *what, int line) {
+    if (!ok) {
+        printf("self-test: line %d: %s failed\n", line, what);
+        self_test_failures++;
+    }
+}
+
+// an interop backend that hands out made-up textures instead of importing
+typedef struct FakeInterop {
+    int exports, imports, syncs, releases;
+    GLuint next_texture;
+} FakeInterop;
+
+static void fake_export_surface(void *opaque, VASurfaceID va_surface, VADRMPRIMESurfaceDescriptor *prime) {
+    FakeInterop *fake = opaque;
+    memset(prime, 0, sizeof(*prime));
+    prime->fourcc = VA_FOURCC_NV12;
+    prime->width  = 64 + va_surface;  // so that the entries can be told apart
+    prime->height = 64;
+    fake->exports++;
+}
+
+static void fake_import_surface(void *opaque, VADRMPRIMESurfaceDescriptor *prime, GLuint textures[MAX_PLANES],
+                                EGLImage images[MAX_PLANES]) {
+    FakeInterop *fake = opaque;
+    (void)prime;
+    for (int i = 0;  i < MAX_PLANES;  ++i) {
+        textures[i] = ++fake->next_texture;
+        images[i] = EGL_NO_IMAGE_KHR;
+    }
+    fake->imports++;
+}
+
+static void fake_sync_surface(void *opaque, VASurfaceID va_surface) {
+    FakeInterop *fake = opaque;
+    (void)va_surface;
+    fake->syncs++;
+}
+
+static void fake_release(void *opaque, GLuint textures[MAX_PLANES], EGLImage images[MAX_PLANES]) {
+    FakeInterop *fake = opaque;
+    (void)textures;
+    (void)images;
+    fake->releases++;
+}
+
+static const InteropEntry* self_test_get(InteropCache *cache, AVFrame *frame, VASurfaceID va_surface) {
+    frame->data[3] = (uint8_t*)(uintptr_t)va_surface;
+    return interop_cache_get(cache, frame);
+}
+
+// hits and misses, LRU eviction once the cache is full, the flush when the
+// surface pool changes, and a release for every import in the end
+static void self_test_interop_cache(void) {
+    FakeInterop fake = { 0 };
+    const InteropBackend backend = {
+        .opaque         = &fake,
+        .export_surface = fake_export_surface,
+        .import_surface = fake_import_surface,
+        .sync_surface   = fake_sync_surface,
+        .release        = fake_release,
+    };
+    InteropCache cache;
+    interop_cache_init(&cache, &backend);
+    AVBufferRef *pool_a = av_buffer_alloc(1), *pool_b = av_buffer_alloc(1);  // stand-ins for hw frames contexts
+    AVFrame *frame = av_frame_alloc();
+    if (!pool_a || !pool_b || !frame) {
+        fail("self-test allocation");
+    }
+    frame->hw_frames_ctx = pool_a;
+
+    // surfaces 1..INTEROP_CACHE_SIZE fill the cache, and are imported once each
+    for (int i = 1;  i <= INTEROP_CACHE_SIZE;  ++i) {
+        self_test_get(&cache, frame, i);
+    }
+    SELF_TEST_CHECK((cache.misses == INTEROP_CACHE_SIZE) && (cache.hits == 0));
+    SELF_TEST_CHECK((fake.exports == INTEROP_CACHE_SIZE) && (fake.imports == INTEROP_CACHE_SIZE));
+    const InteropEntry *entry = self_test_get(&cache, frame, 1);
+    SELF_TEST_CHECK((cache.hits == 1) && (fake.imports == INTEROP_CACHE_SIZE));
+    SELF_TEST_CHECK((entry->va_surface == 1) && (entry->width == 65) && (entry->layout == PLANES_NV12));
+    SELF_TEST_CHECK(fake.syncs == INTEROP_CACHE_SIZE + 1);  // every frame, hit or miss
+
+    // surface 1 was just used, so 2 is the least recently used one
+    self_test_get(&cache, frame, INTEROP_CACHE_SIZE + 1);
+    SELF_TEST_CHECK((cache.evictions == 1) && (fake.releases == 1));
+    self_test_get(&cache, frame, 1);
+    SELF_TEST_CHECK((cache.hits == 2) && (cache.evictions == 1));
+    self_test_get(&cache, frame, 2);
+    SELF_TEST_CHECK((cache.misses == INTEROP_CACHE_SIZE + 2) && (cache.evictions == 2) && (fake.releases == 2));
+    self_test_get(&cache, frame, INTEROP_CACHE_SIZE + 1);
+    SELF_TEST_CHECK(cache.hits == 3);
+
+    // the same surface ID from another pool is another surface
+    frame->hw_frames_ctx = pool_b;
+    entry = self_test_get(&cache, frame, 1);
+    SELF_TEST_CHECK((cache.flushes == 1) && (fake.releases == INTEROP_CACHE_SIZE + 2));
+    SELF_TEST_CHECK((fake.imports == INTEROP_CACHE_SIZE + 3) && (entry->va_surface == 1));
+
+    interop_cache_uninit(&cache);
+    SELF_TEST_CHECK(fake.releases == fake.imports);
+    SELF_TEST_CHECK(!cache.frames_ref);
+    frame->hw_frames_ctx = NULL;
+    av_frame_free(&frame);
+    av_buffer_unref(&pool_a);
+    av_buffer_unref(&pool_b);
+}
+
+// a fence backend whose fences only signal when the test says so; a
+// blocking wait for one that hasn't signalled yet stands for the GPU
+// catching up, so it signals it
+#define FAKE_FENCES 16
+typedef struct FakeFences {
+    bool signalled[FAKE_FENCES + 1];  // by fence number, which is the swap's
+    int inserted, destroyed;
+    int blocking_waits, blocked_on;
+} FakeFences;
+
+static void* fake_fence_insert(void *opaque) {
+    FakeFences *fake = opaque;
+    if (fake->inserted >= FAKE_FENCES) {
+        fail("fake fence count check");
+    }
+    return (void*)(uintptr_t)++fake->inserted;
+}
+
+static bool fake_fence_wait(void *opaque, void *fence, int64_t timeout_ns) {
+    FakeFences *fake = opaque;
+    int n = (int)(uintptr_t)fence;
+    if ((timeout_ns < 0) && !fake->signalled[n]) {
+        fake->blocking_waits++;
+        fake->blocked_on = n;
+        fake->signalled[n] = true;
+    }
+    return fake->signalled[n];
+}
+
+static void fake_fence_destroy(void *opaque, void *fence) {
+    FakeFences *fake = opaque;
+    (void)fence;
+    fake->destroyed++;
+}
+
+// fences that signal out of order still retire in order, submit blocks
+// only once depth swaps are in flight, and a stream gives back only the
+// frames of completed swaps
+static void self_test_frame_fences(void) {
+    FakeFences fake = { 0 };
+    const FenceBackend backend = {
+        .opaque  = &fake,
+        .insert  = fake_fence_insert,
+        .wait    = fake_fence_wait,
+        .destroy = fake_fence_destroy,
+    };
+    FrameFences ff;
+    frame_fences_init(&ff, &backend, 3);
+    Stream *stream = calloc(1, sizeof(Stream));
+    AVFrame *frames[6];
+    if (!stream) {
+        fail("self-test allocation");
+    }
+    ring_init(&stream->pipeline.frame_pool, "frame pool", 8);
+    for (int i = 0;  i < 6;  ++i) {
+        if (!(frames[i] = av_frame_alloc())) {
+            fail("self-test allocation");
+        }
+    }
+    // frame i is drawn in swap i + 1, and leaves the screen with the next one
+    for (int i = 0;  i < 3;  ++i) {
+        stream->next = frames[i];
+        stream_frame_shown(stream, frame_fences_submit(&ff));
+    }
+    SELF_TEST_CHECK((ff.submitted == 3) && (ff.completed == 0) && !fake.blocking_waits);
+
+    fake.signalled[2] = true;  // the second swap finishes before the first
+    frame_fences_poll(&ff);
+    SELF_TEST_CHECK(ff.completed == 0);
+    stream_reap_frames(stream, ff.completed);
+    SELF_TEST_CHECK((ring_count(&stream->pipeline.frame_pool) == 0) && (stream->retired_count == 2));
+    fake.signalled[1] = true;
+    frame_fences_poll(&ff);
+    SELF_TEST_CHECK(ff.completed == 2);
+    // frame 0 left the screen with swap 2, frame 1 with swap 3
+    stream_reap_frames(stream, ff.completed);
+    AVFrame *recycled = NULL;
+    SELF_TEST_CHECK((ring_count(&stream->pipeline.frame_pool) == 1) && (stream->retired_count == 1));
+    SELF_TEST_CHECK((ring_pop(&stream->pipeline.frame_pool, (void**)&recycled, 0) > 0) && (recycled == frames[0]));
+    av_frame_free(&recycled);
+
+    // swaps 4 and 5 fit (with 3 still pending), swap 6 has to wait for it
+    for (int i = 3;  i < 6;  ++i) {
+        stream->next = frames[i];
+        stream_frame_shown(stream, frame_fences_submit(&ff));
+        SELF_TEST_CHECK(fake.blocking_waits == ((i < 5) ? 0 : 1));
+    }
+    SELF_TEST_CHECK((fake.blocked_on == 3) && (ff.blocking_waits == 1) && (ff.completed == 3));
+    stream_reap_frames(stream, ff.completed);
+    SELF_TEST_CHECK((ring_count(&stream->pipeline.frame_pool) == 1) && (stream->retired_count == 3));
+    SELF_TEST_CHECK((ring_pop(&stream->pipeline.frame_pool, (void**)&recycled, 0) > 0) && (recycled == frames[1]));
+    av_frame_free(&recycled);
+
+    frame_fences_finish(&ff);
+    SELF_TEST_CHECK((ff.completed == 6) && (fake.destroyed == fake.inserted));
+    stream_reap_frames(stream, ff.completed);
+    SELF_TEST_CHECK((ring_count(&stream->pipeline.frame_pool) == 3) && (stream->retired_count == 0));
+    av_frame_free(&stream->shown);
+    ring_uninit(&stream->pipeline.frame_pool, free_frame_item);
+    free(stream);
+}
+
+bool run_self_test(void) {
+    self_test_interop_cache();
+    self_test_frame_fences();
+    printf("self-test: %s\n", self_test_failures ? "FAILED" : "passed");
+    return !self_test_failures;
+}
+
+int main(int argc, char* argv[]) {
+    startup_t0 = now_ns();
+    Options opts;
+    parse_options(&opts, argc, argv);
+    if (opts.count_allocs && !install_alloc_counter()) {
+        printf("allocation counting needs a build with -fsanitize=address\n");
+        opts.count_allocs = false;
+    }
+    if (opts.subscribe_path) {
+        run_subscriber(opts.subscribe_path, opts.subscribe_policy, opts.subscribe_depth, opts.subscribe_stream);
+        return 0;
+    }
+    if (opts.simulate_scheduler) {
+        return run_scheduler_simulation(&least_loaded_policy) ? 0 : 1;
+    }
+    if (opts.self_test) {
+        return run_self_test() ? 0 : 1;
+    }
+
+    const int num_streams = opts.playlist ? 1 : opts.num_inputs;
+    const int held_frames = opts.frame_queue_depth + (opts.serve_path ? SERVER_HELD_FRAMES + SERVER_QUEUE_DEPTH : 0);
+    Stream *streams = calloc(num_streams, sizeof(Stream));
+    if (!streams) {
+        fail("stream allocation");
+    }
+
+    // in fast-start mode, the demuxers probe the inputs while we set up
+    // the display, the window and the GL
+    StreamOpener openers[MAX_STREAMS];
+    if (opts.fast_start) {
+        for (int i = 0;  i < num_streams;  ++i) {
+            openers[i] = (StreamOpener){ &streams[i], opts.inputs[i], &opts, 0 };
+            if (pthread_create(&openers[i].thread, NULL, stream_open_thread_func, &openers[i])) {
+                fail("pthread_create");
+            }
+        }
+    }
+
+    // the decoding devices: none with --software, the given render nodes,
+    // or else the X server's GPU, or the default render node in headless mode
+    startup_phase_begin(STARTUP_DISPLAY);
+    Display* x_display = NULL;
+    if (!opts.headless) {
+        x_display = open_x11_display();
+    }
+    VaDevice devices[MAX_DEVICES];
+    int num_devices = 0;
+    if (opts.software) {
+        printf("using software decoding\n");
+    } else if (opts.num_render_nodes) {
+        for (int i = 0;  i < opts.num_render_nodes;  ++i) {
+            VADisplay va_display = initialize_vaapi_drm(opts.render_nodes[i]);
+            if (va_display) {
+                va_device_init(&devices[num_devices++], opts.render_nodes[i], va_display);
+            }
+        }
+    } else {
+        const char *name = opts.headless ? "/dev/dri/renderD128" : "X11";
+        VADisplay va_display = opts.headless ? initialize_vaapi_drm(name) : initialize_vaapi(x_display);
+        if (va_display) {
+            va_device_init(&devices[num_devices++], name, va_display);
+        }
+    }
+    startup_phase_end(STARTUP_DISPLAY);
+
+    // a single video gets a window of its own size, a mosaic gets Full HD;
+    // in fast-start mode, we don't know the size yet and resize later
+    int width = 1920, height = 1080;
+    if (!opts.fast_start) {
+        for (int i = 0;  i < num_streams;  ++i) {
+            stream_open_input(&streams[i], opts.inputs[i], &opts);
+        }
+        if ((num_streams == 1) && streams[0].decoder_ctx->width && streams[0].decoder_ctx->height) {
+            width  = streams[0].decoder_ctx->width;
+            height = streams[0].decoder_ctx->height;
+        }
+    }
+
+    Window window = 0;
+    Atom WM_DELETE_WINDOW = 0;
+    EGLDisplay egl_display;
+    EGLSurface egl_surface;
+    EGLContext egl_context;
+    GLuint fbo = 0, renderbuffer = 0;
+    startup_phase_begin(STARTUP_EGL);
+    if (opts.headless) {
+        egl_display = initialize_headless_egl();
+        create_headless_opengl_ctx(&egl_context, egl_display, &egl_surface, &opts);
+    } else {
+        WM_DELETE_WINDOW = create_x11_window(x_display, width, height, &window);
+        egl_display = initialize_egl(x_display);
+        create_opengl_ctx(&egl_context, egl_display, &egl_surface, window, &opts);
+    }
+
+    startup_phase_end(STARTUP_EGL);
+
+    dump_opengl_cfg();
+
+    startup_phase_begin(STARTUP_SHADER);
+    opengl_shader_setup();
+    startup_phase_end(STARTUP_SHADER);
+
+    if (opts.fast_start) {
+        for (int i = 0;  i < num_streams;  ++i) {
+            pthread_join(openers[i].thread, NULL);
+        }
+        if ((num_streams == 1) && streams[0].decoder_ctx->width && streams[0].decoder_ctx->height) {
+            width  = streams[0].decoder_ctx->width;
+            height = streams[0].decoder_ctx->height;
+            if (!opts.headless) {
+                XResizeWindow(x_display, window, width, height);
+            }
+        }
+    }
+
+    // pick the interop mode on the first device, measuring both if we're
+    // asked to; the others are only used if we can import their frames
+    bool separate_layers = (opts.interop_mode != INTEROP_COMPOSED);
+    if (num_devices && (opts.interop_mode == INTEROP_AUTO)) {
+        startup_phase_begin(STARTUP_INTEROP_PROBE);
+        separate_layers = probe_interop_mode(devices[0].va_display, egl_display,
+                                             streams[0].decoder_ctx->width, streams[0].decoder_ctx->height);
+        startup_phase_end(STARTUP_INTEROP_PROBE);
+    }
+    int usable_devices = 0;
+    for (int d = 0;  d < num_devices;  ++d) {
+        if (d && !probe_device_import(devices[d].va_display, egl_display, separate_layers)) {
+            printf("decoding device %s: its frames can't be displayed, not using it\n", devices[d].name);
+            va_device_uninit(&devices[d]);
+            continue;
+        }
+        devices[usable_devices++] = devices[d];
+    }
+    num_devices = usable_devices;
+
+    // spread the streams across the devices, and open their decoders
+    Scheduler sched;
+    scheduler_init(&sched, &least_loaded_policy);
+    for (int d = 0;  d < num_devices;  ++d) {
+        scheduler_add_device(&sched, devices[d].name, devices[d].codecs, devices[d].num_codecs, opts.max_sessions);
+    }
+    for (int i = 0;  i < num_streams;  ++i) {
+        streams[i].index = i;
+        stream_schedule(&streams[i], &sched, devices, held_frames);
+    }
+
+    // set up the interop caches and the software decoding fallbacks;
+    // textures are created per VA surface, or per stream for software frames
+    for (int i = 0;  i < num_streams;  ++i) {
+        int device = sched.streams[i].device;
+        stream_setup_gl(&streams[i], (device != SCHED_SOFTWARE) ? devices[device].va_display : 0, egl_display,
+                        separate_layers, opts.implicit_sync);
+    }
+
+    // initial window size setup; in headless mode, the "window" is an
+    // offscreen framebuffer
+    if (opts.headless) {
+        fbo = create_offscreen_fbo(width, height, &renderbuffer);
+    } else if (!opts.fast_start) {
+        // (after a resize, the ConfigureNotify event takes care of this)
+        GLint vp[4];
+        glGetIntegerv(GL_VIEWPORT, vp);
+        width = vp[2];
+        height = vp[3];
+    }
+    layout_tiles(streams, num_streams, width, height);
+
+    // publish the frames to other processes, if we're asked to
+    FrameServer server;
+    if (opts.serve_path) {
+        frame_server_init(&server, opts.serve_path);
+    }
+
+    // downscaled copies of the frames for CPU-side analysis, if we're asked to
+    ThumbnailReader thumbs;
+    MotionMeter motion = { 0 };
+    if (opts.thumb_width) {
+        thumbnail_reader_init(&thumbs, opts.thumb_width, opts.thumb_height, opts.thumb_luma, num_streams,
+                              motion_meter_callback, &motion);
+    }
+
+    // start the demux and decode threads
+    int frame_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (frame_event_fd < 0) {
+        fail("eventfd");
+    }
+    for (int i = 0;  i < num_streams;  ++i) {
+        Stream *stream = &streams[i];
+        stream->server = opts.serve_path ? &server : NULL;
+        skip_control_init(&stream->skip, opts.paced && opts.auto_skip, now_ns());
+        stream_set_playlist(stream, &opts.inputs[i], opts.playlist ? opts.num_inputs : 1);
+        // (a write to stdout per frame would skew the --headless frame rate,
+        // and the lines of a mosaic's streams would overwrite each other)
+        stream->pipeline.show_progress = !opts.headless && (num_streams == 1);
+        pipeline_start(&stream->pipeline, stream->input_ctx, stream->decoder_ctx, stream->video_stream, frame_event_fd,
+                       stream->live, opts.packet_queue_depth, opts.frame_queue_depth);
+        if (opts.keyframe_index) {
+            keyframe_index_start(&stream->keyframes, stream->url, stream->video_stream, stream->time_base);
+        }
+        if (opts.start_seconds > 0.0) {
+            stream_seek(stream, opts.start_seconds, false);
+        }
+    }
+
+    // live metrics, if we're asked for them
+    Telemetry telemetry;
+    if (opts.metrics_path || opts.metrics_socket) {
+        telemetry_start(&telemetry, streams, num_streams, opts.metrics_path, opts.metrics_socket);
+    }
+
+    // main loop
+    bool running = true;
+    main_loop(x_display, streams, num_streams, egl_display, egl_surface, running,
+              WM_DELETE_WINDOW, frame_event_fd, opts.thumb_width ? &thumbs : NULL, &sched, devices, &opts);
+
+    // clean up all the mess we made
+    if (opts.thumb_width) {
+        thumbnail_reader_uninit(&thumbs);
+        motion_meter_dump(&motion, num_streams);
+    }
+    if (opts.serve_path) {
+        frame_server_uninit(&server);
+    }
+    if (opts.metrics_path || opts.metrics_socket) {
+        telemetry_stop(&telemetry);
+    }
+    for (int i = 0;  i < num_streams;  ++i) {
+        stream_close(&streams[i]);
+    }
+    scheduler_dump_stats(&sched);
+    free(streams);
+    close(frame_event_fd);
+    if (fbo) {
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteRenderbuffers(1, &renderbuffer);
+    }
+    opengl_shader_uninit();
+    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(egl_display, egl_context);
+    if (egl_surface != EGL_NO_SURFACE) {
+        eglDestroySurface(egl_display, egl_surface);
+    }
+    eglTerminate(egl_display);
+    if (x_display) {
+        XDestroyWindow(x_display, window);
+        XCloseDisplay(x_display);
+    }
+    for (int d = 0;  d < num_devices;  ++d) {
+        va_device_uninit(&devices[d]);
+    }
 	// TODO: TO HERE
     printf("\nBye.\n");
     return 0;